@@ -0,0 +1,324 @@
+//==--- tools/clang-check/ClangInterpreter.cpp - Clang Interpreter tool --------------===//
+//===----------------------------------------------------------------------===//
+
+#include "clang/AST/ASTConsumer.h"
+#include "clang/AST/EvaluatedExprVisitor.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/FrontendAction.h"
+#include "clang/Frontend/TextDiagnosticPrinter.h"
+#include "clang/Tooling/Tooling.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+using namespace clang;
+
+#include "Environment.h"
+#include "BytecodeCompiler.h"
+#include "BytecodeInterpreter.h"
+#include "BytecodeJIT.h"
+#include "Profiler.h"
+#include "ProgramCache.h"
+#include "TestRunner.h"
+
+static llvm::cl::opt<std::string>
+Code(llvm::cl::Positional, llvm::cl::desc("<program>"));
+
+static llvm::cl::opt<std::string>
+ProgramFile("file",
+            llvm::cl::desc("Read the program from this file instead of the command line"),
+            llvm::cl::value_desc("file"));
+
+static llvm::cl::opt<std::string>
+CacheDir("cache-dir",
+         llvm::cl::desc("Keep the compiled program in this directory, and run it from there without parsing it again"),
+         llvm::cl::value_desc("dir"));
+
+static llvm::cl::opt<bool>
+DebugHeap("debug-heap",
+          llvm::cl::desc("Check every memory access and FREE, and never reuse a freed block"),
+          llvm::cl::init(false));
+
+static llvm::cl::opt<std::string>
+InputFile("input",
+          llvm::cl::desc("Read the integers of GET from this file"),
+          llvm::cl::value_desc("file"));
+
+static llvm::cl::opt<bool>
+NoPrompt("no-prompt",
+         llvm::cl::desc("Do not prompt for GET, read stdin or -input as a whole"),
+         llvm::cl::init(false));
+
+static llvm::cl::opt<unsigned>
+JITThreshold("jit-threshold",
+             llvm::cl::desc("Compile a function to native code after this many calls and loop iterations, 0 never"),
+             llvm::cl::init(1000));
+
+static llvm::cl::opt<bool>
+Profile("profile",
+        llvm::cl::desc("Report the time and executions of every function and statement"),
+        llvm::cl::init(false));
+
+static llvm::cl::opt<std::string>
+ProfileFolded("profile-folded",
+              llvm::cl::desc("Profile, and write the folded stacks for flame graph tools to this file"),
+              llvm::cl::value_desc("file"));
+
+static llvm::cl::opt<bool>
+WalkAST("walk-ast",
+        llvm::cl::desc("Walk the AST instead of compiling the program to bytecode"),
+        llvm::cl::init(false));
+
+static llvm::cl::list<std::string>
+RunTests("run-tests",
+         llvm::cl::desc("Run these programs, or the .c files of these directories, in parallel and report on them"),
+         llvm::cl::value_desc("path"), llvm::cl::CommaSeparated);
+
+static llvm::cl::opt<unsigned>
+TestThreads("test-threads",
+            llvm::cl::desc("Number of threads of -run-tests (0 = one per core)"),
+            llvm::cl::init(0));
+
+/// One run of a program: where GET, PRINT and the errors go, and how it went
+struct ProgramRun {
+   llvm::raw_ostream * out;
+   llvm::raw_ostream * log;
+   std::string input;		/// GET reads this file if not empty
+   bool isInteractive;		/// else the terminal, or stdin with -no-prompt; else GET gives 0
+   std::string cacheKey;	/// the compiled program is stored in -cache-dir under it, if not empty
+   bool isSucceeded;
+
+   ProgramRun(llvm::raw_ostream & os, llvm::raw_ostream & errors)
+   : out(&os), log(&errors), input(), isInteractive(true), cacheKey(), isSucceeded(false) {
+   }
+};
+
+static bool setUpIO(ProgramIO & io, const ProgramRun & run) {
+   io.setPrompt(run.isInteractive && !NoPrompt);
+   if (!run.isInteractive && run.input.empty())
+	   io.setInput(llvm::MemoryBuffer::getMemBuffer("", "<no input>"));
+   std::string error;
+   if (!run.input.empty() && !io.openInput(run.input, error)) {
+	   *run.log << "error: " << error << "\n";
+	   return false;
+   }
+   return true;
+}
+
+static void writeProfile(const Profiler & profiler, llvm::raw_ostream & log) {
+   if (Profile)
+	   profiler.report(log);
+   if (ProfileFolded.empty())
+	   return;
+   std::error_code EC;
+   llvm::raw_fd_ostream os(ProfileFolded, EC, llvm::sys::fs::F_None);
+   if (EC) {
+	   log << "error: " << ProfileFolded << ": " << EC.message() << "\n";
+	   return;
+   }
+   profiler.writeFolded(os);
+}
+
+/// Run the compiled program, whether just compiled or loaded from the cache
+static bool runBytecode(const BytecodeProgram & program, Heap & heap, ValueStack & stack, ProgramIO & io,
+                        const ProgramRun & run) {
+   BytecodeInterpreter interpreter(heap, stack, io);
+   /// native code does not check the accesses, nor is it profiled
+   BytecodeJIT jit;
+   Profiler profiler;
+   bool isProfiled = Profile || !ProfileFolded.empty();
+   if (isProfiled)
+	   interpreter.setProfiler(&profiler);
+   else if (JITThreshold != 0 && !DebugHeap)
+	   interpreter.setCompiler(&jit, JITThreshold);
+   bool isSucceeded = interpreter.run(program);
+   io.flush();
+   if (!isSucceeded)
+	   *run.log << "error: " << interpreter.getError() << "\n";
+   if (isProfiled)
+	   writeProfile(profiler, *run.log);
+   return isSucceeded;
+}
+
+class InterpreterVisitor : 
+   public EvaluatedExprVisitor<InterpreterVisitor> {
+public:
+   explicit InterpreterVisitor(const ASTContext &context, Environment * env)
+   : EvaluatedExprVisitor(context), mEnv(env) {}
+   virtual ~InterpreterVisitor() {}
+
+   /// nothing more runs once the Environment has an error
+   void VisitStmt(Stmt * stmt) {
+	   if (!mEnv->hasError())
+		   EvaluatedExprVisitor::VisitStmt(stmt);
+   }
+   virtual void VisitBinaryOperator (BinaryOperator * bop) {
+	   VisitStmt(bop);
+	   if (!mEnv->hasError())
+		   mEnv->binop(bop);
+   }
+   virtual void VisitDeclRefExpr(DeclRefExpr * expr) {
+	   VisitStmt(expr);
+	   if (!mEnv->hasError())
+		   mEnv->declref(expr);
+   }
+   virtual void VisitCastExpr(CastExpr * expr) {
+	   VisitStmt(expr);
+	   if (!mEnv->hasError())
+		   mEnv->cast(expr);
+   }
+   virtual void VisitCallExpr(CallExpr * call) {
+	   VisitStmt(call);
+	   if (mEnv->hasError())
+		   return;
+	   if (FunctionDecl * callee = mEnv->call(call)) {
+		   VisitStmt(callee->getBody());
+		   if (!mEnv->hasError())
+			   mEnv->leave(call);
+	   }
+   }
+   virtual void VisitReturnStmt(ReturnStmt * retstmt) {
+	   VisitStmt(retstmt);
+	   if (!mEnv->hasError())
+		   mEnv->ret(retstmt);
+   }
+   virtual void VisitDeclStmt(DeclStmt * declstmt) {
+	   if (!mEnv->hasError())
+		   mEnv->decl(declstmt);
+   }
+private:
+   Environment * mEnv;
+};
+
+class InterpreterConsumer : public ASTConsumer {
+public:
+   InterpreterConsumer(const ASTContext& context, ProgramRun & run) : mEnv(*run.out),
+   	   mVisitor(context, &mEnv), mRun(run) {
+   }
+   virtual ~InterpreterConsumer() {}
+
+   virtual void HandleTranslationUnit(clang::ASTContext &Context) {
+	   TranslationUnitDecl * decl = Context.getTranslationUnitDecl();
+	   mEnv.init(decl);
+	   mEnv.getHeap().setDebug(DebugHeap);
+	   if (!setUpIO(mEnv.getIO(), mRun))
+		   return;
+
+	   /// Every function is compiled once to bytecode, a program the compiler
+	   /// does not support fails; the AST is only walked with -walk-ast
+	   if (!WalkAST) {
+		   BytecodeCompiler compiler(Context);
+		   BytecodeProgram program;
+		   if (!compiler.compile(decl, program)) {
+			   *mRun.log << "error: " << compiler.getError() << "\n";
+			   return;
+		   }
+		   std::string error;
+		   if (!mRun.cacheKey.empty() && !Context.getDiagnostics().hasErrorOccurred() &&
+		       !ProgramCache(CacheDir).store(mRun.cacheKey, program, error))
+			   *mRun.log << "warning: " << error << ", not cached\n";
+		   mRun.isSucceeded = runBytecode(program, mEnv.getHeap(), mEnv.getValueStack(), mEnv.getIO(), mRun);
+		   return;
+	   }
+
+	   FunctionDecl * entry = mEnv.getEntry();
+	   mVisitor.VisitStmt(entry->getBody());
+	   mEnv.getIO().flush();
+	   if (mEnv.hasError()) {
+		   *mRun.log << "error: " << mEnv.getError() << "\n";
+		   return;
+	   }
+	   mRun.isSucceeded = true;
+  }
+private:
+   Environment mEnv;
+   InterpreterVisitor mVisitor;
+   ProgramRun & mRun;
+};
+
+class InterpreterClassAction : public ASTFrontendAction {
+public: 
+  explicit InterpreterClassAction(ProgramRun & run) : mRun(run) {}
+
+  /// the diagnostics of a program of -run-tests go to its log
+  virtual bool BeginInvocation(clang::CompilerInstance &Compiler) {
+    if (mRun.log != &llvm::errs())
+      Compiler.getDiagnostics().setClient(
+          new TextDiagnosticPrinter(*mRun.log, &Compiler.getDiagnosticOpts()), true);
+    return true;
+  }
+  virtual std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(
+    clang::CompilerInstance &Compiler, llvm::StringRef InFile) {
+    return std::unique_ptr<clang::ASTConsumer>(
+        new InterpreterConsumer(Compiler.getASTContext(), mRun));
+  }
+private:
+  ProgramRun & mRun;
+};
+
+static bool readProgram(const std::string & path, std::string & code, llvm::raw_ostream & log) {
+   llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFile(path);
+   if (!buffer) {
+       log << "error: " << path << ": " << buffer.getError().message() << "\n";
+       return false;
+   }
+   code = (*buffer)->getBuffer().str();
+   return true;
+}
+
+/// Run code, the program in path or "" for the command line
+static bool runProgram(const std::string & path, const std::string & code, ProgramRun & run) {
+   /// A program compiled before runs straight from the cache, without Clang
+   if (!CacheDir.empty() && !WalkAST) {
+       run.cacheKey = ProgramCache::getKey(path, code);
+       BytecodeProgram program;
+       if (ProgramCache(CacheDir).load(run.cacheKey, program)) {
+           Heap heap;
+           ValueStack stack;
+           ProgramIO io(*run.out);
+           heap.setDebug(DebugHeap);
+           return setUpIO(io, run) && runBytecode(program, heap, stack, io, run);
+       }
+   }
+   /// parsed as C++ like a program given on the command line, named by its file
+   bool isParsed;
+   if (path.empty())
+       isParsed = clang::tooling::runToolOnCode(new InterpreterClassAction(run), code);
+   else
+       isParsed = clang::tooling::runToolOnCodeWithArgs(new InterpreterClassAction(run), code,
+                                                        std::vector<std::string>(1, "-xc++"), path);
+   return isParsed && run.isSucceeded;
+}
+
+/// A program of -run-tests, on its own Environment, heap and buffers
+static bool runTest(const std::string & path, const std::string & input,
+                    llvm::raw_ostream & out, llvm::raw_ostream & log) {
+   std::string code;
+   if (!readProgram(path, code, log))
+       return false;
+   ProgramRun run(out, log);
+   run.input = input;
+   run.isInteractive = false;
+   return runProgram(path, code, run);
+}
+
+int main (int argc, char ** argv) {
+   llvm::cl::ParseCommandLineOptions(argc, argv, "ast-interpreter\n");
+   if (!RunTests.empty()) {
+       if (!Code.empty() || !ProgramFile.empty() || !InputFile.empty() || Profile || !ProfileFolded.empty()) {
+           llvm::errs() << "error: -run-tests takes its programs and inputs from its paths, and is not profiled\n";
+           return 1;
+       }
+       TestRunner runner;
+       return runner.run(RunTests, TestThreads, runTest, llvm::outs()) ? 0 : 1;
+   }
+
+   std::string code = Code;
+   if (!ProgramFile.empty() && !readProgram(ProgramFile, code, llvm::errs()))
+       return 1;
+   if (code.empty())
+       return 0;
+   ProgramRun run(llvm::errs(), llvm::errs());
+   run.input = InputFile;
+   return runProgram(ProgramFile, code, run) ? 0 : 1;
+}
@@ -0,0 +1,116 @@
+//==--- Bytecode.h - Register bytecode of the interpreted functions ----------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_BYTECODE_H
+#define AST_INTERPRETER_BYTECODE_H
+
+#include <string>
+#include <vector>
+
+#include "llvm/Support/raw_ostream.h"
+
+/// Every instruction has three operands a, b and c. Registers are numbered
+/// from the frame of the running function, the parameters come first.
+/// Jump targets are instruction indexes in the function.
+#define BYTECODE_OPCODES(X) \
+   X(MOV)      /* a = b */ \
+   X(LOADK)    /* a = constant b */ \
+   X(ADD)      /* a = b + c */ \
+   X(SUB)      \
+   X(MUL)      \
+   X(DIV)      \
+   X(REM)      \
+   X(ADDI)     /* a = b + constant c */ \
+   X(MULI)     /* a = b * constant c */ \
+   X(NEG)      /* a = -b */ \
+   X(NOT)      /* a = !b */ \
+   X(SEXT8)    /* a = (char)b */ \
+   X(LT)       /* a = b < c */ \
+   X(GT)       \
+   X(LE)       \
+   X(GE)       \
+   X(EQ)       \
+   X(NE)       \
+   X(LOAD)     /* a = int at address b */ \
+   X(LOADB)    /* a = char at address b */ \
+   X(STORE)    /* int at address a = b */ \
+   X(STOREB)   /* char at address a = b */ \
+   X(GADDR)    /* a = address of the globals + constant b */ \
+   X(FADDR)    /* a = address of the frame memory + constant b */ \
+   X(JMP)      /* goto a */ \
+   X(JZ)       /* if (!a) goto b */ \
+   X(JNZ)      /* if (a) goto b */ \
+   X(CALL)     /* a = function b, its frame starts at register c of the caller */ \
+   X(RET)      /* return a */ \
+   X(RETV)     /* return */ \
+   X(GET)      /* a = GET() */ \
+   X(PRINT)    /* PRINT(a) */ \
+   X(MALLOC)   /* a = MALLOC(b) */ \
+   X(FREE)     /* FREE(a) */
+
+enum Opcode {
+#define BYTECODE_ENUM(name) OP_##name,
+   BYTECODE_OPCODES(BYTECODE_ENUM)
+#undef BYTECODE_ENUM
+   OP_COUNT
+};
+
+struct Instruction {
+   Opcode op;
+   int a, b, c;
+};
+
+/// A FunctionDecl body lowered once, run by BytecodeInterpreter
+struct BytecodeFunction {
+   std::string name;
+   std::string location;         /// file:line:col of the FunctionDecl
+   int numParams;
+   int numRegs;                  /// parameters, locals and temporaries
+   int frameBytes;               /// local arrays and address-taken scalars, allocated for every call
+   std::vector<Instruction> code;
+   std::vector<int> stmts;       /// the statement of every instruction, -1 for none
+
+   BytecodeFunction() : numParams(0), numRegs(0), frameBytes(0) {
+   }
+
+   static const char * getOpcodeName(Opcode op) {
+      static const char * const names[] = {
+#define BYTECODE_NAME(name) #name,
+         BYTECODE_OPCODES(BYTECODE_NAME)
+#undef BYTECODE_NAME
+      };
+      return names[op];
+   }
+   void dump(llvm::raw_ostream & os) const {
+      os << name << ": params " << numParams << ", registers " << numRegs
+         << ", frame " << frameBytes << " bytes\n";
+      for (size_t i = 0; i < code.size(); ++ i) {
+         os << "  " << i << "\t" << getOpcodeName(code[i].op) << "\t"
+            << code[i].a << ", " << code[i].b << ", " << code[i].c << "\n";
+      }
+   }
+};
+
+struct GlobalInit {
+   int offset;
+   int size;                     /// 1 for a char
+   int value;
+};
+
+/// A Stmt of the source, what the profile is reported by
+struct StatementInfo {
+   std::string location;         /// file:line:col
+   std::string kind;             /// the Stmt class
+};
+
+struct BytecodeProgram {
+   std::vector<BytecodeFunction> functions;
+   int entry;
+   int globalBytes;
+   std::vector<GlobalInit> globalInits;
+   std::vector<StatementInfo> statements;
+
+   BytecodeProgram() : functions(), entry(-1), globalBytes(0), globalInits(), statements() {
+   }
+};
+
+#endif
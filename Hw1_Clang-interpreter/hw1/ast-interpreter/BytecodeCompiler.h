@@ -0,0 +1,909 @@
+//==--- BytecodeCompiler.h - Lowering of the Clang AST to bytecode -----------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_BYTECODECOMPILER_H
+#define AST_INTERPRETER_BYTECODECOMPILER_H
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "clang/AST/ASTContext.h"
+#include "clang/AST/Decl.h"
+#include "clang/AST/Expr.h"
+#include "clang/AST/Stmt.h"
+#include "clang/Basic/Version.h"
+
+#include "Bytecode.h"
+
+using namespace clang;
+
+/// Compiles every function of a translation unit once into a BytecodeProgram.
+///
+/// Parameters and scalar locals live in registers, local arrays and the scalars
+/// whose address is taken in the frame memory of the call and globals in the
+/// global memory. Temporaries take the registers above the locals and are
+/// given back after each statement. A construct out of the supported C subset
+/// makes compile() fail with the reason in getError().
+///
+/// Constant subtrees, sizeof and casts of constants are folded to one LOADK.
+/// Before a loop, the expressions of it that only read constants and registers
+/// the loop never writes are computed once into registers held for the loop.
+class BytecodeCompiler {
+   /// Where an lvalue is: a register, or memory at the address in a register
+   struct LValue {
+      int reg;
+      bool isMemory;
+      int size;                     /// bytes read or written, 1 or 4
+   };
+
+   ASTContext & mContext;
+   BytecodeProgram * mProgram;
+   std::string mError;
+
+   FunctionDecl * mFree;            /// Declartions to the built-in functions
+   FunctionDecl * mMalloc;
+   FunctionDecl * mInput;
+   FunctionDecl * mOutput;
+   std::map<const FunctionDecl *, int> mFunctions;
+   std::map<const VarDecl *, int> mGlobals;
+
+   /// The function being compiled
+   BytecodeFunction * mFunction;
+   std::map<const VarDecl *, int> mLocals;
+   std::map<const VarDecl *, int> mFrameVars;      /// offsets in the frame memory
+   std::set<const VarDecl *> mAddressed;           /// locals and parameters whose address is taken
+   int mNextReg;
+   int mLabel;                      /// the last jump target
+   int mStatement;                  /// what the emitted instructions belong to
+   std::vector<std::vector<size_t> > mBreaks;
+   std::vector<std::vector<size_t> > mContinues;
+   std::map<const Expr *, int> mHoisted;   /// loop invariants of the loops being compiled
+
+   bool evaluateInt(const Expr * expr, int & val) {
+#if CLANG_VERSION_MAJOR >= 8
+      Expr::EvalResult result;
+      if (!expr->EvaluateAsInt(result, mContext))
+         return false;
+      val = (int)result.Val.getInt().getSExtValue();
+#else
+      llvm::APSInt result;
+      if (!expr->EvaluateAsInt(result, mContext))
+         return false;
+      val = (int)result.getSExtValue();
+#endif
+      return true;
+   }
+   std::string getLocation(const Decl * decl) {
+#if CLANG_VERSION_MAJOR >= 8
+      return decl->getBeginLoc().printToString(mContext.getSourceManager());
+#else
+      return decl->getLocStart().printToString(mContext.getSourceManager());
+#endif
+   }
+   int addStatement(const Stmt * stmt) {
+      StatementInfo info;
+#if CLANG_VERSION_MAJOR >= 8
+      info.location = stmt->getBeginLoc().printToString(mContext.getSourceManager());
+#else
+      info.location = stmt->getLocStart().printToString(mContext.getSourceManager());
+#endif
+      info.kind = stmt->getStmtClassName();
+      mProgram->statements.push_back(info);
+      return mProgram->statements.size() - 1;
+   }
+   int getSize(QualType type) {
+      return (int)mContext.getTypeSizeInChars(type).getQuantity();
+   }
+   /// chars are a byte in memory, ints and pointers 4
+   int getAccessSize(QualType type) {
+      return getSize(type) == 1 ? 1 : 4;
+   }
+   static int align(int offset) {
+      return (offset + 7) & ~7;
+   }
+
+   int fail(const Stmt * stmt, const std::string & what) {
+      if (mError.empty()) {
+         mError = what;
+         if (stmt != NULL)
+            mError += std::string(" ") + stmt->getStmtClassName();
+         if (mFunction != NULL)
+            mError += " in " + mFunction->name;
+      }
+      return 0;
+   }
+
+   size_t emit(Opcode op, int a = 0, int b = 0, int c = 0) {
+      Instruction inst = { op, a, b, c };
+      mFunction->code.push_back(inst);
+      mFunction->stmts.push_back(mStatement);
+      return mFunction->code.size() - 1;
+   }
+   int label() {
+      mLabel = mFunction->code.size();
+      return mLabel;
+   }
+   /// jump from at to target
+   void patch(size_t at, int target) {
+      Instruction & inst = mFunction->code[at];
+      if (inst.op == OP_JMP)
+         inst.a = target;
+      else
+         inst.b = target;
+   }
+   void patchAll(std::vector<size_t> & jumps, int target) {
+      for (size_t i = 0; i < jumps.size(); ++ i)
+         patch(jumps[i], target);
+   }
+   int newReg() {
+      int reg = mNextReg ++;
+      if (mNextReg > mFunction->numRegs)
+         mFunction->numRegs = mNextReg;
+      return reg;
+   }
+
+   static bool writesA(Opcode op) {
+      switch (op) {
+      case OP_STORE: case OP_STOREB: case OP_JMP: case OP_JZ: case OP_JNZ:
+      case OP_RET: case OP_RETV: case OP_PRINT: case OP_FREE:
+         return false;
+      default:
+         return true;
+      }
+   }
+   /// Compute expr into dst, the last instruction writes dst directly when it can
+   void compileInto(Expr * expr, int dst) {
+      int mark = mNextReg;
+      int reg = compileExpr(expr);
+      Instruction * last = mFunction->code.empty() ? NULL : &mFunction->code.back();
+      if (reg == dst)
+         return;
+      if (reg >= mark && last != NULL && last->a == reg && writesA(last->op)
+            && mLabel != (int)mFunction->code.size())
+         last->a = dst;
+      else
+         emit(OP_MOV, dst, reg);
+   }
+
+   void allocateGlobal(VarDecl * var) {
+      int offset = align(mProgram->globalBytes);
+      mProgram->globalBytes = offset + std::max(getSize(var->getType()), 1);
+      mGlobals[var->getCanonicalDecl()] = offset;
+
+      if (const Expr * init = var->getInit()) {
+         GlobalInit value = { offset, getAccessSize(var->getType()), 0 };
+         if (var->getType()->isArrayType() || !evaluateInt(init, value.value))
+            fail(init, "unsupported initializer");
+         mProgram->globalInits.push_back(value);
+      }
+   }
+   int allocateFrame(VarDecl * var) {
+      int offset = align(mFunction->frameBytes);
+      mFunction->frameBytes = offset + getSize(var->getType());
+      return offset;
+   }
+   /// frame[offset] = reg, in the access size of var
+   void storeFrame(VarDecl * var, int offset, int reg) {
+      int addr = newReg();
+      emit(OP_FADDR, addr, offset);
+      emit(getAccessSize(var->getType()) == 1 ? OP_STOREB : OP_STORE, addr, reg);
+   }
+   void allocateLocal(VarDecl * var) {
+      if (var->hasGlobalStorage()) {
+         allocateGlobal(var);
+      }
+      else if (var->getType()->isArrayType()) {
+         mFrameVars[var] = allocateFrame(var);
+         if (var->getInit() != NULL)
+            fail(var->getInit(), "unsupported initializer");
+      }
+      else if (mAddressed.count(var)) {
+         int offset = allocateFrame(var);
+         mFrameVars[var] = offset;
+         int mark = mNextReg;
+         int reg = newReg();
+         if (Expr * init = var->getInit())
+            compileInto(init, reg);
+         else
+            emit(OP_LOADK, reg, 0);
+         storeFrame(var, offset, reg);
+         mNextReg = mark;
+      }
+      else {
+         int reg = newReg();
+         mLocals[var] = reg;
+         if (Expr * init = var->getInit())
+            compileInto(init, reg);
+         else
+            emit(OP_LOADK, reg, 0);
+      }
+   }
+
+   /// the locals and parameters stmt takes the address of
+   static void collectAddressed(Stmt * stmt, std::set<const VarDecl *> & addressed) {
+      if (stmt == NULL)
+         return;
+      UnaryOperator * uop = dyn_cast<UnaryOperator>(stmt);
+      if (uop != NULL && uop->getOpcode() == UO_AddrOf) {
+         if (DeclRefExpr * ref = dyn_cast<DeclRefExpr>(uop->getSubExpr()->IgnoreParens()))
+            if (VarDecl * var = dyn_cast<VarDecl>(ref->getDecl()))
+               if (!var->hasGlobalStorage() && !var->getType()->isArrayType())
+                  addressed.insert(var);
+      }
+      for (Stmt::child_iterator it = stmt->child_begin(), ie = stmt->child_end(); it != ie; ++ it)
+         collectAddressed(*it, addressed);
+   }
+   /// the locals stmt assigns or takes the address of
+   static void collectWrites(Stmt * stmt, std::set<const VarDecl *> & writes) {
+      if (stmt == NULL)
+         return;
+      Expr * target = NULL;
+      if (BinaryOperator * bop = dyn_cast<BinaryOperator>(stmt)) {
+         if (bop->isAssignmentOp())
+            target = bop->getLHS();
+      }
+      else if (UnaryOperator * uop = dyn_cast<UnaryOperator>(stmt)) {
+         if (uop->isIncrementDecrementOp() || uop->getOpcode() == UO_AddrOf)
+            target = uop->getSubExpr();
+      }
+      if (target != NULL) {
+         if (DeclRefExpr * ref = dyn_cast<DeclRefExpr>(target->IgnoreParens()))
+            if (VarDecl * var = dyn_cast<VarDecl>(ref->getDecl()))
+               writes.insert(var);
+      }
+      for (Stmt::child_iterator it = stmt->child_begin(), ie = stmt->child_end(); it != ie; ++ it)
+         collectWrites(*it, writes);
+   }
+   /// expr reads only constants and registers out of writes, and can not trap
+   bool isInvariant(Expr * expr, const std::set<const VarDecl *> & writes) {
+      expr = expr->IgnoreParens();
+      if (mHoisted.count(expr))
+         return true;
+      if (!expr->getType()->isIntegerType() && !expr->getType()->isPointerType())
+         return false;
+      if (isa<IntegerLiteral>(expr) || isa<CharacterLiteral>(expr) || isa<UnaryExprOrTypeTraitExpr>(expr))
+         return true;
+      if (DeclRefExpr * ref = dyn_cast<DeclRefExpr>(expr)) {
+         if (isa<EnumConstantDecl>(ref->getDecl()))
+            return true;
+         VarDecl * var = dyn_cast<VarDecl>(ref->getDecl());
+         return var != NULL && mLocals.count(var) && !writes.count(var);
+      }
+      if (CastExpr * cast = dyn_cast<CastExpr>(expr)) {
+         switch (cast->getCastKind()) {
+         case CK_LValueToRValue:
+         case CK_IntegralCast:
+         case CK_IntegralToBoolean:
+         case CK_NoOp:
+            return isInvariant(cast->getSubExpr(), writes);
+         default:
+            return false;
+         }
+      }
+      if (UnaryOperator * uop = dyn_cast<UnaryOperator>(expr)) {
+         UnaryOperatorKind opc = uop->getOpcode();
+         return (opc == UO_Minus || opc == UO_LNot || opc == UO_Plus) && isInvariant(uop->getSubExpr(), writes);
+      }
+      if (BinaryOperator * bop = dyn_cast<BinaryOperator>(expr)) {
+         int val;
+         switch (bop->getOpcode()) {
+         case BO_Div:
+         case BO_Rem:
+            if (!evaluateInt(bop->getRHS(), val) || val == 0)
+               return false;
+            return isInvariant(bop->getLHS(), writes);
+         case BO_Add: case BO_Sub: case BO_Mul:
+         case BO_LT: case BO_GT: case BO_LE: case BO_GE: case BO_EQ: case BO_NE:
+            return isInvariant(bop->getLHS(), writes) && isInvariant(bop->getRHS(), writes);
+         default:
+            return false;
+         }
+      }
+      return false;
+   }
+   /// a variable read is its register already, nothing to hoist
+   static bool isRegisterRead(Expr * expr) {
+      for (;;) {
+         expr = expr->IgnoreParens();
+         CastExpr * cast = dyn_cast<CastExpr>(expr);
+         if (cast == NULL || (cast->getCastKind() != CK_LValueToRValue && cast->getCastKind() != CK_NoOp))
+            break;
+         expr = cast->getSubExpr();
+      }
+      return isa<DeclRefExpr>(expr);
+   }
+   /// compute the largest invariant expressions of stmt into registers; the
+   /// constants compileArith and compileOffset take as immediates stay there
+   void hoist(Stmt * stmt, const std::set<const VarDecl *> & writes, std::vector<const Expr *> & hoisted) {
+      if (stmt == NULL)
+         return;
+      if (Expr * expr = dyn_cast<Expr>(stmt)) {
+         expr = expr->IgnoreParens();
+         if (!mHoisted.count(expr) && !isRegisterRead(expr) && isInvariant(expr, writes)) {
+            int reg = newReg();
+            int mark = mNextReg;
+            compileInto(expr, reg);
+            mNextReg = mark;
+            mHoisted[expr] = reg;
+            hoisted.push_back(expr);
+            return;
+         }
+         int val;
+         BinaryOperator * bop = dyn_cast<BinaryOperator>(expr);
+         if (bop != NULL && !bop->isAssignmentOp()) {
+            BinaryOperatorKind opc = bop->getOpcode();
+            if ((opc == BO_Add || opc == BO_Sub || opc == BO_Mul) && evaluateInt(bop->getRHS(), val)) {
+               hoist(bop->getLHS(), writes, hoisted);
+               return;
+            }
+            if (opc == BO_Add && bop->getRHS()->getType()->isPointerType() && evaluateInt(bop->getLHS(), val)) {
+               hoist(bop->getRHS(), writes, hoisted);
+               return;
+            }
+         }
+         ArraySubscriptExpr * subscript = dyn_cast<ArraySubscriptExpr>(expr);
+         if (subscript != NULL && evaluateInt(subscript->getIdx(), val)) {
+            hoist(subscript->getBase(), writes, hoisted);
+            return;
+         }
+      }
+      for (Stmt::child_iterator it = stmt->child_begin(), ie = stmt->child_end(); it != ie; ++ it)
+         hoist(*it, writes, hoisted);
+   }
+
+   void compileLoop(Stmt * body, Expr * cond, Expr * inc, bool isDo) {
+      mBreaks.push_back(std::vector<size_t>());
+      mContinues.push_back(std::vector<size_t>());
+
+      /// the registers of the invariants live until the loop is done
+      int mark = mNextReg;
+      std::set<const VarDecl *> writes;
+      collectWrites(body, writes);
+      collectWrites(cond, writes);
+      collectWrites(inc, writes);
+      std::vector<const Expr *> hoisted;
+      hoist(cond, writes, hoisted);
+      hoist(body, writes, hoisted);
+      hoist(inc, writes, hoisted);
+
+      /// the condition is at the bottom, one jump per iteration
+      size_t entry = 0;
+      if (!isDo)
+         entry = emit(OP_JMP);
+      int top = label();
+      compileStmt(body);
+      int next = label();
+      patchAll(mContinues.back(), next);
+      if (inc != NULL)
+         compileStmt(inc);
+      int check = label();
+      if (!isDo)
+         patch(entry, check);
+      if (cond != NULL) {
+         int temps = mNextReg;
+         emit(OP_JNZ, compileExpr(cond), top);
+         mNextReg = temps;
+      }
+      else {
+         emit(OP_JMP, top);
+      }
+      patchAll(mBreaks.back(), label());
+
+      for (size_t i = 0; i < hoisted.size(); ++ i)
+         mHoisted.erase(hoisted[i]);
+      mNextReg = mark;
+      mBreaks.pop_back();
+      mContinues.pop_back();
+   }
+
+   /// every statement but a block owns the instructions it emits itself
+   void compileStmt(Stmt * stmt) {
+      if (stmt == NULL)
+         return;
+      int outer = mStatement;
+      if (!isa<CompoundStmt>(stmt))
+         mStatement = addStatement(stmt);
+      compileStmtBody(stmt);
+      mStatement = outer;
+   }
+   void compileStmtBody(Stmt * stmt) {
+      if (CompoundStmt * block = dyn_cast<CompoundStmt>(stmt)) {
+         for (CompoundStmt::body_iterator it = block->body_begin(), ie = block->body_end(); it != ie; ++ it)
+            compileStmt(*it);
+      }
+      else if (DeclStmt * declstmt = dyn_cast<DeclStmt>(stmt)) {
+         for (DeclStmt::decl_iterator it = declstmt->decl_begin(), ie = declstmt->decl_end(); it != ie; ++ it) {
+            if (VarDecl * var = dyn_cast<VarDecl>(*it)) {
+               int mark = mNextReg;
+               allocateLocal(var);
+               /// keep the register of the new local
+               if (mNextReg > mark + 1)
+                  mNextReg = mark + 1;
+            }
+         }
+      }
+      else if (IfStmt * ifstmt = dyn_cast<IfStmt>(stmt)) {
+         int mark = mNextReg;
+         size_t toElse = emit(OP_JZ, compileExpr(ifstmt->getCond()));
+         mNextReg = mark;
+         compileStmt(ifstmt->getThen());
+         if (ifstmt->getElse() != NULL) {
+            size_t toEnd = emit(OP_JMP);
+            patch(toElse, label());
+            compileStmt(ifstmt->getElse());
+            patch(toEnd, label());
+         }
+         else {
+            patch(toElse, label());
+         }
+      }
+      else if (WhileStmt * whilestmt = dyn_cast<WhileStmt>(stmt)) {
+         compileLoop(whilestmt->getBody(), whilestmt->getCond(), NULL, false);
+      }
+      else if (DoStmt * dostmt = dyn_cast<DoStmt>(stmt)) {
+         compileLoop(dostmt->getBody(), dostmt->getCond(), NULL, true);
+      }
+      else if (ForStmt * forstmt = dyn_cast<ForStmt>(stmt)) {
+         compileStmt(forstmt->getInit());
+         compileLoop(forstmt->getBody(), forstmt->getCond(), forstmt->getInc(), false);
+      }
+      else if (isa<BreakStmt>(stmt) && !mBreaks.empty()) {
+         mBreaks.back().push_back(emit(OP_JMP));
+      }
+      else if (isa<ContinueStmt>(stmt) && !mContinues.empty()) {
+         mContinues.back().push_back(emit(OP_JMP));
+      }
+      else if (ReturnStmt * ret = dyn_cast<ReturnStmt>(stmt)) {
+         int mark = mNextReg;
+         if (ret->getRetValue() != NULL)
+            emit(OP_RET, compileExpr(ret->getRetValue()));
+         else
+            emit(OP_RETV);
+         mNextReg = mark;
+      }
+      else if (isa<NullStmt>(stmt)) {
+      }
+      else if (Expr * expr = dyn_cast<Expr>(stmt)) {
+         int mark = mNextReg;
+         compileExpr(expr);
+         mNextReg = mark;
+      }
+      else {
+         fail(stmt, "unsupported statement");
+      }
+   }
+
+   LValue compileLValue(Expr * expr) {
+      LValue lvalue = { 0, true, 4 };
+      expr = expr->IgnoreParens();
+
+      if (DeclRefExpr * ref = dyn_cast<DeclRefExpr>(expr)) {
+         VarDecl * var = dyn_cast<VarDecl>(ref->getDecl());
+         std::map<const VarDecl *, int>::iterator it;
+         if (var == NULL) {
+            fail(expr, "unsupported reference");
+         }
+         else if ((it = mLocals.find(var)) != mLocals.end()) {
+            lvalue.reg = it->second;
+            lvalue.isMemory = false;
+         }
+         else if ((it = mFrameVars.find(var)) != mFrameVars.end()) {
+            lvalue.reg = newReg();
+            emit(OP_FADDR, lvalue.reg, it->second);
+         }
+         else if ((it = mGlobals.find(var->getCanonicalDecl())) != mGlobals.end()) {
+            lvalue.reg = newReg();
+            emit(OP_GADDR, lvalue.reg, it->second);
+         }
+         else {
+            fail(expr, "unknown variable");
+         }
+      }
+      else if (UnaryOperator * uop = dyn_cast<UnaryOperator>(expr)) {
+         if (uop->getOpcode() == UO_Deref)
+            lvalue.reg = compileExpr(uop->getSubExpr());
+         else
+            fail(expr, "unsupported lvalue");
+      }
+      else if (ArraySubscriptExpr * subscript = dyn_cast<ArraySubscriptExpr>(expr)) {
+         lvalue.reg = compileOffset(compileExpr(subscript->getBase()), subscript->getIdx(),
+                                    getSize(subscript->getType()), false);
+      }
+      else {
+         fail(expr, "unsupported lvalue");
+      }
+      lvalue.size = getAccessSize(expr->getType());
+      return lvalue;
+   }
+   int load(const LValue & lvalue) {
+      if (!lvalue.isMemory)
+         return lvalue.reg;
+      int reg = newReg();
+      emit(lvalue.size == 1 ? OP_LOADB : OP_LOAD, reg, lvalue.reg);
+      return reg;
+   }
+   void store(const LValue & lvalue, int reg) {
+      if (!lvalue.isMemory)
+         emit(OP_MOV, lvalue.reg, reg);
+      else
+         emit(lvalue.size == 1 ? OP_STOREB : OP_STORE, lvalue.reg, reg);
+   }
+
+   /// pointer +/- index * size
+   int compileOffset(int pointer, Expr * index, int size, bool isSub) {
+      int reg = newReg();
+      int val;
+      if (evaluateInt(index, val)) {
+         emit(OP_ADDI, reg, pointer, (isSub ? -val : val) * size);
+         return reg;
+      }
+      int offset = compileExpr(index);
+      if (size != 1) {
+         emit(OP_MULI, reg, offset, size);
+         offset = reg;
+      }
+      emit(isSub ? OP_SUB : OP_ADD, reg, pointer, offset);
+      return reg;
+   }
+   int getPointeeSize(QualType type) {
+      return getSize(type->getPointeeType());
+   }
+
+   /// lhs op rhs, with the pointer arithmetic of C
+   int compileArith(BinaryOperatorKind opc, Expr * lhs, Expr * rhs, int left) {
+      QualType lt = lhs->getType();
+      QualType rt = rhs->getType();
+      if (opc == BO_Add && lt->isPointerType())
+         return compileOffset(left, rhs, getPointeeSize(lt), false);
+      if (opc == BO_Sub && lt->isPointerType() && !rt->isPointerType())
+         return compileOffset(left, rhs, getPointeeSize(lt), true);
+
+      int reg = newReg();
+      int val;
+      if ((opc == BO_Add || opc == BO_Sub || opc == BO_Mul) && evaluateInt(rhs, val)) {
+         if (opc == BO_Mul)
+            emit(OP_MULI, reg, left, val);
+         else
+            emit(OP_ADDI, reg, left, opc == BO_Sub ? -val : val);
+         return reg;
+      }
+
+      int right = compileExpr(rhs);
+      Opcode op;
+      switch (opc) {
+      case BO_Add: op = OP_ADD; break;
+      case BO_Sub: op = OP_SUB; break;
+      case BO_Mul: op = OP_MUL; break;
+      case BO_Div: op = OP_DIV; break;
+      case BO_Rem: op = OP_REM; break;
+      case BO_LT:  op = OP_LT; break;
+      case BO_GT:  op = OP_GT; break;
+      case BO_LE:  op = OP_LE; break;
+      case BO_GE:  op = OP_GE; break;
+      case BO_EQ:  op = OP_EQ; break;
+      case BO_NE:  op = OP_NE; break;
+      default:
+         return fail(lhs, "unsupported operator");
+      }
+      emit(op, reg, left, right);
+
+      /// the distance of two pointers is in elements
+      if (opc == BO_Sub && lt->isPointerType() && getPointeeSize(lt) != 1) {
+         int size = newReg();
+         emit(OP_LOADK, size, getPointeeSize(lt));
+         emit(OP_DIV, reg, reg, size);
+      }
+      return reg;
+   }
+
+   int compileBinary(BinaryOperator * bop) {
+      BinaryOperatorKind opc = bop->getOpcode();
+      Expr * lhs = bop->getLHS();
+      Expr * rhs = bop->getRHS();
+
+      if (opc == BO_Assign) {
+         LValue lvalue = compileLValue(lhs);
+         if (!lvalue.isMemory) {
+            compileInto(rhs, lvalue.reg);
+            return lvalue.reg;
+         }
+         int reg = compileExpr(rhs);
+         store(lvalue, reg);
+         return reg;
+      }
+      if (bop->isCompoundAssignmentOp()) {
+         LValue lvalue = compileLValue(lhs);
+         int reg = compileArith(BinaryOperator::getOpForCompoundAssignment(opc), lhs, rhs, load(lvalue));
+         if (lvalue.size == 1 && !lvalue.isMemory)
+            emit(OP_SEXT8, reg, reg);
+         store(lvalue, reg);
+         return reg;
+      }
+      if (opc == BO_LAnd || opc == BO_LOr) {
+         /// the result is 0 or 1, the right side only runs when it decides
+         bool isAnd = opc == BO_LAnd;
+         int reg = newReg();
+         emit(OP_LOADK, reg, isAnd ? 0 : 1);
+         int mark = mNextReg;
+         size_t first = emit(isAnd ? OP_JZ : OP_JNZ, compileExpr(lhs));
+         mNextReg = mark;
+         size_t second = emit(isAnd ? OP_JZ : OP_JNZ, compileExpr(rhs));
+         mNextReg = mark;
+         emit(OP_LOADK, reg, isAnd ? 1 : 0);
+         int end = label();
+         patch(first, end);
+         patch(second, end);
+         return reg;
+      }
+      if (opc == BO_Comma) {
+         compileExpr(lhs);
+         return compileExpr(rhs);
+      }
+      /// index + pointer is pointer + index
+      if (opc == BO_Add && rhs->getType()->isPointerType())
+         return compileArith(opc, rhs, lhs, compileExpr(rhs));
+      return compileArith(opc, lhs, rhs, compileExpr(lhs));
+   }
+
+   int compileUnary(UnaryOperator * uop) {
+      Expr * sub = uop->getSubExpr();
+      if (uop->isIncrementDecrementOp()) {
+         LValue lvalue = compileLValue(sub);
+         int step = sub->getType()->isPointerType() ? getPointeeSize(sub->getType()) : 1;
+         if (uop->isDecrementOp())
+            step = -step;
+         int old = load(lvalue);
+         int reg = newReg();
+         if (!lvalue.isMemory && uop->isPrefix())
+            reg = lvalue.reg;
+         else if (!lvalue.isMemory)
+            emit(OP_MOV, reg, old);
+         if (!lvalue.isMemory) {
+            emit(OP_ADDI, lvalue.reg, lvalue.reg, step);
+            if (lvalue.size == 1)
+               emit(OP_SEXT8, lvalue.reg, lvalue.reg);
+            return reg;
+         }
+         emit(OP_ADDI, reg, old, step);
+         store(lvalue, reg);
+         return uop->isPrefix() ? reg : old;
+      }
+
+      switch (uop->getOpcode()) {
+      case UO_Plus:
+         return compileExpr(sub);
+      case UO_Minus: {
+         int reg = newReg();
+         emit(OP_NEG, reg, compileExpr(sub));
+         return reg;
+      }
+      case UO_LNot: {
+         int reg = newReg();
+         emit(OP_NOT, reg, compileExpr(sub));
+         return reg;
+      }
+      case UO_AddrOf: {
+         LValue lvalue = compileLValue(sub);
+         if (!lvalue.isMemory)
+            return fail(uop, "address of a register variable");
+         return lvalue.reg;
+      }
+      default:
+         return fail(uop, "unsupported operator");
+      }
+   }
+
+   int compileCast(CastExpr * cast) {
+      Expr * sub = cast->getSubExpr();
+      switch (cast->getCastKind()) {
+      case CK_LValueToRValue:
+         return load(compileLValue(sub));
+      case CK_ArrayToPointerDecay: {
+         LValue lvalue = compileLValue(sub);
+         return lvalue.reg;
+      }
+      case CK_IntegralCast: {
+         int reg = compileExpr(sub);
+         if (getSize(cast->getType()) != 1)
+            return reg;
+         int trunc = newReg();
+         emit(OP_SEXT8, trunc, reg);
+         return trunc;
+      }
+      case CK_IntegralToBoolean:
+      case CK_PointerToBoolean: {
+         int reg = newReg();
+         emit(OP_NOT, reg, compileExpr(sub));
+         emit(OP_NOT, reg, reg);
+         return reg;
+      }
+      case CK_NoOp:
+      case CK_BitCast:
+      case CK_NullToPointer:
+      case CK_IntegralToPointer:
+      case CK_PointerToIntegral:
+      case CK_ToVoid:
+         return compileExpr(sub);
+      default:
+         return fail(cast, std::string("unsupported cast ") + cast->getCastKindName());
+      }
+   }
+
+   int compileCall(CallExpr * call) {
+      FunctionDecl * callee = call->getDirectCallee();
+      if (callee == NULL)
+         return fail(call, "indirect call");
+      callee = callee->getCanonicalDecl();
+
+      if (callee == mInput) {
+         int reg = newReg();
+         emit(OP_GET, reg);
+         return reg;
+      }
+      if (callee == mOutput || callee == mFree) {
+         int reg = compileExpr(call->getArg(0));
+         emit(callee == mOutput ? OP_PRINT : OP_FREE, reg);
+         return reg;
+      }
+      if (callee == mMalloc) {
+         int reg = newReg();
+         emit(OP_MALLOC, reg, compileExpr(call->getArg(0)));
+         return reg;
+      }
+
+      std::map<const FunctionDecl *, int>::iterator it = mFunctions.find(callee);
+      if (it == mFunctions.end())
+         return fail(call, "call without a body");
+
+      /// the arguments are the first registers of the callee frame
+      int base = mNextReg;
+      for (unsigned i = 0; i < call->getNumArgs(); ++ i)
+         newReg();
+      for (unsigned i = 0; i < call->getNumArgs(); ++ i)
+         compileInto(call->getArg(i), base + i);
+      mNextReg = base;
+      int reg = newReg();
+      emit(OP_CALL, reg, it->second, base);
+      return reg;
+   }
+
+   int compileExpr(Expr * expr) {
+      if (!mError.empty())
+         return 0;
+      expr = expr->IgnoreParens();
+
+      std::map<const Expr *, int>::iterator hoisted = mHoisted.find(expr);
+      if (hoisted != mHoisted.end())
+         return hoisted->second;
+      if (isa<BinaryOperator>(expr) || isa<UnaryOperator>(expr) || isa<CastExpr>(expr)
+            || isa<ConditionalOperator>(expr) || isa<UnaryExprOrTypeTraitExpr>(expr)) {
+         int val;
+         if (expr->getType()->isIntegerType() && evaluateInt(expr, val)) {
+            int reg = newReg();
+            emit(OP_LOADK, reg, val);
+            return reg;
+         }
+      }
+      if (IntegerLiteral * literal = dyn_cast<IntegerLiteral>(expr)) {
+         int reg = newReg();
+         emit(OP_LOADK, reg, (int)literal->getValue().getSExtValue());
+         return reg;
+      }
+      if (CharacterLiteral * literal = dyn_cast<CharacterLiteral>(expr)) {
+         int reg = newReg();
+         emit(OP_LOADK, reg, (int)literal->getValue());
+         return reg;
+      }
+      if (isa<UnaryExprOrTypeTraitExpr>(expr))
+         return fail(expr, "unsupported");
+      if (DeclRefExpr * ref = dyn_cast<DeclRefExpr>(expr)) {
+         if (EnumConstantDecl * constant = dyn_cast<EnumConstantDecl>(ref->getDecl())) {
+            int reg = newReg();
+            emit(OP_LOADK, reg, (int)constant->getInitVal().getSExtValue());
+            return reg;
+         }
+         return fail(expr, "unsupported reference");
+      }
+      if (BinaryOperator * bop = dyn_cast<BinaryOperator>(expr))
+         return compileBinary(bop);
+      if (UnaryOperator * uop = dyn_cast<UnaryOperator>(expr))
+         return compileUnary(uop);
+      if (CastExpr * cast = dyn_cast<CastExpr>(expr))
+         return compileCast(cast);
+      if (CallExpr * call = dyn_cast<CallExpr>(expr))
+         return compileCall(call);
+      if (ConditionalOperator * cond = dyn_cast<ConditionalOperator>(expr)) {
+         int reg = newReg();
+         int mark = mNextReg;
+         size_t toFalse = emit(OP_JZ, compileExpr(cond->getCond()));
+         mNextReg = mark;
+         compileInto(cond->getTrueExpr(), reg);
+         mNextReg = mark;
+         size_t toEnd = emit(OP_JMP);
+         patch(toFalse, label());
+         compileInto(cond->getFalseExpr(), reg);
+         mNextReg = mark;
+         patch(toEnd, label());
+         return reg;
+      }
+      return fail(expr, "unsupported expression");
+   }
+
+   void compileFunction(FunctionDecl * fdecl, BytecodeFunction & function) {
+      mFunction = &function;
+      mLocals.clear();
+      mFrameVars.clear();
+      mAddressed.clear();
+      mHoisted.clear();
+      mNextReg = 0;
+      mLabel = -1;
+      mStatement = -1;
+
+      function.name = fdecl->getNameAsString();
+      function.location = getLocation(fdecl);
+      function.numParams = fdecl->getNumParams();
+      collectAddressed(fdecl->getBody(), mAddressed);
+      for (unsigned i = 0; i < fdecl->getNumParams(); ++ i)
+         mLocals[fdecl->getParamDecl(i)] = newReg();
+      /// a parameter whose address is taken is copied from its register to the frame
+      for (unsigned i = 0; i < fdecl->getNumParams(); ++ i) {
+         ParmVarDecl * param = fdecl->getParamDecl(i);
+         if (mAddressed.count(param)) {
+            int mark = mNextReg;
+            int offset = allocateFrame(param);
+            storeFrame(param, offset, mLocals[param]);
+            mLocals.erase(param);
+            mFrameVars[param] = offset;
+            mNextReg = mark;
+         }
+      }
+      compileStmt(fdecl->getBody());
+      emit(OP_RETV);
+   }
+public:
+   explicit BytecodeCompiler(ASTContext & context)
+   : mContext(context), mProgram(NULL), mError(), mFree(NULL), mMalloc(NULL), mInput(NULL), mOutput(NULL),
+     mFunction(NULL), mNextReg(0), mLabel(-1), mStatement(-1) {
+   }
+
+   const std::string & getError() {
+      return mError;
+   }
+
+   bool compile(TranslationUnitDecl * unit, BytecodeProgram & program) {
+      mProgram = &program;
+
+      std::vector<FunctionDecl *> bodies;
+      for (TranslationUnitDecl::decl_iterator i = unit->decls_begin(), e = unit->decls_end(); i != e; ++ i) {
+         if (FunctionDecl * fdecl = dyn_cast<FunctionDecl>(*i)) {
+            FunctionDecl * canonical = fdecl->getCanonicalDecl();
+            if (fdecl->getName().equals("FREE")) mFree = canonical;
+            else if (fdecl->getName().equals("MALLOC")) mMalloc = canonical;
+            else if (fdecl->getName().equals("GET")) mInput = canonical;
+            else if (fdecl->getName().equals("PRINT")) mOutput = canonical;
+
+            if (fdecl->doesThisDeclarationHaveABody()) {
+               mFunctions[canonical] = bodies.size();
+               if (fdecl->getName().equals("main"))
+                  program.entry = bodies.size();
+               bodies.push_back(fdecl);
+            }
+         }
+         else if (VarDecl * var = dyn_cast<VarDecl>(*i)) {
+            if (mGlobals.find(var->getCanonicalDecl()) == mGlobals.end())
+               allocateGlobal(var);
+         }
+      }
+      if (program.entry < 0)
+         fail(NULL, "no main");
+
+      program.functions.resize(bodies.size());
+      for (size_t i = 0; i < bodies.size() && mError.empty(); ++ i)
+         compileFunction(bodies[i], program.functions[i]);
+      return mError.empty();
+   }
+};
+
+#endif
@@ -0,0 +1,444 @@
+//==--- BytecodeInterpreter.h - Interpreter of the register bytecode --------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_BYTECODEINTERPRETER_H
+#define AST_INTERPRETER_BYTECODEINTERPRETER_H
+
+#include <string>
+#include <vector>
+
+#include "llvm/Support/raw_ostream.h"
+
+#include "Bytecode.h"
+#include "Heap.h"
+#include "ProgramIO.h"
+#include "Profiler.h"
+#include "ValueStack.h"
+
+/// Computed goto is a GNU extension, other compilers dispatch with a switch
+#if defined(__GNUC__)
+#define BYTECODE_THREADED 1
+#endif
+
+/// What native code of a function shares with the interpreter. The callbacks
+/// refresh memory, the heap arena moves when it grows.
+struct JITRuntime {
+   char * memory;
+   int globals;
+   int failed;                   /// a callback stopped the program
+   void * interpreter;
+};
+
+/// Native code of a function, it runs on the registers and the frame memory of
+/// a frame the interpreter set up. entry is 0, or the instruction of a loop
+/// header to go on from when a running frame switches to native code.
+typedef int (*NativeFunction)(JITRuntime * rt, int * R, int frameMem, int entry);
+
+/// The second tier, compiles a hot function to native code
+class NativeCompiler {
+public:
+   virtual ~NativeCompiler() {
+   }
+   /// NULL if the function can not be compiled
+   virtual NativeFunction compile(const BytecodeProgram & program, int index) = 0;
+};
+
+/// Runs a BytecodeProgram from its entry. The registers of all frames are slices
+/// of the value stack, a callee frame starts at the arguments the caller put on
+/// top of its own registers, so calls copy nothing.
+///
+/// With a NativeCompiler, calls and loop back-edges are counted per function;
+/// a function crossing the threshold is compiled, its later calls run native
+/// code and a running frame of it switches over at its next back-edge. Native
+/// code calls back for calls and builtins, a call goes through execute() again,
+/// so interpreted and native frames mix freely.
+///
+/// With a Profiler the run goes through execute<true>, which reports every
+/// instruction and call to it; execute<false> has no trace of profiling.
+class BytecodeInterpreter {
+   struct CallFrame {
+      const BytecodeFunction * function;
+      const Instruction * ip;    /// where the caller goes on
+      int base;
+      int frameMem;
+      int dst;                   /// register of the caller for the returned value
+   };
+   struct Tier {
+      unsigned count;
+      NativeFunction native;
+      bool isFailed;             /// the compiler gave up, stay interpreted
+
+      Tier() : count(0), native(NULL), isFailed(false) {
+      }
+   };
+   static const size_t MaxDepth = 1 << 16;
+   /// Native frames nest on the host stack, deeper calls are interpreted
+   static const int MaxNativeDepth = 4096;
+
+   Heap & mHeap;
+   ValueStack & mStack;
+   ProgramIO & mIO;
+   std::vector<CallFrame> mFrames;
+   const BytecodeProgram * mProgram;
+   int mGlobals;
+   int mResult;
+   std::string mError;
+
+   /// released frame arrays of every function, reused as they are
+   std::vector<std::vector<int> > mFramePool;
+
+   Profiler * mProfiler;
+   std::vector<Profiler::Frame> mSampleStack;
+
+   NativeCompiler * mCompiler;
+   unsigned mThreshold;
+   std::vector<Tier> mTiers;
+   JITRuntime mRuntime;
+   int mNativeDepth;
+
+   /// the registers of function from base, NULL on a stack overflow
+   int * reserve(int base, const BytecodeFunction * function) {
+      return mStack.getSlice(base, function->numRegs);
+   }
+
+   /// The arrays of a new frame of function index. Debug mode frees them on
+   /// return instead of pooling, so an access after the return is caught.
+   int allocFrame(int index) {
+      std::vector<int> & pool = mFramePool[index];
+      if (pool.empty()) {
+         int bytes = mProgram->functions[index].frameBytes;
+         return bytes != 0 ? mHeap.Malloc(bytes) : 0;
+      }
+      int addr = pool.back();
+      pool.pop_back();
+      return addr;
+   }
+   void releaseFrame(int index, int addr) {
+      if (addr == 0)
+         return;
+      if (mHeap.isDebug())
+         mHeap.Free(addr);
+      else
+         mFramePool[index].push_back(addr);
+   }
+
+   int input() {
+      return mIO.get();
+   }
+   void output(int val) {
+      mIO.print(val);
+   }
+
+   /// Count a call or a back-edge of function index, its native code once it is hot
+   NativeFunction getNative(int index) {
+      Tier & tier = mTiers[index];
+      if (tier.native == NULL && !tier.isFailed && ++ tier.count >= mThreshold) {
+         tier.native = mCompiler->compile(*mProgram, index);
+         tier.isFailed = tier.native == NULL;
+      }
+      return mNativeDepth < MaxNativeDepth ? tier.native : NULL;
+   }
+   bool callNative(NativeFunction native, int * R, int frameMem, int entry, int & value) {
+      mRuntime.memory = mHeap.getMemory();
+      ++ mNativeDepth;
+      value = native(&mRuntime, R, frameMem, entry);
+      -- mNativeDepth;
+      return !mRuntime.failed;
+   }
+
+   void profile(const BytecodeFunction * function, const Instruction * code, const Instruction * ip) {
+      const BytecodeFunction * functions = &mProgram->functions[0];
+      if (!mProfiler->count(function - functions, ip - code))
+         return;
+      mSampleStack.clear();
+      for (size_t i = 0; i < mFrames.size(); ++ i) {
+         const CallFrame & frame = mFrames[i];
+         mSampleStack.push_back(Profiler::Frame(frame.function - functions, frame.ip - 1 - &frame.function->code[0]));
+      }
+      mSampleStack.push_back(Profiler::Frame(function - functions, ip - code));
+      mProfiler->sample(mSampleStack);
+   }
+
+   /// Run function index with its registers from base until it returns
+   template <bool Profile>
+   bool execute(int index, int base, int & result) {
+      const BytecodeProgram & program = *mProgram;
+      const size_t entryDepth = mFrames.size();
+      const BytecodeFunction * function = &program.functions[index];
+      const Instruction * code = NULL;
+      const Instruction * ip = NULL;
+      int * R = NULL;
+      int frameMem = 0;
+      int value = 0;
+      int target = 0;
+      /// debug mode checks every access
+      const bool check = mHeap.isDebug();
+      const bool tiering = mCompiler != NULL;
+      const char * accessError = NULL;
+
+#ifdef BYTECODE_THREADED
+#define BYTECODE_LABEL(name) &&L_##name,
+      static const void * const labels[] = { BYTECODE_OPCODES(BYTECODE_LABEL) };
+#undef BYTECODE_LABEL
+#define VM_CASE(name) L_##name:
+#define VM_GOTO() goto *labels[ip->op]
+#else
+#define VM_CASE(name) case OP_##name:
+#define VM_GOTO() goto dispatch
+#endif
+#define VM_DISPATCH() \
+      do { \
+         if (Profile) \
+            profile(function, code, ip); \
+         VM_GOTO(); \
+      } while (0)
+#define VM_NEXT() do { ++ ip; VM_DISPATCH(); } while (0)
+
+   enter:
+      R = reserve(base, function);
+      if (R == NULL)
+         goto stackOverflow;
+      frameMem = allocFrame(function - &program.functions[0]);
+      code = &function->code[0];
+      ip = code;
+      if (Profile)
+         mProfiler->enter(function - &program.functions[0]);
+      if (tiering) {
+         NativeFunction native = getNative(function - &program.functions[0]);
+         if (native != NULL) {
+            if (!callNative(native, R, frameMem, 0, value))
+               goto fail;
+            goto leave;
+         }
+      }
+      VM_DISPATCH();
+
+#ifndef BYTECODE_THREADED
+   dispatch:
+      switch (ip->op) {
+#endif
+/// the arithmetic wraps around like the machine does
+#define VM_WRAP(expr) (int)(expr)
+/// a jump to an earlier instruction closes a loop
+#define VM_JUMP(to) \
+         if (tiering && (to) <= ip - code) { \
+            target = (to); \
+            goto backEdge; \
+         } \
+         ip = code + (to); \
+         VM_DISPATCH()
+      VM_CASE(MOV)    R[ip->a] = R[ip->b]; VM_NEXT();
+      VM_CASE(LOADK)  R[ip->a] = ip->b; VM_NEXT();
+      VM_CASE(ADD)    R[ip->a] = VM_WRAP((unsigned)R[ip->b] + (unsigned)R[ip->c]); VM_NEXT();
+      VM_CASE(SUB)    R[ip->a] = VM_WRAP((unsigned)R[ip->b] - (unsigned)R[ip->c]); VM_NEXT();
+      VM_CASE(MUL)    R[ip->a] = VM_WRAP((unsigned)R[ip->b] * (unsigned)R[ip->c]); VM_NEXT();
+      VM_CASE(DIV)
+         if (R[ip->c] == 0)
+            goto divideByZero;
+         R[ip->a] = R[ip->c] == -1 ? VM_WRAP(0u - (unsigned)R[ip->b]) : R[ip->b] / R[ip->c];
+         VM_NEXT();
+      VM_CASE(REM)
+         if (R[ip->c] == 0)
+            goto divideByZero;
+         R[ip->a] = R[ip->c] == -1 ? 0 : R[ip->b] % R[ip->c];
+         VM_NEXT();
+      VM_CASE(ADDI)   R[ip->a] = VM_WRAP((unsigned)R[ip->b] + (unsigned)ip->c); VM_NEXT();
+      VM_CASE(MULI)   R[ip->a] = VM_WRAP((unsigned)R[ip->b] * (unsigned)ip->c); VM_NEXT();
+      VM_CASE(NEG)    R[ip->a] = VM_WRAP(0u - (unsigned)R[ip->b]); VM_NEXT();
+      VM_CASE(NOT)    R[ip->a] = !R[ip->b]; VM_NEXT();
+      VM_CASE(SEXT8)  R[ip->a] = (signed char)R[ip->b]; VM_NEXT();
+      VM_CASE(LT)     R[ip->a] = R[ip->b] < R[ip->c]; VM_NEXT();
+      VM_CASE(GT)     R[ip->a] = R[ip->b] > R[ip->c]; VM_NEXT();
+      VM_CASE(LE)     R[ip->a] = R[ip->b] <= R[ip->c]; VM_NEXT();
+      VM_CASE(GE)     R[ip->a] = R[ip->b] >= R[ip->c]; VM_NEXT();
+      VM_CASE(EQ)     R[ip->a] = R[ip->b] == R[ip->c]; VM_NEXT();
+      VM_CASE(NE)     R[ip->a] = R[ip->b] != R[ip->c]; VM_NEXT();
+#define VM_CHECK(addr, size) \
+         if (check && (accessError = mHeap.getAccessError(addr, size)) != NULL) \
+            goto badAccess
+      VM_CASE(LOAD)   VM_CHECK(R[ip->b], 4); R[ip->a] = mHeap.get(R[ip->b]); VM_NEXT();
+      VM_CASE(LOADB)  VM_CHECK(R[ip->b], 1); R[ip->a] = mHeap.getByte(R[ip->b]); VM_NEXT();
+      VM_CASE(STORE)  VM_CHECK(R[ip->a], 4); mHeap.Update(R[ip->a], R[ip->b]); VM_NEXT();
+      VM_CASE(STOREB) VM_CHECK(R[ip->a], 1); mHeap.UpdateByte(R[ip->a], R[ip->b]); VM_NEXT();
+      VM_CASE(GADDR)  R[ip->a] = mGlobals + ip->b; VM_NEXT();
+      VM_CASE(FADDR)  R[ip->a] = frameMem + ip->b; VM_NEXT();
+      VM_CASE(JMP)    VM_JUMP(ip->a);
+      VM_CASE(JZ)
+         if (R[ip->a] == 0) {
+            VM_JUMP(ip->b);
+         }
+         VM_NEXT();
+      VM_CASE(JNZ)
+         if (R[ip->a] != 0) {
+            VM_JUMP(ip->b);
+         }
+         VM_NEXT();
+      VM_CASE(CALL) {
+         if (mFrames.size() == MaxDepth)
+            goto stackOverflow;
+         CallFrame caller = { function, ip + 1, base, frameMem, ip->a };
+         mFrames.push_back(caller);
+
+         function = &program.functions[ip->b];
+         base += ip->c;
+         goto enter;
+      }
+      VM_CASE(RET)
+         value = R[ip->a];
+         goto leave;
+      VM_CASE(RETV)
+         value = 0;
+         goto leave;
+      VM_CASE(GET)    R[ip->a] = input(); VM_NEXT();
+      VM_CASE(PRINT)  output(R[ip->a]); VM_NEXT();
+      VM_CASE(MALLOC) R[ip->a] = mHeap.Malloc(R[ip->b]); VM_NEXT();
+      VM_CASE(FREE)
+         if (!mHeap.Free(R[ip->a])) {
+            accessError = "free of no allocated block";
+            goto badAccess;
+         }
+         VM_NEXT();
+
+      backEdge: {
+         NativeFunction native = getNative(function - &program.functions[0]);
+         ip = code + target;
+         if (native == NULL)
+            VM_DISPATCH();
+         if (!callNative(native, R, frameMem, target, value))
+            goto fail;
+         goto leave;
+      }
+      leave: {
+         releaseFrame(function - &program.functions[0], frameMem);
+         if (mFrames.size() == entryDepth) {
+            result = value;
+            return true;
+         }
+         const CallFrame & caller = mFrames.back();
+         function = caller.function;
+         code = &function->code[0];
+         ip = caller.ip;
+         base = caller.base;
+         frameMem = caller.frameMem;
+         R = reserve(base, function);
+         if (caller.dst >= 0)
+            R[caller.dst] = value;
+         mFrames.pop_back();
+         VM_DISPATCH();
+      }
+#ifndef BYTECODE_THREADED
+      default:
+         mError = "bad opcode";
+         goto fail;
+      }
+#endif
+#undef VM_WRAP
+#undef VM_JUMP
+#undef VM_CHECK
+#undef VM_CASE
+#undef VM_GOTO
+#undef VM_DISPATCH
+#undef VM_NEXT
+
+   badAccess: {
+         std::string message;
+         llvm::raw_string_ostream os(message);
+         os << accessError << " at address " << R[ip->op == OP_STORE || ip->op == OP_STOREB || ip->op == OP_FREE ? ip->a : ip->b]
+            << " in " << function->name;
+         mError = os.str();
+         goto fail;
+      }
+   divideByZero:
+      mError = "division by zero in " + function->name;
+      goto fail;
+   stackOverflow:
+      mError = "stack overflow in " + function->name;
+   fail:
+      mFrames.resize(entryDepth);
+      return false;
+   }
+public:
+   BytecodeInterpreter(Heap & heap, ValueStack & stack, ProgramIO & io)
+   : mHeap(heap), mStack(stack), mIO(io), mFrames(), mProgram(NULL), mGlobals(0), mResult(0), mError(),
+     mFramePool(), mProfiler(NULL), mSampleStack(), mCompiler(NULL), mThreshold(0), mTiers(), mRuntime(), mNativeDepth(0) {
+   }
+
+   /// Count and time the run with profiler; native code is not profiled, so
+   /// this goes without a compiler
+   void setProfiler(Profiler * profiler) {
+      mProfiler = profiler;
+   }
+   /// Compile the functions called or looping threshold times with compiler
+   void setCompiler(NativeCompiler * compiler, unsigned threshold) {
+      mCompiler = compiler;
+      mThreshold = threshold;
+   }
+
+   const std::string & getError() {
+      return mError;
+   }
+   /// The value main returned
+   int getResult() {
+      return mResult;
+   }
+
+   bool run(const BytecodeProgram & program) {
+      mProgram = &program;
+      mGlobals = program.globalBytes != 0 ? mHeap.Malloc(program.globalBytes) : 0;
+      for (size_t i = 0; i < program.globalInits.size(); ++ i) {
+         const GlobalInit & init = program.globalInits[i];
+         if (init.size == 1)
+            mHeap.UpdateByte(mGlobals + init.offset, init.value);
+         else
+            mHeap.Update(mGlobals + init.offset, init.value);
+      }
+
+      mFramePool.assign(program.functions.size(), std::vector<int>());
+      mTiers.assign(program.functions.size(), Tier());
+      mRuntime.globals = mGlobals;
+      mRuntime.failed = 0;
+      mRuntime.interpreter = this;
+      if (mProfiler == NULL)
+         return execute<false>(program.entry, mStack.size(), mResult);
+      mProfiler->start(program);
+      return execute<true>(program.entry, mStack.size(), mResult);
+   }
+
+   /// The host side of native code, see BytecodeJIT
+   static int nativeCall(JITRuntime * rt, int index, int * args) {
+      BytecodeInterpreter * self = (BytecodeInterpreter *)rt->interpreter;
+      int result = 0;
+      if (!self->execute<false>(index, args - self->mStack.getSlice(0, 0), result))
+         rt->failed = 1;
+      rt->memory = self->mHeap.getMemory();
+      return result;
+   }
+   static int nativeGet(JITRuntime * rt) {
+      return ((BytecodeInterpreter *)rt->interpreter)->input();
+   }
+   static void nativePrint(JITRuntime * rt, int val) {
+      ((BytecodeInterpreter *)rt->interpreter)->output(val);
+   }
+   static int nativeMalloc(JITRuntime * rt, int size) {
+      BytecodeInterpreter * self = (BytecodeInterpreter *)rt->interpreter;
+      int addr = self->mHeap.Malloc(size);
+      rt->memory = self->mHeap.getMemory();
+      return addr;
+   }
+   static void nativeFree(JITRuntime * rt, int addr, int index) {
+      BytecodeInterpreter * self = (BytecodeInterpreter *)rt->interpreter;
+      if (self->mHeap.Free(addr))
+         return;
+      std::string message;
+      llvm::raw_string_ostream os(message);
+      os << "free of no allocated block at address " << addr << " in " << self->mProgram->functions[index].name;
+      self->mError = os.str();
+      rt->failed = 1;
+   }
+   static void nativeDivideByZero(JITRuntime * rt, int index) {
+      BytecodeInterpreter * self = (BytecodeInterpreter *)rt->interpreter;
+      self->mError = "division by zero in " + self->mProgram->functions[index].name;
+      rt->failed = 1;
+   }
+};
+
+#endif
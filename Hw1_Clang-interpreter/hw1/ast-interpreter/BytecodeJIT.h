@@ -0,0 +1,353 @@
+//==--- BytecodeJIT.h - Native code for hot bytecode functions ---------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_BYTECODEJIT_H
+#define AST_INTERPRETER_BYTECODEJIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/raw_ostream.h"
+
+/// LLJIT and the new pass manager, older LLVMs stay interpreted
+#if LLVM_VERSION_MAJOR >= 12
+#define BYTECODE_JIT 1
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/TargetSelect.h"
+#endif
+
+#include "BytecodeInterpreter.h"
+
+/// Lowers a BytecodeFunction to LLVM IR and compiles it in process with ORC.
+///
+/// The native function keeps the interpreter's frame: a register is an i32 of
+/// R, memory is the heap arena, so a running frame can switch to native code at
+/// a loop header and native code can call back into interpreted functions. R is
+/// noalias, the optimizer keeps registers in machine registers across loops
+/// that do not call back. Calls and builtins are calls of the interpreter's
+/// native* functions at their absolute addresses, nothing is linked by name.
+class BytecodeJIT : public NativeCompiler {
+#ifdef BYTECODE_JIT
+   std::unique_ptr<llvm::orc::LLJIT> mJIT;
+   bool mIsBroken;                  /// creating the JIT failed, compile nothing
+
+   class Emitter {
+      const BytecodeFunction & mFunction;
+      int mIndex;
+      llvm::LLVMContext & mContext;
+      llvm::IRBuilder<> B;
+      llvm::Function * F;
+      llvm::Type * mVoid;
+      llvm::Type * mByte;
+      llvm::Type * mInt;
+      llvm::Type * mLong;
+      llvm::Type * mBytePtr;
+      llvm::Type * mIntPtr;
+      llvm::Value * mRuntime;
+      llvm::Value * mRegs;
+      llvm::Value * mFrameMem;
+      llvm::BasicBlock * mExit;           /// a callback failed, return at once
+      llvm::BasicBlock * mDivideByZero;
+      std::vector<llvm::BasicBlock *> mBlocks;
+
+      static bool isJump(Opcode op) {
+         return op == OP_JMP || op == OP_JZ || op == OP_JNZ;
+      }
+      static int getTarget(const Instruction & ins) {
+         return ins.op == OP_JMP ? ins.a : ins.b;
+      }
+
+      llvm::Value * constant(int val) {
+         return llvm::ConstantInt::get(mInt, val);
+      }
+      llvm::Value * reg(int r) {
+         return B.CreateConstInBoundsGEP1_32(mInt, mRegs, r);
+      }
+      llvm::Value * get(int r) {
+         return B.CreateLoad(mInt, reg(r));
+      }
+      void set(int r, llvm::Value * val) {
+         B.CreateStore(val, reg(r));
+      }
+      llvm::Value * field(size_t offset, llvm::Type * type) {
+         llvm::Value * ptr = B.CreateConstInBoundsGEP1_32(mByte, mRuntime, offset);
+         return B.CreateBitCast(ptr, llvm::PointerType::getUnqual(type));
+      }
+      /// the arena moves when it grows, so it is loaded for every access
+      llvm::Value * address(llvm::Value * addr, llvm::Type * type) {
+         llvm::Value * memory = B.CreateLoad(mBytePtr, field(offsetof(JITRuntime, memory), mBytePtr));
+         llvm::Value * ptr = B.CreateInBoundsGEP(mByte, memory, B.CreateSExt(addr, mLong));
+         return B.CreateBitCast(ptr, llvm::PointerType::getUnqual(type));
+      }
+      llvm::Value * callback(uint64_t fn, llvm::Type * ret, llvm::ArrayRef<llvm::Type *> params,
+                             llvm::ArrayRef<llvm::Value *> args) {
+         llvm::FunctionType * type = llvm::FunctionType::get(ret, params, false);
+         llvm::Value * callee = B.CreateIntToPtr(llvm::ConstantInt::get(mLong, fn), llvm::PointerType::getUnqual(type));
+         return B.CreateCall(type, callee, args);
+      }
+      void checkFailed() {
+         llvm::Value * failed = B.CreateLoad(mInt, field(offsetof(JITRuntime, failed), mInt));
+         llvm::BasicBlock * next = llvm::BasicBlock::Create(mContext, "", F);
+         B.CreateCondBr(B.CreateICmpNE(failed, constant(0)), mExit, next);
+         B.SetInsertPoint(next);
+      }
+      llvm::Value * compare(llvm::CmpInst::Predicate pred, const Instruction & ins) {
+         return B.CreateZExt(B.CreateICmp(pred, get(ins.b), get(ins.c)), mInt);
+      }
+      void divide(const Instruction & ins) {
+         llvm::Value * lhs = get(ins.b);
+         llvm::Value * rhs = get(ins.c);
+         llvm::BasicBlock * next = llvm::BasicBlock::Create(mContext, "", F);
+         B.CreateCondBr(B.CreateICmpEQ(rhs, constant(0)), mDivideByZero, next);
+         B.SetInsertPoint(next);
+         /// INT_MIN / -1 wraps around like in the interpreter
+         llvm::Value * minusOne = B.CreateICmpEQ(rhs, constant(-1));
+         llvm::Value * divisor = B.CreateSelect(minusOne, constant(1), rhs);
+         if (ins.op == OP_DIV)
+            set(ins.a, B.CreateSelect(minusOne, B.CreateNeg(lhs), B.CreateSDiv(lhs, divisor)));
+         else
+            set(ins.a, B.CreateSelect(minusOne, constant(0), B.CreateSRem(lhs, divisor)));
+      }
+
+      void emit(const Instruction & ins, size_t i) {
+         switch (ins.op) {
+         case OP_MOV:    set(ins.a, get(ins.b)); break;
+         case OP_LOADK:  set(ins.a, constant(ins.b)); break;
+         case OP_ADD:    set(ins.a, B.CreateAdd(get(ins.b), get(ins.c))); break;
+         case OP_SUB:    set(ins.a, B.CreateSub(get(ins.b), get(ins.c))); break;
+         case OP_MUL:    set(ins.a, B.CreateMul(get(ins.b), get(ins.c))); break;
+         case OP_DIV:
+         case OP_REM:    divide(ins); break;
+         case OP_ADDI:   set(ins.a, B.CreateAdd(get(ins.b), constant(ins.c))); break;
+         case OP_MULI:   set(ins.a, B.CreateMul(get(ins.b), constant(ins.c))); break;
+         case OP_NEG:    set(ins.a, B.CreateNeg(get(ins.b))); break;
+         case OP_NOT:    set(ins.a, B.CreateZExt(B.CreateICmpEQ(get(ins.b), constant(0)), mInt)); break;
+         case OP_SEXT8:  set(ins.a, B.CreateSExt(B.CreateTrunc(get(ins.b), mByte), mInt)); break;
+         case OP_LT:     set(ins.a, compare(llvm::CmpInst::ICMP_SLT, ins)); break;
+         case OP_GT:     set(ins.a, compare(llvm::CmpInst::ICMP_SGT, ins)); break;
+         case OP_LE:     set(ins.a, compare(llvm::CmpInst::ICMP_SLE, ins)); break;
+         case OP_GE:     set(ins.a, compare(llvm::CmpInst::ICMP_SGE, ins)); break;
+         case OP_EQ:     set(ins.a, compare(llvm::CmpInst::ICMP_EQ, ins)); break;
+         case OP_NE:     set(ins.a, compare(llvm::CmpInst::ICMP_NE, ins)); break;
+         case OP_LOAD:
+            set(ins.a, B.CreateAlignedLoad(mInt, address(get(ins.b), mInt), llvm::MaybeAlign(1)));
+            break;
+         case OP_LOADB:
+            set(ins.a, B.CreateSExt(B.CreateLoad(mByte, address(get(ins.b), mByte)), mInt));
+            break;
+         case OP_STORE:
+            B.CreateAlignedStore(get(ins.b), address(get(ins.a), mInt), llvm::MaybeAlign(1));
+            break;
+         case OP_STOREB:
+            B.CreateStore(B.CreateTrunc(get(ins.b), mByte), address(get(ins.a), mByte));
+            break;
+         case OP_GADDR: {
+            llvm::Value * globals = B.CreateLoad(mInt, field(offsetof(JITRuntime, globals), mInt));
+            set(ins.a, B.CreateAdd(globals, constant(ins.b)));
+            break;
+         }
+         case OP_FADDR:  set(ins.a, B.CreateAdd(mFrameMem, constant(ins.b))); break;
+         case OP_JMP:    B.CreateBr(mBlocks[ins.a]); break;
+         case OP_JZ:
+            B.CreateCondBr(B.CreateICmpEQ(get(ins.a), constant(0)), mBlocks[ins.b], mBlocks[i + 1]);
+            break;
+         case OP_JNZ:
+            B.CreateCondBr(B.CreateICmpNE(get(ins.a), constant(0)), mBlocks[ins.b], mBlocks[i + 1]);
+            break;
+         case OP_CALL: {
+            llvm::Value * val = callback((uint64_t)(uintptr_t)&BytecodeInterpreter::nativeCall, mInt,
+                                         {mBytePtr, mInt, mIntPtr}, {mRuntime, constant(ins.b), reg(ins.c)});
+            checkFailed();
+            if (ins.a >= 0)
+               set(ins.a, val);
+            break;
+         }
+         case OP_RET:    B.CreateRet(get(ins.a)); break;
+         case OP_RETV:   B.CreateRet(constant(0)); break;
+         case OP_GET:
+            set(ins.a, callback((uint64_t)(uintptr_t)&BytecodeInterpreter::nativeGet, mInt,
+                                {mBytePtr}, {mRuntime}));
+            break;
+         case OP_PRINT:
+            callback((uint64_t)(uintptr_t)&BytecodeInterpreter::nativePrint, mVoid,
+                     {mBytePtr, mInt}, {mRuntime, get(ins.a)});
+            break;
+         case OP_MALLOC:
+            set(ins.a, callback((uint64_t)(uintptr_t)&BytecodeInterpreter::nativeMalloc, mInt,
+                                {mBytePtr, mInt}, {mRuntime, get(ins.b)}));
+            break;
+         case OP_FREE:
+            callback((uint64_t)(uintptr_t)&BytecodeInterpreter::nativeFree, mVoid,
+                     {mBytePtr, mInt, mInt}, {mRuntime, get(ins.a), constant(mIndex)});
+            checkFailed();
+            break;
+         case OP_COUNT:
+            break;
+         }
+      }
+   public:
+      Emitter(const BytecodeFunction & function, int index, llvm::LLVMContext & context)
+      : mFunction(function), mIndex(index), mContext(context), B(context), F(NULL),
+        mVoid(llvm::Type::getVoidTy(context)), mByte(llvm::Type::getInt8Ty(context)),
+        mInt(llvm::Type::getInt32Ty(context)), mLong(llvm::Type::getInt64Ty(context)),
+        mBytePtr(llvm::PointerType::getUnqual(mByte)), mIntPtr(llvm::PointerType::getUnqual(mInt)),
+        mRuntime(NULL), mRegs(NULL), mFrameMem(NULL), mExit(NULL), mDivideByZero(NULL), mBlocks() {
+      }
+
+      /// NULL if the code has a jump out of the function
+      llvm::Function * emit(llvm::Module & module, const std::string & name) {
+         const std::vector<Instruction> & code = mFunction.code;
+         const int size = code.size();
+         if (size == 0)
+            return NULL;
+         for (int i = 0; i < size; ++ i) {
+            if (isJump(code[i].op) && (getTarget(code[i]) < 0 || getTarget(code[i]) >= size || i + 1 == size))
+               return NULL;
+         }
+
+         llvm::Type * params[] = { mBytePtr, mIntPtr, mInt, mInt };
+         llvm::FunctionType * type = llvm::FunctionType::get(mInt, params, false);
+         F = llvm::Function::Create(type, llvm::Function::ExternalLinkage, name, &module);
+         F->addParamAttr(1, llvm::Attribute::NoAlias);
+         llvm::Function::arg_iterator arg = F->arg_begin();
+         mRuntime = &*arg++;
+         mRegs = &*arg++;
+         mFrameMem = &*arg++;
+         llvm::Value * entry = &*arg;
+
+         llvm::BasicBlock * entryBlock = llvm::BasicBlock::Create(mContext, "entry", F);
+         mExit = llvm::BasicBlock::Create(mContext, "exit", F);
+         B.SetInsertPoint(mExit);
+         B.CreateRet(constant(0));
+         mDivideByZero = llvm::BasicBlock::Create(mContext, "divideByZero", F);
+         B.SetInsertPoint(mDivideByZero);
+         callback((uint64_t)(uintptr_t)&BytecodeInterpreter::nativeDivideByZero, mVoid,
+                  {mBytePtr, mInt}, {mRuntime, constant(mIndex)});
+         B.CreateRet(constant(0));
+
+         /// a block starts at every jump target and after every jump or return
+         mBlocks.assign(size, NULL);
+         mBlocks[0] = llvm::BasicBlock::Create(mContext, "", F);
+         for (int i = 0; i < size; ++ i) {
+            Opcode op = code[i].op;
+            if (isJump(op) && mBlocks[getTarget(code[i])] == NULL)
+               mBlocks[getTarget(code[i])] = llvm::BasicBlock::Create(mContext, "", F);
+            if ((isJump(op) || op == OP_RET || op == OP_RETV) && i + 1 < size && mBlocks[i + 1] == NULL)
+               mBlocks[i + 1] = llvm::BasicBlock::Create(mContext, "", F);
+         }
+
+         /// a frame switching over from the interpreter comes in at a loop
+         /// header, which is where the interpreter counts a back-edge
+         B.SetInsertPoint(entryBlock);
+         llvm::SwitchInst * dispatch = B.CreateSwitch(entry, mBlocks[0]);
+         std::vector<bool> isEntry(size, false);
+         for (int i = 0; i < size; ++ i) {
+            if (isJump(code[i].op) && getTarget(code[i]) <= i && getTarget(code[i]) > 0)
+               isEntry[getTarget(code[i])] = true;
+         }
+         for (int i = 1; i < size; ++ i) {
+            if (isEntry[i])
+               dispatch->addCase(llvm::ConstantInt::get(llvm::cast<llvm::IntegerType>(mInt), i), mBlocks[i]);
+         }
+
+         for (int i = 0; i < size; ++ i) {
+            if (mBlocks[i] != NULL) {
+               if (B.GetInsertBlock()->getTerminator() == NULL)
+                  B.CreateBr(mBlocks[i]);
+               B.SetInsertPoint(mBlocks[i]);
+            }
+            emit(code[i], i);
+         }
+         if (B.GetInsertBlock()->getTerminator() == NULL)
+            B.CreateRet(constant(0));
+         return F;
+      }
+   };
+
+   bool init() {
+      if (mJIT || mIsBroken)
+         return !mIsBroken;
+      /// once per process, the programs of -run-tests start their jits together
+      static bool isTargetFailed = llvm::InitializeNativeTarget() || llvm::InitializeNativeTargetAsmPrinter();
+      (void)isTargetFailed;
+      llvm::Expected<std::unique_ptr<llvm::orc::LLJIT>> jit = llvm::orc::LLJITBuilder().create();
+      if (!jit) {
+         llvm::errs() << "jit: " << llvm::toString(jit.takeError()) << ", staying interpreted\n";
+         mIsBroken = true;
+         return false;
+      }
+      mJIT = std::move(*jit);
+      return true;
+   }
+
+   static void optimize(llvm::Module & module) {
+      llvm::LoopAnalysisManager LAM;
+      llvm::FunctionAnalysisManager FAM;
+      llvm::CGSCCAnalysisManager CGAM;
+      llvm::ModuleAnalysisManager MAM;
+      llvm::PassBuilder PB;
+      PB.registerModuleAnalyses(MAM);
+      PB.registerCGSCCAnalyses(CGAM);
+      PB.registerFunctionAnalyses(FAM);
+      PB.registerLoopAnalyses(LAM);
+      PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+#if LLVM_VERSION_MAJOR >= 14
+      llvm::ModulePassManager MPM = PB.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O2);
+#else
+      llvm::ModulePassManager MPM = PB.buildPerModuleDefaultPipeline(llvm::PassBuilder::OptimizationLevel::O2);
+#endif
+      MPM.run(module, MAM);
+   }
+public:
+   BytecodeJIT() : mJIT(), mIsBroken(false) {
+   }
+
+   virtual NativeFunction compile(const BytecodeProgram & program, int index) {
+      if (!init())
+         return NULL;
+      const BytecodeFunction & function = program.functions[index];
+      std::string name = function.name + "." + std::to_string(index);
+
+      std::unique_ptr<llvm::LLVMContext> context(new llvm::LLVMContext());
+      std::unique_ptr<llvm::Module> module(new llvm::Module(name, *context));
+      module->setDataLayout(mJIT->getDataLayout());
+      module->setTargetTriple(mJIT->getTargetTriple().str());
+      llvm::Function * fn = Emitter(function, index, *context).emit(*module, name);
+      if (fn == NULL || llvm::verifyFunction(*fn, &llvm::errs()))
+         return NULL;
+      optimize(*module);
+
+      llvm::Error err = mJIT->addIRModule(llvm::orc::ThreadSafeModule(std::move(module), std::move(context)));
+      if (err) {
+         llvm::errs() << "jit: " << llvm::toString(std::move(err)) << "\n";
+         return NULL;
+      }
+      auto symbol = mJIT->lookup(name);
+      if (!symbol) {
+         llvm::errs() << "jit: " << llvm::toString(symbol.takeError()) << "\n";
+         return NULL;
+      }
+#if LLVM_VERSION_MAJOR >= 15
+      return symbol->toPtr<NativeFunction>();
+#else
+      return (NativeFunction)symbol->getAddress();
+#endif
+   }
+#else
+public:
+   virtual NativeFunction compile(const BytecodeProgram & program, int index) {
+      return NULL;
+   }
+#endif
+};
+
+#endif
@@ -0,0 +1,330 @@
+//==--- tools/clang-check/ClangInterpreter.cpp - Clang Interpreter tool --------------===//
+//===----------------------------------------------------------------------===//
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "clang/AST/ASTConsumer.h"
+#include "clang/AST/Decl.h"
+#include "clang/AST/RecursiveASTVisitor.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/FrontendAction.h"
+#include "clang/Tooling/Tooling.h"
+
+#include "llvm/ADT/DenseMap.h"
+
+#include "Heap.h"
+#include "ProgramIO.h"
+#include "ValueStack.h"
+
+using namespace clang;
+
+/// The slot of every global, parameter, local and expression of a function,
+/// numbered once the first time the function runs
+class SlotLayout {
+   llvm::DenseMap<const void *, int> mSlots;
+
+   void number(Stmt * stmt) {
+      if (stmt == NULL)
+         return;
+      if (DeclStmt * declstmt = dyn_cast<DeclStmt>(stmt)) {
+         for (DeclStmt::decl_iterator it = declstmt->decl_begin(), ie = declstmt->decl_end();
+               it != ie; ++ it)
+            if (VarDecl * vardecl = dyn_cast<VarDecl>(*it))
+               insert(vardecl);
+      }
+      else if (isa<Expr>(stmt)) {
+         insert(stmt);
+      }
+      for (Stmt::child_iterator it = stmt->child_begin(), ie = stmt->child_end(); it != ie; ++ it)
+         number(*it);
+   }
+   void insert(const void * key) {
+      mSlots.insert(std::make_pair(key, (int)mSlots.size()));
+   }
+public:
+   SlotLayout(FunctionDecl * fdecl, const std::vector<VarDecl *> & globals) : mSlots() {
+      for (size_t i = 0; i < globals.size(); ++ i)
+         insert(globals[i]);
+      for (unsigned i = 0; i < fdecl->getNumParams(); ++ i)
+         insert(fdecl->getParamDecl(i));
+      number(fdecl->getBody());
+   }
+
+   int getSlot(const void * key) const {
+      llvm::DenseMap<const void *, int>::const_iterator it = mSlots.find(key);
+      assert (it != mSlots.end());
+      return it->second;
+   }
+   int size() const {
+      return mSlots.size();
+   }
+};
+
+class StackFrame {
+   /// StackFrame maps Variable Declaration to Value
+   /// Which are either integer or addresses (also represented using an Integer value)
+   /// The values are a slice of the value stack, indexed by the slots of the function
+   const SlotLayout * mLayout;
+   int * mSlots;
+   /// The current stmt
+   Stmt * mPC;
+   /// The value of the last return
+   int mRetVal;
+public:
+   StackFrame(const SlotLayout * layout, int * slots) : mLayout(layout), mSlots(slots), mPC(), mRetVal(0) {
+   }
+
+   const SlotLayout * getLayout() {
+      return mLayout;
+   }
+
+   void bindDecl(Decl* decl, int val) {
+      mSlots[mLayout->getSlot(decl)] = val;
+   }    
+   int getDeclVal(Decl * decl) {
+      return mSlots[mLayout->getSlot(decl)];
+   }
+   void bindStmt(Stmt * stmt, int val) {
+	   mSlots[mLayout->getSlot(stmt)] = val;
+   }
+   int getStmtVal(Stmt * stmt) {
+	   return mSlots[mLayout->getSlot(stmt)];
+   }
+   void setPC(Stmt * stmt) {
+	   mPC = stmt;
+   }
+   Stmt * getPC() {
+	   return mPC;
+   }
+   void setRetVal(int val) {
+	   mRetVal = val;
+   }
+   int getRetVal() {
+	   return mRetVal;
+   }
+};
+
+/// What a call site calls, resolved the first time it runs
+struct CallTarget {
+   enum Kind { Unknown, User, Input, Output, Malloc, Free };
+   Kind kind;
+   FunctionDecl * definition;			/// the body of a User call
+   unsigned numParams;
+   const SlotLayout * layout;
+};
+
+/// A StackFrame is a view of a value stack slice, so frames are pooled for
+/// free: popping one keeps the capacity of mStack and of mValues for the next
+/// call, nothing is allocated per call once the stack has been that deep.
+class Environment {
+   std::vector<StackFrame> mStack;
+   ValueStack mValues;
+   std::map<FunctionDecl *, SlotLayout *> mLayouts;
+   llvm::DenseMap<CallExpr *, CallTarget> mCallSites;
+   std::vector<VarDecl *> mGlobals;
+   Heap mHeap;
+   ProgramIO mIO;
+
+   FunctionDecl * mFree;				/// Declartions to the built-in functions
+   FunctionDecl * mMalloc;
+   FunctionDecl * mInput;
+   FunctionDecl * mOutput;
+
+   FunctionDecl * mEntry;
+   std::string mError;				/// why the program stopped, empty while it runs
+public:
+   /// Get the declartions to the built-in functions; PRINT writes to os
+   explicit Environment(llvm::raw_ostream & os = llvm::errs()) : mStack(), mValues(), mLayouts(), mCallSites(), mGlobals(), mHeap(), mIO(os), mFree(NULL), mMalloc(NULL), mInput(NULL), mOutput(NULL), mEntry(NULL), mError() {
+   }
+
+
+   ~Environment() {
+	   for (std::map<FunctionDecl *, SlotLayout *>::iterator it = mLayouts.begin(); it != mLayouts.end(); ++ it)
+		   delete it->second;
+   }
+
+   /// Initialize the Environment
+   void init(TranslationUnitDecl * unit) {
+	   for (TranslationUnitDecl::decl_iterator i =unit->decls_begin(), e = unit->decls_end(); i != e; ++ i) {
+		   if (FunctionDecl * fdecl = dyn_cast<FunctionDecl>(*i) ) {
+			   if (fdecl->getName().equals("FREE")) mFree = fdecl;
+			   else if (fdecl->getName().equals("MALLOC")) mMalloc = fdecl;
+			   else if (fdecl->getName().equals("GET")) mInput = fdecl;
+			   else if (fdecl->getName().equals("PRINT")) mOutput = fdecl;
+			   else if (fdecl->getName().equals("main")) mEntry = fdecl;
+		   }
+		   else if (VarDecl * vardecl = dyn_cast<VarDecl>(*i)) {
+			   mGlobals.push_back(vardecl);
+		   }
+	   }
+	   if (mEntry != NULL)
+		   pushFrame(mEntry);
+   }
+
+   const SlotLayout * getLayout(FunctionDecl * fdecl) {
+	   SlotLayout *& layout = mLayouts[fdecl];
+	   if (layout == NULL)
+		   layout = new SlotLayout(fdecl, mGlobals);
+	   return layout;
+   }
+
+   /// A frame for fdecl on top of the value stack, false with the error set
+   /// when the stack is full
+   bool pushFrame(FunctionDecl * fdecl, const SlotLayout * layout) {
+	   int * slots = mValues.push(layout->size());
+	   if (slots == NULL) {
+		   mError = "stack overflow in " + fdecl->getNameAsString();
+		   return false;
+	   }
+	   mStack.push_back(StackFrame(layout, slots));
+	   return true;
+   }
+   bool pushFrame(FunctionDecl * fdecl) {
+	   return pushFrame(fdecl, getLayout(fdecl));
+   }
+   void popFrame() {
+	   mValues.pop(mStack.back().getLayout()->size());
+	   mStack.pop_back();
+   }
+
+   /// The target of callexpr, the callee is looked up once per call site
+   CallTarget getCallTarget(CallExpr * callexpr) {
+	   llvm::DenseMap<CallExpr *, CallTarget>::iterator it = mCallSites.find(callexpr);
+	   if (it != mCallSites.end())
+		   return it->second;
+
+	   CallTarget target = { CallTarget::Unknown, NULL, 0, NULL };
+	   FunctionDecl * callee = callexpr->getDirectCallee();
+	   if (callee != NULL) {
+		   callee = callee->getCanonicalDecl();
+		   const FunctionDecl * definition = NULL;
+		   if (mInput != NULL && callee == mInput->getCanonicalDecl())
+			   target.kind = CallTarget::Input;
+		   else if (mOutput != NULL && callee == mOutput->getCanonicalDecl())
+			   target.kind = CallTarget::Output;
+		   else if (mMalloc != NULL && callee == mMalloc->getCanonicalDecl())
+			   target.kind = CallTarget::Malloc;
+		   else if (mFree != NULL && callee == mFree->getCanonicalDecl())
+			   target.kind = CallTarget::Free;
+		   else if (callee->hasBody(definition)) {
+			   target.kind = CallTarget::User;
+			   target.definition = const_cast<FunctionDecl *>(definition);
+			   target.numParams = definition->getNumParams();
+			   target.layout = getLayout(target.definition);
+		   }
+	   }
+	   mCallSites[callexpr] = target;
+	   return target;
+   }
+
+   FunctionDecl * getEntry() {
+	   return mEntry;
+   }
+   /// The walk stops at the first error
+   bool hasError() {
+	   return !mError.empty();
+   }
+   const std::string & getError() {
+	   return mError;
+   }
+   Heap & getHeap() {
+	   return mHeap;
+   }
+   ValueStack & getValueStack() {
+	   return mValues;
+   }
+   ProgramIO & getIO() {
+	   return mIO;
+   }
+
+   /// !TODO Support comparison operation
+   void binop(BinaryOperator *bop) {
+	   Expr * left = bop->getLHS();
+	   Expr * right = bop->getRHS();
+
+	   if (bop->isAssignmentOp()) {
+		   int val = mStack.back().getStmtVal(right);
+		   mStack.back().bindStmt(left, val);
+		   if (DeclRefExpr * declexpr = dyn_cast<DeclRefExpr>(left)) {
+			   Decl * decl = declexpr->getFoundDecl();
+			   mStack.back().bindDecl(decl, val);
+		   }
+	   }
+   }
+
+   void decl(DeclStmt * declstmt) {
+	   for (DeclStmt::decl_iterator it = declstmt->decl_begin(), ie = declstmt->decl_end();
+			   it != ie; ++ it) {
+		   Decl * decl = *it;
+		   if (VarDecl * vardecl = dyn_cast<VarDecl>(decl)) {
+			   mStack.back().bindDecl(vardecl, 0);
+		   }
+	   }
+   }
+   void declref(DeclRefExpr * declref) {
+	   mStack.back().setPC(declref);
+	   if (declref->getType()->isIntegerType()) {
+		   Decl* decl = declref->getFoundDecl();
+
+		   int val = mStack.back().getDeclVal(decl);
+		   mStack.back().bindStmt(declref, val);
+	   }
+   }
+
+   void cast(CastExpr * castexpr) {
+	   mStack.back().setPC(castexpr);
+	   if (castexpr->getType()->isIntegerType()) {
+		   Expr * expr = castexpr->getSubExpr();
+		   int val = mStack.back().getStmtVal(expr);
+		   mStack.back().bindStmt(castexpr, val );
+	   }
+   }
+
+   /// A builtin runs here; for a user function the frame of the callee is
+   /// pushed with its arguments and its body returned to be walked, then leave()
+   FunctionDecl * call(CallExpr * callexpr) {
+	   mStack.back().setPC(callexpr);
+	   int val = 0;
+	   CallTarget target = getCallTarget(callexpr);
+	   switch (target.kind) {
+	   case CallTarget::Input:
+		  val = mIO.get();
+		  mStack.back().bindStmt(callexpr, val);
+		  return NULL;
+	   case CallTarget::Output:
+		   val = mStack.back().getStmtVal(callexpr->getArg(0));
+		   mIO.print(val);
+		   return NULL;
+	   case CallTarget::Malloc:
+		   val = mStack.back().getStmtVal(callexpr->getArg(0));
+		   mStack.back().bindStmt(callexpr, mHeap.Malloc(val));
+		   return NULL;
+	   case CallTarget::Free:
+		   mHeap.Free(mStack.back().getStmtVal(callexpr->getArg(0)));
+		   return NULL;
+	   case CallTarget::User:
+		   break;
+	   default:
+		   return NULL;
+	   }
+
+	   if (!pushFrame(target.definition, target.layout))
+		   return NULL;
+	   StackFrame & caller = mStack[mStack.size() - 2];
+	   for (unsigned i = 0; i < target.numParams && i < callexpr->getNumArgs(); ++ i)
+		   mStack.back().bindDecl(target.definition->getParamDecl(i), caller.getStmtVal(callexpr->getArg(i)));
+	   return target.definition;
+   }
+   void ret(ReturnStmt * retstmt) {
+	   if (Expr * value = retstmt->getRetValue())
+		   mStack.back().setRetVal(mStack.back().getStmtVal(value));
+   }
+   /// Back from the body of the callee of callexpr
+   void leave(CallExpr * callexpr) {
+	   int val = mStack.back().getRetVal();
+	   popFrame();
+	   mStack.back().bindStmt(callexpr, val);
+   }
+};
+
+
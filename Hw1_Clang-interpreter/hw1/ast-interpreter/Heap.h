@@ -0,0 +1,175 @@
+//==--- Heap.h - Memory of the interpreted program ---------------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_HEAP_H
+#define AST_INTERPRETER_HEAP_H
+
+#include <limits.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+/// Heap maps address to a value
+///
+/// Memory is one growable byte arena, an address is an offset into it, so
+/// pointers are integers like every other value and an access is an index.
+/// Address 0 is never allocated and stays NULL.
+///
+/// Every block has an 8 byte header before it with its capacity. Capacities are
+/// multiples of 8 up to 256 bytes and powers of two above, each capacity is a
+/// size class with a free list threaded through the freed blocks, so MALLOC and
+/// FREE are constant time and a freed block is reused by the next request of
+/// its class.
+///
+/// In debug mode one shadow byte per 8 bytes of arena tells whether they are in
+/// a live block, a freed block or neither (headers, tails of blocks). Freed
+/// blocks are then never reused, so a stale pointer keeps pointing to freed
+/// memory, and getAccessError() reports out-of-bounds and use-after-free.
+class Heap {
+   static const int HeaderSize = 8;
+   static const int SmallLimit = 256;
+   static const int NumClasses = SmallLimit / 8 + 23;
+   static const int LiveMagic = 0x4c495645;
+   static const int FreeMagic = 0x46524545;
+   enum Shadow { Unmapped, Live, Freed };
+
+   std::vector<char> mMemory;
+   int mTop;                        /// end of the blocks carved so far
+   int mFreeLists[NumClasses];      /// first free block of each class, 0 for none
+   bool mDebug;
+   std::vector<char> mShadow;
+
+   static int roundSize(int size) {
+      if (size <= SmallLimit)
+         return size <= 0 ? 8 : (size + 7) & ~7;
+      int rounded = SmallLimit * 2;
+      while (rounded < size)
+         rounded *= 2;
+      return rounded;
+   }
+   static int getClass(int rounded) {
+      if (rounded <= SmallLimit)
+         return rounded / 8 - 1;
+      int cls = SmallLimit / 8;
+      for (int capacity = SmallLimit * 2; capacity < rounded; capacity *= 2)
+         ++ cls;
+      return cls;
+   }
+
+   int getCapacity(int addr) {
+      return get(addr - HeaderSize);
+   }
+   int getMagic(int addr) {
+      return get(addr - HeaderSize + 4);
+   }
+   void setHeader(int addr, int capacity, int magic) {
+      Update(addr - HeaderSize, capacity);
+      Update(addr - HeaderSize + 4, magic);
+   }
+
+   /// a new block at the end of the arena, 0 when the addresses run out
+   int carve(int capacity) {
+      if ((long long)mTop + HeaderSize + capacity > INT_MAX)
+         return 0;
+      int addr = mTop + HeaderSize;
+      mTop = addr + capacity;
+      if ((size_t)mTop > mMemory.size())
+         mMemory.resize(std::max((size_t)mTop, 2 * mMemory.size()));
+      if (mDebug && (size_t)mTop / 8 > mShadow.size())
+         mShadow.resize(std::max((size_t)mTop / 8, 2 * mShadow.size()), Unmapped);
+      return addr;
+   }
+   void mark(int addr, int size, Shadow state) {
+      for (int i = addr / 8; i < (addr + size + 7) / 8; ++ i)
+         mShadow[i] = state;
+   }
+public:
+   Heap() : mMemory(1 << 16), mTop(HeaderSize), mDebug(false), mShadow() {
+      for (int i = 0; i < NumClasses; ++ i)
+         mFreeLists[i] = 0;
+   }
+
+   /// Check the accesses, before the first Malloc
+   void setDebug(bool debug) {
+      mDebug = debug;
+      if (mDebug)
+         mShadow.assign(mMemory.size() / 8, Unmapped);
+   }
+   bool isDebug() {
+      return mDebug;
+   }
+
+   int Malloc(int size) {
+      if (size < 0 || size > (1 << 30))
+         return 0;
+      int capacity = roundSize(size);
+      int cls = getClass(capacity);
+      int addr = mFreeLists[cls];
+      if (addr != 0)
+         mFreeLists[cls] = get(addr);
+      else if ((addr = carve(capacity)) == 0)
+         return 0;
+
+      setHeader(addr, capacity, LiveMagic);
+      if (mDebug) {
+         mark(addr, capacity, Unmapped);
+         mark(addr, size, Live);
+      }
+      return addr;
+   }
+   /// false if addr is no live block
+   bool Free (int addr) {
+      if (addr == 0)
+         return true;
+      if (addr < 2 * HeaderSize || addr > mTop || addr % 8 != 0 || getMagic(addr) != LiveMagic)
+         return false;
+
+      int capacity = getCapacity(addr);
+      setHeader(addr, capacity, FreeMagic);
+      if (mDebug) {
+         mark(addr, capacity, Freed);
+         return true;
+      }
+      int cls = getClass(capacity);
+      Update(addr, mFreeLists[cls]);
+      mFreeLists[cls] = addr;
+      return true;
+   }
+
+   /// What is wrong with accessing size bytes at addr, NULL if nothing;
+   /// outside of debug mode only the arena bounds are known
+   const char * getAccessError(int addr, int size) {
+      if (addr < HeaderSize || addr > mTop - size)
+         return addr == 0 ? "null pointer access" : "access out of the heap";
+      if (!mDebug)
+         return NULL;
+      for (int i = addr / 8; i <= (addr + size - 1) / 8; ++ i) {
+         if (mShadow[i] == Freed)
+            return "use after free";
+         if (mShadow[i] != Live)
+            return "access out of bounds";
+      }
+      return NULL;
+   }
+
+   /// The arena, valid until the next Malloc
+   char * getMemory() {
+      return &mMemory[0];
+   }
+
+   void Update(int addr, int val) {
+      memcpy(&mMemory[0] + addr, &val, sizeof(int));
+   }
+   int get(int addr) {
+      int val;
+      memcpy(&val, &mMemory[0] + addr, sizeof(int));
+      return val;
+   }
+   void UpdateByte(int addr, int val) {
+      mMemory[addr] = (char)val;
+   }
+   int getByte(int addr) {
+      return (signed char)mMemory[addr];
+   }
+};
+
+#endif
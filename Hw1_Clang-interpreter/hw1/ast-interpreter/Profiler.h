@@ -0,0 +1,163 @@
+//==--- Profiler.h - Where a run of the interpreted program spends its time ---===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_PROFILER_H
+#define AST_INTERPRETER_PROFILER_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Bytecode.h"
+
+/// Counts every instruction the interpreter runs, and every SampleInstructions
+/// instructions charges the time since the last sample to the call stack of
+/// that moment: self time to the statement and function on top, total time to
+/// every function on the stack, and the whole sample to the folded stack.
+///
+/// The executions of a statement are those of its first instruction. The
+/// interpreter only calls into the Profiler from its profiling instantiation,
+/// a run without one executes exactly the code it did before.
+class Profiler {
+   static const unsigned SampleInstructions = 1024;
+   typedef std::chrono::steady_clock Clock;
+
+   const BytecodeProgram * mProgram;
+   std::vector<std::vector<uint64_t> > mCounts;   /// of every instruction
+   std::vector<uint64_t> mCalls;
+   std::vector<uint64_t> mSelfTime;               /// nanoseconds, per function
+   std::vector<uint64_t> mTotalTime;
+   std::vector<uint64_t> mStatementTime;
+   std::map<std::string, uint64_t> mStacks;       /// folded stack to nanoseconds
+   unsigned mCountdown;
+   Clock::time_point mLast;
+
+   static double toMillis(uint64_t nanos) {
+      return nanos / 1e6;
+   }
+public:
+   /// A frame of a sampled stack, the function and the instruction running in it
+   typedef std::pair<int, int> Frame;
+
+   Profiler() : mProgram(NULL), mCountdown(SampleInstructions) {
+   }
+
+   void start(const BytecodeProgram & program) {
+      mProgram = &program;
+      mCounts.resize(program.functions.size());
+      for (size_t i = 0; i < program.functions.size(); ++ i)
+         mCounts[i].assign(program.functions[i].code.size(), 0);
+      mCalls.assign(program.functions.size(), 0);
+      mSelfTime.assign(program.functions.size(), 0);
+      mTotalTime.assign(program.functions.size(), 0);
+      mStatementTime.assign(program.statements.size(), 0);
+      mStacks.clear();
+      mCountdown = SampleInstructions;
+      mLast = Clock::now();
+   }
+
+   void enter(int function) {
+      ++ mCalls[function];
+   }
+   /// true when a sample is due
+   bool count(int function, int ins) {
+      ++ mCounts[function][ins];
+      if (-- mCountdown != 0)
+         return false;
+      mCountdown = SampleInstructions;
+      return true;
+   }
+   /// stack is outermost first
+   void sample(const std::vector<Frame> & stack) {
+      Clock::time_point now = Clock::now();
+      uint64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(now - mLast).count();
+      mLast = now;
+      if (stack.empty())
+         return;
+
+      const Frame & top = stack.back();
+      mSelfTime[top.first] += nanos;
+      int stmt = mProgram->functions[top.first].stmts[top.second];
+      if (stmt >= 0)
+         mStatementTime[stmt] += nanos;
+
+      std::string folded;
+      std::vector<bool> isCounted(mProgram->functions.size(), false);
+      for (size_t i = 0; i < stack.size(); ++ i) {
+         int function = stack[i].first;
+         if (!isCounted[function]) {
+            isCounted[function] = true;
+            mTotalTime[function] += nanos;
+         }
+         if (i != 0)
+            folded += ';';
+         folded += mProgram->functions[function].name;
+      }
+      mStacks[folded] += nanos;
+   }
+
+   /// The functions and then the statements, hottest first
+   void report(llvm::raw_ostream & os) const {
+      std::vector<std::pair<uint64_t, int> > functions;
+      for (size_t i = 0; i < mCalls.size(); ++ i)
+         functions.push_back(std::make_pair(mSelfTime[i], (int)i));
+      std::sort(functions.rbegin(), functions.rend());
+
+      os << "profile: functions by self time\n";
+      os << "     self ms    total ms        calls  function\n";
+      for (size_t i = 0; i < functions.size(); ++ i) {
+         int f = functions[i].second;
+         const BytecodeFunction & function = mProgram->functions[f];
+         os << llvm::format("%12.3f%12.3f%13llu  ", toMillis(mSelfTime[f]), toMillis(mTotalTime[f]),
+                            (unsigned long long)mCalls[f])
+            << function.name << " (" << function.location << ")\n";
+      }
+
+      /// the executions of a statement are those of its first instruction
+      std::vector<uint64_t> executions(mStatementTime.size(), 0);
+      std::vector<uint64_t> instructions(mStatementTime.size(), 0);
+      std::vector<bool> isSeen(mStatementTime.size(), false);
+      for (size_t f = 0; f < mCounts.size(); ++ f) {
+         const std::vector<int> & stmts = mProgram->functions[f].stmts;
+         for (size_t i = 0; i < stmts.size(); ++ i) {
+            if (stmts[i] < 0)
+               continue;
+            if (!isSeen[stmts[i]]) {
+               isSeen[stmts[i]] = true;
+               executions[stmts[i]] = mCounts[f][i];
+            }
+            instructions[stmts[i]] += mCounts[f][i];
+         }
+      }
+      std::vector<std::pair<std::pair<uint64_t, uint64_t>, int> > statements;
+      for (size_t s = 0; s < mStatementTime.size(); ++ s) {
+         if (instructions[s] != 0)
+            statements.push_back(std::make_pair(std::make_pair(mStatementTime[s], instructions[s]), (int)s));
+      }
+      std::sort(statements.rbegin(), statements.rend());
+
+      os << "profile: statements by self time\n";
+      os << "     self ms   executions  instructions  statement\n";
+      for (size_t i = 0; i < statements.size(); ++ i) {
+         int s = statements[i].second;
+         os << llvm::format("%12.3f%13llu%14llu  ", toMillis(mStatementTime[s]),
+                            (unsigned long long)executions[s], (unsigned long long)instructions[s])
+            << mProgram->statements[s].location << " " << mProgram->statements[s].kind << "\n";
+      }
+   }
+   /// One "outer;...;inner microseconds" line per stack, for flame graph tools
+   void writeFolded(llvm::raw_ostream & os) const {
+      for (std::map<std::string, uint64_t>::const_iterator it = mStacks.begin(); it != mStacks.end(); ++ it) {
+         if (it->second >= 1000)
+            os << it->first << " " << it->second / 1000 << "\n";
+      }
+   }
+};
+
+#endif
@@ -0,0 +1,289 @@
+//==--- ProgramCache.h - Compiled programs kept on disk ------------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_PROGRAMCACHE_H
+#define AST_INTERPRETER_PROGRAMCACHE_H
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Bytecode.h"
+
+/// A BytecodeProgram is stored in dir under the MD5 of the format version, the
+/// path and the source, so a script run again is not parsed again. The file is
+/// little-endian 32 bit words, strings a length and their bytes:
+///
+///   "HW1B" version entry globalBytes
+///   globalInits  count, offset size value each
+///   statements   count, location kind each
+///   functions    count, name location numParams numRegs frameBytes codeSize,
+///                then op a b c stmt for every instruction
+///
+/// A file that does not read back whole, or whose operands do not fit the
+/// program, is a miss. A new file is written under a unique name and renamed,
+/// so concurrent runs never see half of one.
+class ProgramCache {
+   /// Format changes with the layout of the file or the meaning of an opcode,
+   /// a new opcode changes the version by itself
+   static const uint32_t Format = 1;
+   static const uint32_t Version = Format << 16 | OP_COUNT;
+
+   std::string mDir;
+
+   class Reader {
+      const char * mPos;
+      const char * mEnd;
+      bool mIsBad;
+   public:
+      Reader(const char * begin, const char * end) : mPos(begin), mEnd(end), mIsBad(false) {
+      }
+      bool isGood() {
+         return !mIsBad && mPos == mEnd;
+      }
+      int read() {
+         if (mEnd - mPos < 4) {
+            mIsBad = true;
+            return 0;
+         }
+         const unsigned char * u = (const unsigned char *)mPos;
+         mPos += 4;
+         return (int)((uint32_t)u[0] | ((uint32_t)u[1] << 8) | ((uint32_t)u[2] << 16) | ((uint32_t)u[3] << 24));
+      }
+      /// a count of at least size bytes each, 0 if the file is too short for it
+      size_t readCount(size_t size) {
+         int count = read();
+         if (count < 0 || (size_t)(mEnd - mPos) / size < (size_t)count) {
+            mIsBad = true;
+            return 0;
+         }
+         return count;
+      }
+      std::string readString() {
+         size_t size = readCount(1);
+         std::string str(mPos, size);
+         mPos += size;
+         return str;
+      }
+   };
+
+   static void write(llvm::raw_ostream & os, int val) {
+      uint32_t v = val;
+      char b[4] = { (char)v, (char)(v >> 8), (char)(v >> 16), (char)(v >> 24) };
+      os.write(b, 4);
+   }
+   static void write(llvm::raw_ostream & os, const std::string & str) {
+      write(os, (int)str.size());
+      os << str;
+   }
+
+   static bool isInRange(int val, size_t end) {
+      return val >= 0 && (size_t)val < end;
+   }
+   /// every register, jump target, function and offset of inst is in function and program
+   static bool isValid(const BytecodeProgram & program, const BytecodeFunction & function,
+                       const Instruction & inst) {
+      size_t regs = function.numRegs;
+      switch (inst.op) {
+      case OP_LOADK: case OP_GET:
+      case OP_RET: case OP_PRINT: case OP_FREE:
+         return isInRange(inst.a, regs);
+      /// the address of an empty array may be the end of the memory
+      case OP_GADDR:
+         return isInRange(inst.a, regs) && isInRange(inst.b, program.globalBytes + 1);
+      case OP_FADDR:
+         return isInRange(inst.a, regs) && isInRange(inst.b, function.frameBytes + 1);
+      case OP_MOV: case OP_ADDI: case OP_MULI: case OP_NEG: case OP_NOT: case OP_SEXT8:
+      case OP_LOAD: case OP_LOADB: case OP_STORE: case OP_STOREB: case OP_MALLOC:
+         return isInRange(inst.a, regs) && isInRange(inst.b, regs);
+      case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_REM:
+      case OP_LT: case OP_GT: case OP_LE: case OP_GE: case OP_EQ: case OP_NE:
+         return isInRange(inst.a, regs) && isInRange(inst.b, regs) && isInRange(inst.c, regs);
+      case OP_JMP:
+         return isInRange(inst.a, function.code.size());
+      case OP_JZ: case OP_JNZ:
+         return isInRange(inst.a, regs) && isInRange(inst.b, function.code.size());
+      case OP_CALL:
+         /// a of -1 drops the returned value
+         return inst.a >= -1 && inst.a < function.numRegs && isInRange(inst.b, program.functions.size()) &&
+                isInRange(inst.c, regs);
+      case OP_RETV:
+         return true;
+      case OP_COUNT:
+         break;
+      }
+      return false;
+   }
+   static bool isValid(const BytecodeProgram & program) {
+      if (!isInRange(program.entry, program.functions.size()) || program.globalBytes < 0)
+         return false;
+      for (size_t i = 0; i < program.globalInits.size(); ++ i) {
+         const GlobalInit & init = program.globalInits[i];
+         if ((init.size != 1 && init.size != 4) || init.offset < 0 || init.offset > program.globalBytes - init.size)
+            return false;
+      }
+      for (size_t i = 0; i < program.functions.size(); ++ i) {
+         const BytecodeFunction & function = program.functions[i];
+         if (function.numParams < 0 || function.numRegs < function.numParams || function.frameBytes < 0)
+            return false;
+         /// the last instruction never falls through past the end
+         if (function.code.empty())
+            return false;
+         Opcode last = function.code.back().op;
+         if (last != OP_JMP && last != OP_RET && last != OP_RETV)
+            return false;
+         for (size_t j = 0; j < function.code.size(); ++ j) {
+            if (!isValid(program, function, function.code[j]))
+               return false;
+            if (function.stmts[j] != -1 && !isInRange(function.stmts[j], program.statements.size()))
+               return false;
+         }
+      }
+      return true;
+   }
+
+   std::string getPath(const std::string & key) {
+      llvm::SmallString<128> path(mDir);
+      llvm::sys::path::append(path, key + ".hw1b");
+      return path.str().str();
+   }
+public:
+   explicit ProgramCache(const std::string & dir) : mDir(dir) {
+   }
+
+   static std::string getKey(const std::string & path, const std::string & source) {
+      llvm::MD5 md5;
+      std::string version = std::to_string(Version);
+      md5.update(llvm::StringRef(version.c_str(), version.size() + 1));
+      md5.update(llvm::StringRef(path.c_str(), path.size() + 1));
+      md5.update(source);
+      llvm::MD5::MD5Result result;
+      md5.final(result);
+      llvm::SmallString<32> hex;
+      llvm::MD5::stringifyResult(result, hex);
+      return hex.str().str();
+   }
+
+   /// false on a miss
+   bool load(const std::string & key, BytecodeProgram & program) {
+      llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFile(getPath(key));
+      if (!buffer)
+         return false;
+      llvm::StringRef data = (*buffer)->getBuffer();
+      if (!data.startswith("HW1B"))
+         return false;
+      Reader in(data.begin() + 4, data.end());
+      if (in.read() != (int)Version)
+         return false;
+
+      BytecodeProgram loaded;
+      loaded.entry = in.read();
+      loaded.globalBytes = in.read();
+      loaded.globalInits.resize(in.readCount(12));
+      for (size_t i = 0; i < loaded.globalInits.size(); ++ i) {
+         GlobalInit & init = loaded.globalInits[i];
+         init.offset = in.read();
+         init.size = in.read();
+         init.value = in.read();
+      }
+      loaded.statements.resize(in.readCount(8));
+      for (size_t i = 0; i < loaded.statements.size(); ++ i) {
+         loaded.statements[i].location = in.readString();
+         loaded.statements[i].kind = in.readString();
+      }
+      loaded.functions.resize(in.readCount(28));
+      for (size_t i = 0; i < loaded.functions.size(); ++ i) {
+         BytecodeFunction & function = loaded.functions[i];
+         function.name = in.readString();
+         function.location = in.readString();
+         function.numParams = in.read();
+         function.numRegs = in.read();
+         function.frameBytes = in.read();
+         size_t size = in.readCount(20);
+         function.code.resize(size);
+         function.stmts.resize(size);
+         for (size_t j = 0; j < size; ++ j) {
+            int op = in.read();
+            if (op < 0 || op >= OP_COUNT)
+               return false;
+            Instruction inst = { (Opcode)op, in.read(), in.read(), in.read() };
+            function.code[j] = inst;
+            function.stmts[j] = in.read();
+         }
+      }
+      if (!in.isGood() || !isValid(loaded))
+         return false;
+      program = loaded;
+      return true;
+   }
+
+   /// false with the reason in error if the program could not be stored
+   bool store(const std::string & key, const BytecodeProgram & program, std::string & error) {
+      std::error_code EC = llvm::sys::fs::create_directories(mDir);
+      int fd = -1;
+      llvm::SmallString<128> temp;
+      if (!EC)
+         EC = llvm::sys::fs::createUniqueFile(getPath(key) + ".%%%%%%%%", fd, temp);
+      if (EC) {
+         error = mDir + ": " + EC.message();
+         return false;
+      }
+      {
+         llvm::raw_fd_ostream os(fd, true);
+         os << "HW1B";
+         write(os, (int)Version);
+         write(os, program.entry);
+         write(os, program.globalBytes);
+         write(os, (int)program.globalInits.size());
+         for (size_t i = 0; i < program.globalInits.size(); ++ i) {
+            write(os, program.globalInits[i].offset);
+            write(os, program.globalInits[i].size);
+            write(os, program.globalInits[i].value);
+         }
+         write(os, (int)program.statements.size());
+         for (size_t i = 0; i < program.statements.size(); ++ i) {
+            write(os, program.statements[i].location);
+            write(os, program.statements[i].kind);
+         }
+         write(os, (int)program.functions.size());
+         for (size_t i = 0; i < program.functions.size(); ++ i) {
+            const BytecodeFunction & function = program.functions[i];
+            write(os, function.name);
+            write(os, function.location);
+            write(os, function.numParams);
+            write(os, function.numRegs);
+            write(os, function.frameBytes);
+            write(os, (int)function.code.size());
+            for (size_t j = 0; j < function.code.size(); ++ j) {
+               const Instruction & inst = function.code[j];
+               write(os, inst.op);
+               write(os, inst.a);
+               write(os, inst.b);
+               write(os, inst.c);
+               write(os, j < function.stmts.size() ? function.stmts[j] : -1);
+            }
+         }
+         if (os.has_error()) {
+            os.clear_error();
+            error = std::string(temp.str()) + ": write failed";
+            llvm::sys::fs::remove(temp);
+            return false;
+         }
+      }
+      EC = llvm::sys::fs::rename(temp, getPath(key));
+      if (EC) {
+         error = getPath(key) + ": " + EC.message();
+         llvm::sys::fs::remove(temp);
+         return false;
+      }
+      return true;
+   }
+};
+
+#endif
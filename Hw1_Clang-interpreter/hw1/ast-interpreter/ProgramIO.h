@@ -0,0 +1,116 @@
+//==--- ProgramIO.h - GET and PRINT of the interpreted program ----------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_PROGRAMIO_H
+#define AST_INTERPRETER_PROGRAMIO_H
+
+#include <stdio.h>
+#include <memory>
+#include <string>
+
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+/// PRINT goes to a buffer flushed to the output when it is full, before
+/// waiting for the terminal and at the end of the program.
+///
+/// GET reads an integer like scanf("%d") does. From an input file, mapped or
+/// read whole by MemoryBuffer, or from stdin in no prompt mode, the integers
+/// are parsed straight out of memory; only an interactive run, prompting and
+/// reading the terminal, goes through scanf for every value. When no integer
+/// is left GET gives 0 and consumes nothing, as scanf leaves it.
+class ProgramIO {
+   static const size_t FlushSize = 1 << 16;
+
+   llvm::raw_ostream & mOS;
+   std::string mOutput;
+   std::unique_ptr<llvm::MemoryBuffer> mInput;
+   const char * mPos;
+   const char * mEnd;
+   bool mPrompt;
+
+   static bool isSpace(char c) {
+      return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+   }
+   static bool isDigit(char c) {
+      return c >= '0' && c <= '9';
+   }
+
+   int parse() {
+      const char * p = mPos;
+      while (p != mEnd && isSpace(*p))
+         ++ p;
+      mPos = p;
+      bool isNegative = false;
+      if (p != mEnd && (*p == '-' || *p == '+'))
+         isNegative = *p ++ == '-';
+      if (p == mEnd || !isDigit(*p))
+         return 0;
+      /// wraps around on overflow like the arithmetic of the program
+      unsigned val = 0;
+      while (p != mEnd && isDigit(*p))
+         val = val * 10 + (*p ++ - '0');
+      mPos = p;
+      return (int)(isNegative ? 0u - val : val);
+   }
+public:
+   explicit ProgramIO(llvm::raw_ostream & os = llvm::errs())
+   : mOS(os), mOutput(), mInput(), mPos(NULL), mEnd(NULL), mPrompt(true) {
+   }
+   ~ProgramIO() {
+      flush();
+   }
+
+   /// Read the integers from path, false with the reason in error if it can not
+   bool openInput(const std::string & path, std::string & error) {
+      llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFile(path);
+      if (!buffer) {
+         error = path + ": " + buffer.getError().message();
+         return false;
+      }
+      setInput(std::move(*buffer));
+      return true;
+   }
+   /// Read the integers from input, never from stdin
+   void setInput(std::unique_ptr<llvm::MemoryBuffer> input) {
+      mInput = std::move(input);
+      mPos = mInput->getBufferStart();
+      mEnd = mInput->getBufferEnd();
+   }
+   /// Without the prompt stdin is read whole on the first GET
+   void setPrompt(bool prompt) {
+      mPrompt = prompt;
+   }
+
+   int get() {
+      if (mPrompt)
+         mOutput += "Please Input an Integer Value : ";
+      if (mInput == NULL && !mPrompt) {
+         llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getSTDIN();
+         if (buffer)
+            setInput(std::move(*buffer));
+      }
+      if (mInput != NULL)
+         return parse();
+
+      flush();
+      int val = 0;
+      scanf("%d", &val);
+      return val;
+   }
+   void print(int val) {
+      char digits[16];
+      int length = snprintf(digits, sizeof(digits), "%d", val);
+      mOutput.append(digits, length);
+      if (mOutput.size() >= FlushSize)
+         flush();
+   }
+   void flush() {
+      if (mOutput.empty())
+         return;
+      mOS.write(mOutput.data(), mOutput.size());
+      mOS.flush();
+      mOutput.clear();
+   }
+};
+
+#endif
@@ -0,0 +1,170 @@
+//==--- TestRunner.h - Many programs run in one process ----------------------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_TESTRUNNER_H
+#define AST_INTERPRETER_TESTRUNNER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+/// Runs the program in path, GET reading the file input or nothing if it is
+/// empty, PRINT writing to out and everything else to log; false if it failed
+typedef std::function<bool (const std::string & path, const std::string & input,
+                            llvm::raw_ostream & out, llvm::raw_ostream & log)> TestJob;
+
+/// Each input is a program or a directory, whose .c files are taken in name
+/// order. The worker threads take the next program until none is left; each
+/// program is run by the job on its own, with its own output and log kept in
+/// memory. GET of test.c reads test.in when there is one, and when there is a
+/// test.out the output must be exactly that.
+///
+/// When all are done a table of the outcome and time of every program is
+/// written in input order, then the log and the mismatch of each that has one.
+class TestRunner {
+   enum Status { Ran, Passed, Failed, Error };
+
+   struct Result {
+      Status status;
+      double millis;
+      std::string output;
+      std::string log;
+      std::string expected;
+   };
+
+   std::vector<std::string> mPaths;
+   std::vector<Result> mResults;
+
+   bool collect(const std::string & input) {
+      if (!llvm::sys::fs::is_directory(input)) {
+         mPaths.push_back(input);
+         return true;
+      }
+      std::vector<std::string> files;
+      std::error_code EC;
+      for (llvm::sys::fs::directory_iterator it(input, EC), end; it != end && !EC; it.increment(EC)) {
+         if (llvm::sys::path::extension(it->path()) == ".c")
+            files.push_back(it->path());
+      }
+      if (EC) {
+         llvm::errs() << "error: " << input << ": " << EC.message() << "\n";
+         return false;
+      }
+      std::sort(files.begin(), files.end());
+      mPaths.insert(mPaths.end(), files.begin(), files.end());
+      return true;
+   }
+
+   static std::string getSibling(const std::string & path, llvm::StringRef extension) {
+      llvm::SmallString<128> sibling(path);
+      llvm::sys::path::replace_extension(sibling, extension);
+      return llvm::sys::fs::exists(sibling) ? sibling.str().str() : std::string();
+   }
+
+   void runOne(size_t i, const TestJob & job) {
+      const std::string & path = mPaths[i];
+      Result & result = mResults[i];
+      llvm::raw_string_ostream out(result.output);
+      llvm::raw_string_ostream log(result.log);
+
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      bool isSucceeded = job(path, getSibling(path, "in"), out, log);
+      result.millis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+      out.flush();
+      log.flush();
+
+      result.status = isSucceeded ? Ran : Error;
+      std::string expectedPath = getSibling(path, "out");
+      if (!isSucceeded || expectedPath.empty())
+         return;
+      llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> expected = llvm::MemoryBuffer::getFile(expectedPath);
+      if (!expected) {
+         log << "error: " << expectedPath << ": " << expected.getError().message() << "\n";
+         log.flush();
+         result.status = Error;
+         return;
+      }
+      result.expected = (*expected)->getBuffer().str();
+      result.status = result.output == result.expected ? Passed : Failed;
+   }
+
+   static const char * getName(Status status) {
+      switch (status) {
+      case Ran:    return "ran";
+      case Passed: return "pass";
+      case Failed: return "FAIL";
+      case Error:  return "ERROR";
+      }
+      return "";
+   }
+
+   void report(llvm::raw_ostream & os, unsigned threads, double millis) {
+      unsigned counts[4] = { 0, 0, 0, 0 };
+      os << "  status          ms  program\n";
+      for (size_t i = 0; i < mPaths.size(); ++ i) {
+         ++ counts[mResults[i].status];
+         os << llvm::format("  %-6s%12.3f  ", getName(mResults[i].status), mResults[i].millis) << mPaths[i] << "\n";
+      }
+      os << mPaths.size() << " programs on " << threads << " threads in "
+         << llvm::format("%.3f", millis) << " ms: " << counts[Passed] << " passed, " << counts[Failed]
+         << " failed, " << counts[Error] << " errors, " << counts[Ran] << " without expected output\n";
+
+      for (size_t i = 0; i < mPaths.size(); ++ i) {
+         const Result & result = mResults[i];
+         if (result.log.empty() && result.status != Failed)
+            continue;
+         os << "\n" << mPaths[i] << ":\n" << result.log;
+         if (result.status == Failed)
+            os << "expected: " << result.expected << "\n" << "     got: " << result.output << "\n";
+      }
+   }
+public:
+   /// 0 threads is one per core; false if any program failed or did not run
+   bool run(const std::vector<std::string> & inputs, unsigned threads, const TestJob & job,
+            llvm::raw_ostream & os) {
+      for (size_t i = 0; i < inputs.size(); ++ i) {
+         if (!collect(inputs[i]))
+            return false;
+      }
+      if (mPaths.empty())
+         return true;
+      mResults.resize(mPaths.size());
+
+      if (threads == 0)
+         threads = std::max(1u, std::thread::hardware_concurrency());
+      threads = std::min<size_t>(threads, mPaths.size());
+
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      std::atomic<size_t> next(0);
+      std::vector<std::thread> workers;
+      for (unsigned t = 0; t < threads; ++ t) {
+         workers.push_back(std::thread([&]() {
+            for (size_t i = next ++; i < mPaths.size(); i = next ++)
+               runOne(i, job);
+         }));
+      }
+      for (size_t t = 0; t < workers.size(); ++ t)
+         workers[t].join();
+      double millis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+      report(os, threads, millis);
+      for (size_t i = 0; i < mResults.size(); ++ i) {
+         if (mResults[i].status == Failed || mResults[i].status == Error)
+            return false;
+      }
+      return true;
+   }
+};
+
+#endif
@@ -0,0 +1,46 @@
+//==--- ValueStack.h - Values of the frames of the interpreted program -------===//
+//===----------------------------------------------------------------------===//
+#ifndef AST_INTERPRETER_VALUESTACK_H
+#define AST_INTERPRETER_VALUESTACK_H
+
+#include <stddef.h>
+#include <vector>
+
+/// One block allocated up front, a frame is a slice of it. A slice never moves,
+/// so a frame can keep a pointer to its values; a slice past the end is a stack
+/// overflow of the interpreted program.
+class ValueStack {
+   static const size_t DefaultCapacity = 1 << 20;
+
+   std::vector<int> mValues;
+   size_t mTop;
+public:
+   explicit ValueStack(size_t capacity = DefaultCapacity) : mValues(capacity), mTop(0) {
+   }
+
+   /// The n values from index base, NULL if they do not fit
+   int * getSlice(size_t base, size_t n) {
+      if (base + n > mValues.size())
+         return NULL;
+      return &mValues[0] + base;
+   }
+
+   /// n zeroed values on the top, NULL if they do not fit
+   int * push(size_t n) {
+      int * slice = getSlice(mTop, n);
+      if (slice == NULL)
+         return NULL;
+      for (size_t i = 0; i < n; ++ i)
+         slice[i] = 0;
+      mTop += n;
+      return slice;
+   }
+   void pop(size_t n) {
+      mTop -= n;
+   }
+   size_t size() const {
+      return mTop;
+   }
+};
+
+#endif
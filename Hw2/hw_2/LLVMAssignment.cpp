@@ -16,6 +16,7 @@
 #include <map>
 #include <set>
 #include <vector>
+#include <algorithm>
 using namespace std;
 
 #include <llvm/Support/CommandLine.h>
@@ -37,6 +38,16 @@ using namespace std;
 #include "llvm/Bitcode/BitcodeWriterPass.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Transforms/IPO.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/Analysis/ConstantFolding.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/ADT/SCCIterator.h"
+#include "../../common/ResultCache.h"
+#include "../../common/CallGraphWriter.h"
+#include "../../common/LazyLoader.h"
+#include "../../common/WholeProgram.h"
+#include "../../common/SignatureIndex.h"
+#include "../../common/BatchDriver.h"
 
 #if LLVM_VERSION_MAJOR >= 4
 #include <llvm/Bitcode/BitcodeReader.h>
@@ -70,54 +81,514 @@ struct EnableFunctionOptPass: public FunctionPass {
 char EnableFunctionOptPass::ID=0;
 #endif
 
-enum ResultType { AlwaysTrue, AlwaysFalse, NotDefined};
+// cache file of the results, empty means no cache
+static cl::opt<std::string>
+CacheFile("cache",
+          cl::desc("Cache file of the results, only changed functions are analyzed again"),
+          cl::init(""));
+
+// export of the resolved call graph
+static cl::opt<std::string>
+CallGraphFile("callgraph",
+              cl::desc("Write the resolved call graph to this file"),
+              cl::init(""));
+static cl::opt<CallGraphFormat>
+CallGraphFileFormat("callgraph-format",
+                    cl::desc("Format of the call graph file"),
+                    cl::values(clEnumValN(CGBinary, "binary", "compact binary records"),
+                               clEnumValN(CGDot, "dot", "DOT graph"),
+                               clEnumValN(CGJSON, "json", "JSON")),
+                    cl::init(CGBinary));
+
+// function types of the address-taken functions
+static cl::opt<SignatureMode>
+Signatures("signatures",
+           cl::desc("Use the function types of the address-taken functions"),
+           cl::values(clEnumValN(SigOff, "off", "not used"),
+                      clEnumValN(SigFilter, "filter", "drop the targets whose type does not fit the call"),
+                      clEnumValN(SigOnly, "only", "resolve by the types only, without the pointer analysis")),
+           cl::init(SigOff));
 
-class AlwaysTrueBlocks {
-    set<Value *> alwaysTrueBlocks;
+// only load the function bodies reached from the entries
+static cl::opt<bool>
+LazyLoad("lazy",
+         cl::desc("Load the function bodies on demand, from the entries, only to analyze: the bitcode is not written back"),
+         cl::init(false));
+static cl::list<std::string>
+LazyEntries("lazy-entry",
+            cl::desc("Entry function of the lazy loading, main by default"),
+            cl::CommaSeparated);
+
+// report the callees rewritten in the bitcode
+static cl::opt<bool>
+RewriteStats("rewrite-stats",
+             cl::desc("Report the number of calls given a direct callee"),
+             cl::init(false));
+
+/*
+Sparse conditional constant propagation over the integers of each function.
+A value is unknown, one constant, or overdefined; a CFG edge is executable once
+the branch at its source can take it. Blocks never reached by an executable edge are dead.
+*/
+class FeasibleBlocks {
+    enum LatticeKind { Unknown, ConstantValue, Overdefined };
+    struct LatticeValue {
+        LatticeKind kind;
+        Constant *value;
+    };
+
+    map<Value *, LatticeValue> latticeMap;
+    set<BasicBlock *> executableBlocks;
+    set<pair<BasicBlock *, BasicBlock *>> executableEdges;
+    set<Function *> solvedFunctions;
+    vector<Instruction *> instWorklist;
+    vector<BasicBlock *> blockWorklist;
+
+    LatticeValue getLattice(Value *v) {
+        LatticeValue lv;
+        lv.kind = Overdefined;
+        lv.value = NULL;
+        if (isa<ConstantInt>(v)) {
+            lv.kind = ConstantValue;
+            lv.value = dyn_cast<Constant>(v);
+        }
+        else if (isa<UndefValue>(v)) {
+            lv.kind = Unknown;
+        }
+        else if (isa<Instruction>(v) && v->getType()->isIntegerTy()) {
+            map<Value *, LatticeValue>::iterator iter = latticeMap.find(v);
+            lv.kind = Unknown;
+            if (iter != latticeMap.end())
+                lv = iter->second;
+        }
+        return lv;
+    }
+    // a branch on a constant undef or poison may go either way
+    LatticeValue getConditionLattice(Value *cond) {
+        LatticeValue lv = this->getLattice(cond);
+        if (isa<UndefValue>(cond))
+            lv.kind = Overdefined;
+        return lv;
+    }
+    void pushUsers(Instruction *I) {
+        for (User *user : I->users()) {
+            if (Instruction *userInst = dyn_cast<Instruction>(user))
+                instWorklist.push_back(userInst);
+        }
+    }
+    void markConstant(Instruction *I, Constant *c) {
+        LatticeValue lv = this->getLattice(I);
+        if (lv.kind == Overdefined || (lv.kind == ConstantValue && lv.value == c))
+            return;
+        // a second constant is overdefined
+        if (lv.kind == ConstantValue) {
+            this->markOverdefined(I);
+            return;
+        }
+        lv.kind = ConstantValue;
+        lv.value = c;
+        latticeMap[I] = lv;
+        this->pushUsers(I);
+    }
+    void markOverdefined(Instruction *I) {
+        LatticeValue lv = this->getLattice(I);
+        if (lv.kind == Overdefined)
+            return;
+        lv.kind = Overdefined;
+        lv.value = NULL;
+        latticeMap[I] = lv;
+        this->pushUsers(I);
+    }
+    void markBlock(BasicBlock *B) {
+        if (executableBlocks.insert(B).second)
+            blockWorklist.push_back(B);
+    }
+    // true if the edge is new
+    bool markEdge(BasicBlock *from, BasicBlock *to) {
+        if (!executableEdges.insert(pair<BasicBlock *, BasicBlock *>(from, to)).second)
+            return false;
+        // a new edge into a live block only changes its phis
+        if (executableBlocks.find(to) == executableBlocks.end()) {
+            this->markBlock(to);
+        }
+        else {
+            for (Instruction &I : *to) {
+                if (!isa<PHINode>(&I))
+                    break;
+                instWorklist.push_back(&I);
+            }
+        }
+        return true;
+    }
+
+    void visitTerminator(Instruction *term) {
+        BasicBlock *B = term->getParent();
+        if (BranchInst *branch = dyn_cast<BranchInst>(term)) {
+            if (branch->isUnconditional()) {
+                this->markEdge(B, branch->getSuccessor(0));
+                return;
+            }
+            LatticeValue cond = this->getConditionLattice(branch->getCondition());
+            if (cond.kind == Unknown)
+                return;
+            if (cond.kind == ConstantValue) {
+                ConstantInt *c = dyn_cast<ConstantInt>(cond.value);
+                this->markEdge(B, branch->getSuccessor(c->isZero() ? 1 : 0));
+                return;
+            }
+        }
+        else if (SwitchInst *sw = dyn_cast<SwitchInst>(term)) {
+            LatticeValue cond = this->getConditionLattice(sw->getCondition());
+            if (cond.kind == Unknown)
+                return;
+            if (cond.kind == ConstantValue) {
+                ConstantInt *c = dyn_cast<ConstantInt>(cond.value);
+                this->markEdge(B, sw->findCaseValue(c)->getCaseSuccessor());
+                return;
+            }
+        }
+        for (BasicBlock *succ : successors(B)) {
+            this->markEdge(B, succ);
+        }
+    }
+    void visitPHI(PHINode *phi) {
+        if (!phi->getType()->isIntegerTy()) {
+            return;
+        }
+        // meet of the values on the executable edges
+        Constant *c = NULL;
+        for (unsigned i = 0; i < phi->getNumIncomingValues(); ++i) {
+            if (!this->isEdgeExecutable(phi->getIncomingBlock(i), phi->getParent()))
+                continue;
+            LatticeValue lv = this->getLattice(phi->getIncomingValue(i));
+            if (lv.kind == Unknown)
+                continue;
+            if (lv.kind == Overdefined || (c != NULL && c != lv.value)) {
+                this->markOverdefined(phi);
+                return;
+            }
+            c = lv.value;
+        }
+        if (c != NULL)
+            this->markConstant(phi, c);
+    }
+    void visitInstruction(Instruction *I) {
+        if (executableBlocks.find(I->getParent()) == executableBlocks.end())
+            return;
+
+        if (I->isTerminator()) {
+            this->visitTerminator(I);
+            return;
+        }
+        if (PHINode *phi = dyn_cast<PHINode>(I)) {
+            this->visitPHI(phi);
+            return;
+        }
+        if (!I->getType()->isIntegerTy())
+            return;
+        if (!isa<BinaryOperator>(I) && !isa<CmpInst>(I) && !isa<CastInst>(I) && !isa<SelectInst>(I)) {
+            this->markOverdefined(I);
+            return;
+        }
+
+        // fold when every operand is a constant
+        vector<Constant *> operands;
+        for (Use &op : I->operands()) {
+            LatticeValue lv = this->getLattice(op.get());
+            if (lv.kind == Unknown)
+                return;
+            if (lv.kind == Overdefined) {
+                this->markOverdefined(I);
+                return;
+            }
+            operands.push_back(lv.value);
+        }
+
+        const DataLayout &DL = I->getModule()->getDataLayout();
+        Constant *c = NULL;
+        if (CmpInst *cmp = dyn_cast<CmpInst>(I))
+            c = ConstantFoldCompareInstOperands(cmp->getPredicate(), operands[0], operands[1], DL);
+        else
+            c = ConstantFoldInstOperands(I, operands, DL);
+
+        if (c != NULL && isa<ConstantInt>(c))
+            this->markConstant(I, c);
+        else
+            this->markOverdefined(I);
+    }
+    void propagate() {
+        while (!blockWorklist.empty() || !instWorklist.empty()) {
+            while (!instWorklist.empty()) {
+                Instruction *I = instWorklist.back();
+                instWorklist.pop_back();
+                this->visitInstruction(I);
+            }
+            while (!blockWorklist.empty()) {
+                BasicBlock *B = blockWorklist.back();
+                blockWorklist.pop_back();
+                for (Instruction &I : *B) {
+                    this->visitInstruction(&I);
+                }
+            }
+        }
+    }
+    // a branch on a value that stays unknown may go either way, true if that changed anything
+    bool resolveUnknownBranches(Function &F) {
+        for (BasicBlock &B : F) {
+            if (executableBlocks.find(&B) == executableBlocks.end())
+                continue;
+            Instruction *term = B.getTerminator();
+            Value *cond = NULL;
+            if (BranchInst *branch = dyn_cast<BranchInst>(term)) {
+                if (branch->isConditional())
+                    cond = branch->getCondition();
+            }
+            else if (SwitchInst *sw = dyn_cast<SwitchInst>(term)) {
+                cond = sw->getCondition();
+            }
+            if (cond == NULL || this->getConditionLattice(cond).kind != Unknown)
+                continue;
+
+            bool isChanged = false;
+            for (BasicBlock *succ : successors(&B)) {
+                isChanged |= this->markEdge(&B, succ);
+            }
+            if (Instruction *condInst = dyn_cast<Instruction>(cond)) {
+                this->markOverdefined(condInst);
+                isChanged = true;
+            }
+            if (isChanged)
+                return true;
+        }
+        return false;
+    }
+
+public:
+    void solve(Function &F) {
+        if (F.empty() || !solvedFunctions.insert(&F).second)
+            return;
+
+        this->markBlock(&F.getEntryBlock());
+        do {
+            this->propagate();
+        } while (this->resolveUnknownBranches(F));
+    }
+    void solve(Module &M) {
+        for (Function &F : M) {
+            this->solve(F);
+        }
+    }
+
+    bool isExecutable(BasicBlock *B) {
+        if (solvedFunctions.find(B->getParent()) == solvedFunctions.end())
+            return true;
+        return executableBlocks.find(B) != executableBlocks.end();
+    }
+    bool isEdgeExecutable(BasicBlock *from, BasicBlock *to) {
+        if (solvedFunctions.find(to->getParent()) == solvedFunctions.end())
+            return true;
+        return executableEdges.find(pair<BasicBlock *, BasicBlock *>(from, to)) != executableEdges.end();
+    }
+};
+
+// function -> every value it returns, built once for the module
+class ReturnValues {
+    map<Function *, vector<Value *>> returnMap;
+    vector<Value *> emptyValues;
 
 public:
-    void insertAlwaysTrue(Value *v) {
-        alwaysTrueBlocks.insert(v);
+    void init(Module &M, FeasibleBlocks &feasibles) {
+        returnMap.clear();
+        for (Function &F : M) {
+            if (!F.getReturnType()->isPointerTy())
+                continue;
+            for (BasicBlock &B : F) {
+                if (!feasibles.isExecutable(&B))
+                    continue;
+                if (ReturnInst *retInst = dyn_cast<ReturnInst>(B.getTerminator())) {
+                    if (retInst->getReturnValue() != NULL)
+                        returnMap[&F].push_back(retInst->getReturnValue());
+                }
+            }
+        }
     }
-    bool isAlwarysTrue(Value *v) {
-        return alwaysTrueBlocks.find(v) != alwaysTrueBlocks.end();
+    const vector<Value *>& getReturnValues(Function *F) {
+        map<Function *, vector<Value *>>::iterator it = returnMap.find(F);
+        if (it == returnMap.end())
+            return emptyValues;
+        return it->second;
     }
 };
 
+/*
+alias -> names, the real names of an alias are the names reached through the aliases.
+Resolved with Tarjan's SCCs, every alias of a cycle gets the same real names.
+The results are kept until an alias they reach changes, and the walk keeps its own stack.
+*/
 class FunctionNamesMap {
     map<Value *, set<Value *>> nMap;
-    set<string> realNames;
+    // name -> the aliases that have it
+    map<Value *, set<Value *>> usersMap;
 
-public:
-    FunctionNamesMap() {}
+    // resolved aliases, an alias resolved means every alias it reaches is
+    map<Value *, set<Value *>> resolvedMap;
+    // Tarjan state of one resolving
+    map<Value *, unsigned> indexMap;
+    map<Value *, unsigned> lowMap;
+    map<Value *, set<Value *>> partialMap;
+    vector<Value *> sccStack;
+    set<Value *> onStack;
+    unsigned nextIndex;
+
+    // an alias being walked, and its next name
+    struct AliasFrame {
+        Value *alias;
+        set<Value *>::iterator next;
+    };
+
+    // drop the results of key and of the aliases that reach it
+    void invalidate(Value *key) {
+        vector<Value *> worklist;
+        worklist.push_back(key);
+        resolvedMap.erase(key);
+        while (!worklist.empty()) {
+            Value *name = worklist.back();
+            worklist.pop_back();
 
-    void insertName(Value *alias, Value *name) {
-        if (nMap.find(alias) != nMap.end()) {
-            nMap[alias].insert(name);
+            map<Value *, set<Value *>>::iterator users = usersMap.find(name);
+            if (users == usersMap.end())
+                continue;
+            set<Value *>::iterator iter;
+            for (iter = users->second.begin(); iter != users->second.end(); ++iter) {
+                // an alias not resolved has no resolved users
+                if (resolvedMap.erase(*iter) != 0)
+                    worklist.push_back(*iter);
+            }
         }
-        else {
-            set<Value *> v;
-            v.insert(name);
-            nMap.insert(pair<Value *, set<Value *>>(alias, v));
+    }
+
+    void enterAlias(Value *alias, vector<AliasFrame> &frames) {
+        indexMap[alias] = lowMap[alias] = nextIndex++;
+        sccStack.push_back(alias);
+        onStack.insert(alias);
+        partialMap[alias];
+
+        AliasFrame frame;
+        frame.alias = alias;
+        frame.next = nMap[alias].begin();
+        frames.push_back(frame);
+    }
+    void resolveAlias(Value *root) {
+        vector<AliasFrame> frames;
+        this->enterAlias(root, frames);
+        while (!frames.empty()) {
+            Value *alias = frames.back().alias;
+            set<Value *> &targets = partialMap[alias];
+
+            if (frames.back().next != nMap[alias].end()) {
+                Value *name = *frames.back().next;
+                ++frames.back().next;
+                if (!this->hasKey(name)) {
+                    targets.insert(name);
+                }
+                else if (indexMap.find(name) == indexMap.end() && resolvedMap.find(name) == resolvedMap.end()) {
+                    // its low link and names are taken when it is finished
+                    this->enterAlias(name, frames);
+                }
+                else {
+                    if (onStack.find(name) != onStack.end())
+                        lowMap[alias] = std::min(lowMap[alias], indexMap[name]);
+                    // a finished SCC, the same SCC is joined at its root
+                    map<Value *, set<Value *>>::iterator done = resolvedMap.find(name);
+                    if (done != resolvedMap.end())
+                        targets.insert(done->second.begin(), done->second.end());
+                }
+                continue;
+            }
+
+            // every name of alias is walked
+            frames.pop_back();
+            if (lowMap[alias] == indexMap[alias]) {
+                // the root, all aliases of the SCC share the real names
+                vector<Value *> scc;
+                set<Value *> sccTargets;
+                Value *member;
+                do {
+                    member = sccStack.back();
+                    sccStack.pop_back();
+                    onStack.erase(member);
+                    scc.push_back(member);
+                    sccTargets.insert(partialMap[member].begin(), partialMap[member].end());
+                    partialMap.erase(member);
+                } while (member != alias);
+
+                for (size_t i = 0; i < scc.size(); ++i) {
+                    resolvedMap[scc[i]] = sccTargets;
+                }
+            }
+            if (!frames.empty()) {
+                Value *parent = frames.back().alias;
+                lowMap[parent] = std::min(lowMap[parent], lowMap[alias]);
+                map<Value *, set<Value *>>::iterator done = resolvedMap.find(alias);
+                if (done != resolvedMap.end())
+                    partialMap[parent].insert(done->second.begin(), done->second.end());
+            }
         }
     }
+    const set<Value *>& resolve(Value *alias) {
+        map<Value *, set<Value *>>::iterator iter = resolvedMap.find(alias);
+        if (iter != resolvedMap.end())
+            return iter->second;
+
+        nextIndex = 0;
+        this->resolveAlias(alias);
+        indexMap.clear();
+        lowMap.clear();
+        return resolvedMap[alias];
+    }
+
+public:
+    FunctionNamesMap() {
+        nextIndex = 0;
+    }
+
+    // true if name is new to alias
+    bool insertName(Value *alias, Value *name) {
+        if (!nMap[alias].insert(name).second)
+            return false;
+        usersMap[name].insert(alias);
+        this->invalidate(alias);
+        return true;
+    }
     void insertNames(Value *alias, set<Value *> names) {
-        if (alias != NULL && names.size()!= 0) 
-            nMap.insert(pair<Value *, set<Value *>>(alias, names));
+        if (alias == NULL || names.size() == 0 || this->hasKey(alias))
+            return;
+        nMap[alias] = names;
+        set<Value *>::iterator iter;
+        for (iter = names.begin(); iter != names.end(); ++iter) {
+            usersMap[*iter].insert(alias);
+        }
+        this->invalidate(alias);
     }
 
     bool hasKey(Value *alias) {
         return nMap.find(alias) != nMap.end();
     }
     void deleteKey(Value *key) {
-        if (this->hasKey(key))
-            nMap.erase(key);
+        if (!this->hasKey(key))
+            return;
+        set<Value *>::iterator iter;
+        for (iter = nMap[key].begin(); iter != nMap[key].end(); ++iter) {
+            usersMap[*iter].erase(key);
+        }
+        nMap.erase(key);
+        this->invalidate(key);
     }
     
     bool keyHasName(Value *key, Value *name) {
         bool ret = false;
         if (this->hasKey(key)) {
-            set<Value *> ns = this->getNames(key);
+            set<Value *> &ns = nMap[key];
             if (ns.find(name) != ns.end()) {
                 ret = true;
             }
@@ -133,60 +604,112 @@ public:
         }
     }
 
-    void clearRealNames() {
-        this->realNames.clear();
-    }
     set<Value *> getNames(Value *alias) {
         return nMap[alias];
     }
-    set<string> getRealNames(set<Value *> fakeV) {
-        set<Value *>::iterator fakeName;
+    // the names of the real values, a value that is no alias is real
+    // with signatures, functions whose type does not fit the called value are dropped
+    set<string> getRealNames(const set<Value *> &fakeV, SignatureIndex *signatures = NULL) {
+        set<string> realNames;
+        set<Value *>::const_iterator fakeName;
         for (fakeName = fakeV.begin(); fakeName != fakeV.end(); ++fakeName) {
             if (this->hasKey(*fakeName)) {
-                this->getRealNames(this->getNames(*fakeName));
+                FunctionType *calledType = SignatureIndex::getCalledType(*fakeName);
+                const set<Value *> &rSet = this->resolve(*fakeName);
+                set<Value *>::const_iterator iter;
+                for (iter = rSet.begin(); iter != rSet.end(); ++iter) {
+                    Function *f = dyn_cast<Function>(*iter);
+                    if (signatures != NULL && f != NULL && !SignatureIndex::isCompatible(calledType, f))
+                        continue;
+                    realNames.insert((*iter)->getName().str());
+                }
             }
             else {
-                realNames.insert((*fakeName)->getName());
+                realNames.insert((*fakeName)->getName().str());
             }
         }
-
-        return this->realNames;
+        return realNames;
     }
+    // the real values of an alias, none if key is no alias
     set<Value *> getRealNames(Value *key) {
-        set<Value *> rSet;
+        if (!this->hasKey(key))
+            return set<Value *>();
+        return this->resolve(key);
+    }
+};
 
-        if (this->hasKey(key)) {
-            set<Value *>::iterator iter;
-            set<Value *> rNames = this->getNames(key);
-            for (iter = rNames.begin(); iter != rNames.end(); ++iter) {
-                if (this->hasKey(*iter)) {
-                    set<Value *> subNames = this->getRealNames(*iter);
-                    set<Value *>::iterator s_iter;
-                    for (s_iter = subNames.begin(); s_iter != subNames.end(); ++s_iter) {
-                        rSet.insert(*s_iter);
-                    }
-                }
-                else
-                    rSet.insert(*iter);
+/*
+planned callee replacements, applied in one batch after the analysis.
+Only the callee operand of each call changes, other uses of the old called value are kept.
+*/
+class CalleeRewriter {
+    vector<pair<CallInst *, Function *>> rewrites;
+    unsigned rewriteCount;
+    unsigned castCount;
+
+public:
+    CalleeRewriter() {
+        rewriteCount = 0;
+        castCount = 0;
+    }
+
+    void insertRewrite(CallInst *call, Function *target) {
+        rewrites.push_back(pair<CallInst *, Function *>(call, target));
+    }
+    // true if any call changed
+    bool apply() {
+        for (size_t i = 0; i < rewrites.size(); ++i) {
+            CallInst *call = rewrites[i].first;
+            Value *callee = rewrites[i].second;
+
+            // keep the function type of the call
+            Type *calledType = call->getCalledValue()->getType();
+            if (callee->getType() != calledType) {
+                callee = ConstantExpr::getBitCast(rewrites[i].second, calledType);
+                ++castCount;
             }
-        } 
-        return rSet;
+            call->setCalledFunction(call->getFunctionType(), callee);
+            ++rewriteCount;
+        }
+        rewrites.clear();
+        return rewriteCount != 0;
+    }
+    void output(raw_ostream &os) {
+        os << "rewrote " << rewriteCount << " callees, " << castCount << " with a cast\n";
     }
 };
 
 class LineFunctions {
     map<int, set<Value *>> rMap;
+    map<int, Function *> ownerMap;  // line -> the function the call is in
+    map<CallInst *, Value *> callMap;   // call -> called value
     set<string> rSet;
     FunctionNamesMap *names;
+    SignatureIndex *signatures;     // drops the functions whose type does not fit, NULL keeps all
+    raw_ostream *os;
 
 public:
-    LineFunctions() {}
+    LineFunctions() {
+        this->names = NULL;
+        this->signatures = NULL;
+        this->os = &errs();
+    }
+
+    void setOutput(raw_ostream &os) {
+        this->os = &os;
+    }
 
     void setNameTable(FunctionNamesMap &names) {
         this->names = &names;
     }
+    void setSignatureFilter(SignatureIndex *signatures) {
+        this->signatures = signatures;
+    }
+
+    void insertLineFunction(int line, Value *funcName, CallInst *call) {
+        Function *owner = call->getFunction();
+        callMap[call] = funcName;
 
-    void insertLineFunction(int line, Value *funcName) {
         if (rMap.find(line) != rMap.end()) {
             rMap[line].insert(funcName);
         }
@@ -194,71 +717,88 @@ public:
             set<Value *> v;
             v.insert(funcName);
             rMap.insert(pair<int, set<Value *>>(line, v));
+            ownerMap.insert(pair<int, Function *>(line, owner));
         }
     }
 
-    void output() {
+    LineNames getLineNames() {
+        LineNames lineNames;
         map<int, set<Value *>>::iterator iter;
 
         for(iter = rMap.begin(); iter != rMap.end(); ++iter) {
-            // output the line number
-            errs() << iter->first << " : ";
+            set<string> realNames = this->names->getRealNames(iter->second, this->signatures);
+            lineNames[iter->first] = vector<string>(realNames.begin(), realNames.end());
+        }
+        return lineNames;
+    }
+    // group the lines by the function they are in
+    map<Function *, LineNames> getFunctionLineNames(LineNames &lineNames) {
+        map<Function *, LineNames> funcLines;
+        LineNames::iterator iter;
+        for (iter = lineNames.begin(); iter != lineNames.end(); ++iter) {
+            funcLines[ownerMap[iter->first]].insert(*iter);
+        }
+        return funcLines;
+    }
+    // an edge for every call and callee, not only the first call of a line
+    void insertCallGraph(CallGraphWriter &writer) {
+        map<CallInst *, Value *>::iterator iter;
+        for (iter = callMap.begin(); iter != callMap.end(); ++iter) {
+            set<Value *> v;
+            v.insert(iter->second);
 
-            this->names->clearRealNames();
-            set<string> realNames = this->names->getRealNames(iter->second);
+            set<string> realNames = this->names->getRealNames(v, this->signatures);
+            writer.insertCall(iter->first, vector<string>(realNames.begin(), realNames.end()));
+        }
+    }
+    void outputLineNames(LineNames &lineNames) {
+        LineNames::iterator iter;
+
+        for(iter = lineNames.begin(); iter != lineNames.end(); ++iter) {
+            // output the line number
+            *this->os << iter->first << " : ";
 
             // output the function names
-            this->outputNameSet(realNames);
-            errs() << "\n";
+            this->outputNameSet(iter->second);
+            *this->os << "\n";
         }
     }
-    void outputNameSet(set<string> s) {
+    void output() {
+        LineNames lineNames = this->getLineNames();
+        this->outputLineNames(lineNames);
+    }
+    void outputNameSet(vector<string> s) {
         if (s.size() > 0) {
-            set<string>::iterator iter;
-            set<string>::iterator end = s.end();
+            vector<string>::iterator iter;
+            vector<string>::iterator end = s.end();
             --end;
             for (iter = s.begin(); iter != end; ++iter) {
                 // not null
                 if (*iter != "")
-                    errs() << *iter << ", ";
+                    *this->os << *iter << ", ";
                 // null
                 else
                     continue;
             }
-            errs() << *iter;
+            *this->os << *iter;
         }   
     }
-    void rewriteCalleeName(FunctionNamesMap &ns) {
+    // plan a direct callee for every call whose called value has one real function
+    void rewriteCalleeName(FunctionNamesMap &ns, CalleeRewriter &rewriter) {
         this->setNameTable(ns);
 
-        map<int, set<Value *>>::iterator iter;
-        for(iter = rMap.begin(); iter != rMap.end(); ++iter) {
-            // get the real names string set
-            this->names->clearRealNames();
-            set<string> realNames = this->names->getRealNames(iter->second);
-            set<Value *> v_set = iter->second;
-            
-            // if only one real name
-            if (realNames.size() == 1) {
-                // get the calls
-                set<Value *>::iterator originNameIter;
-                for (originNameIter = iter->second.begin(); originNameIter != iter->second.end(); ++originNameIter) {
-                    for (User *user : (*originNameIter)->users()) {
-                        // get which CallInst called the originNameIter
-                        if (CallInst *callInst = dyn_cast<CallInst>(user)) {
-                            set<Value *> r_set = this->names->getRealNames(callInst->getCalledValue());
-                            if (r_set.size() == 1) {
-                                Function *f = dyn_cast<Function>(*(r_set.begin()));
-                                if (f != NULL && f != callInst->getCalledValue()) {
-                                    callInst->getCalledValue()->replaceAllUsesWith(f);
-                                }
-                            }
-
-                            break;// important, if not add break, maybe crash
-                        }
-                    }
-                }
-            }
+        map<CallInst *, Value *>::iterator iter;
+        for (iter = callMap.begin(); iter != callMap.end(); ++iter) {
+            CallInst *callInst = iter->first;
+            set<Value *> r_set = this->names->getRealNames(callInst->getCalledValue());
+            if (r_set.size() != 1)
+                continue;
+
+            Function *f = dyn_cast<Function>(*(r_set.begin()));
+            if (f != NULL && this->signatures != NULL && !SignatureIndex::isCompatible(callInst->getFunctionType(), f))
+                continue;
+            if (f != NULL && f != callInst->getCalledValue()->stripPointerCasts())
+                rewriter.insertRewrite(callInst, f);
         }
     }
 };
@@ -266,64 +806,192 @@ public:
 struct FuncPtrPass : public ModulePass {
     LineFunctions lineFuncs;
     FunctionNamesMap funcNames;
-    AlwaysTrueBlocks alwaysTrues;
+    FeasibleBlocks feasibles;
+    ReturnValues returnValues;
+    ResultCache resultCache;
+    CalleeRewriter calleeRewriter;
+    SignatureIndex signatures;
+
+    // functions callers first, by the SCCs of the call graph
+    vector<Function *> callOrder;
+    map<Function *, size_t> callOrderIndex;
+    set<size_t> pendingSet;     // indexes in callOrder of the functions to deal
+    map<CallInst *, set<Function *>> calleeSets;    // the functions each call of a pointer was bound to
+
+    raw_ostream *os;    // the lines and statistics
 
     static char ID; // Pass identification, replacement for typeid
-    FuncPtrPass() : ModulePass(ID) {}
+    FuncPtrPass() : ModulePass(ID), os(&errs()) {}
+    FuncPtrPass(raw_ostream &os) : ModulePass(ID), os(&os) {}
 
     bool runOnModule(Module &M) override {
-        for (Function &F : M) {
-            for (BasicBlock &B : F) {
-                for (Instruction &I: B) {
-                    // Call Instruction
-                    if (isa<CallInst>(&I) && !isLLVMDBG(I)) {
-                        this->dealCallInst(&I);
-                    }
-                    // PHI Instruction
-                    if (isa<PHINode>(&I)) {
-                        this->dealPHI(&I);
-                    }
-                    // Branch Instruction
-                    if (isa<BranchInst>(&I)) {
-                        this->dealBranchInst(&I);
-                    }
-                }
-            }
+        this->lineFuncs.setOutput(*this->os);
+        if (Signatures != SigOff) {
+            this->signatures.init(M);
+            // the lines come from the types only
+            if (Signatures == SigOnly)
+                return false;
+            this->lineFuncs.setSignatureFilter(&this->signatures);
         }
-        // if not forward declaration
-        for (Function &F : M) {
-            for (BasicBlock &B : F) {
-                for (Instruction &I: B) {
-                    // Call Instruction
-                    if (isa<CallInst>(&I) && !isLLVMDBG(I)) {
-                        this->dealCallInst(&I);
-                    }
-                }
-            }
+
+        this->feasibles.solve(M);
+        this->returnValues.init(M, this->feasibles);
+
+        if (CacheFile != "") {
+            this->resultCache.hashModule(M, this->getCacheConfig());
+            this->resultCache.load(CacheFile);
+            this->resultCache.computeDirtyFunctions(M);
         }
-        
+
+        this->initCallOrder(M);
+        do {
+            while (!this->pendingSet.empty()) {
+                Function *F = this->callOrder[*this->pendingSet.begin()];
+                this->pendingSet.erase(this->pendingSet.begin());
+                this->dealInstructionsInFunction(*F);
+            }
+            this->pendChangedCalls();
+        } while (!this->pendingSet.empty());
+
         // replace the certain function name in different lines
-        this->lineFuncs.rewriteCalleeName(this->funcNames);
+        this->lineFuncs.rewriteCalleeName(this->funcNames, this->calleeRewriter);
+        this->calleeRewriter.apply();
 
         return true;// if modified, return true
     }
 
     bool doFinalization(Module &M) override {
+        if (Signatures == SigOnly) {
+            LineNames lineNames = this->signatures.getLineNames(M);
+            this->lineFuncs.outputLineNames(lineNames);
+            return true;
+        }
+
         this->lineFuncs.setNameTable(this->funcNames);
-        this->lineFuncs.output();
+        LineNames lineNames = this->lineFuncs.getLineNames();
+
+        if (CallGraphFile != "")
+            this->writeCallGraph(M);
+
+        // lines of the unchanged functions come from the cache
+        if (CacheFile != "") {
+            map<Function *, LineNames> funcLines = this->lineFuncs.getFunctionLineNames(lineNames);
+            this->resultCache.insertCachedLines(M, lineNames);
+            this->resultCache.hashModule(M, this->getCacheConfig());
+            this->resultCache.write(CacheFile, M, funcLines);
+        }
+        this->lineFuncs.outputLineNames(lineNames);
+        if (RewriteStats)
+            this->calleeRewriter.output(*this->os);
         
         return true;
     }
+    string getCacheConfig() {
+        string config;
+        raw_string_ostream os(config);
+        os << "hw2 signatures=" << (int)Signatures;
+        return os.str();
+    }
+    void writeCallGraph(Module &M) {
+        CallGraphWriter writer;
+        this->lineFuncs.insertCallGraph(writer);
+
+        // unchanged functions, the names of a cached line go to the first call of the line
+        for (Function &F : M) {
+            LineNames cached;
+            if (!this->resultCache.getCachedLines(&F, cached))
+                continue;
+
+            for (BasicBlock &B : F) {
+                for (Instruction &I : B) {
+                    if (!isa<CallInst>(&I) || isLLVMDBG(I))
+                        continue;
+
+                    DILocation *loc = I.getDebugLoc();
+                    LineNames::iterator iter = cached.find(loc->getLine());
+                    if (iter != cached.end()) {
+                        writer.insertCall(dyn_cast<CallInst>(&I), iter->second);
+                        cached.erase(iter);
+                    }
+                }
+            }
+        }
+
+        writer.write(CallGraphFile, CallGraphFileFormat);
+    }
     bool isLLVMDBG(Instruction &I) {
         return dyn_cast<CallInst>(&I)->getCalledValue()->getName().find("llvm.dbg") != std::string::npos;
     }
-    bool isIfBlock(BasicBlock *b) {
-        return b->getName().find("if.") != std::string::npos;
-    }
     bool isFunctionPointer(Value *v) {
         return v->getType()->isPointerTy();
     }
     
+    // scc_iterator gives the callees first, the arguments are bound by the callers so the order is reversed
+    void initCallOrder(Module &M) {
+        CallGraph callGraph(M);
+        vector<vector<CallGraphNode *>> sccs;
+        for (scc_iterator<CallGraph *> iter = scc_begin(&callGraph); !iter.isAtEnd(); ++iter) {
+            sccs.push_back(*iter);
+        }
+
+        for (size_t i = sccs.size(); i > 0; --i) {
+            for (size_t j = 0; j < sccs[i - 1].size(); ++j) {
+                Function *F = sccs[i - 1][j]->getFunction();
+                if (F == NULL || F->isDeclaration())
+                    continue;
+                this->callOrderIndex[F] = this->callOrder.size();
+                this->callOrder.push_back(F);
+                this->pendFunction(F);
+            }
+        }
+    }
+    // deal F again, unchanged functions come from the cache
+    void pendFunction(Function *F) {
+        map<Function *, size_t>::iterator iter = this->callOrderIndex.find(F);
+        if (iter != this->callOrderIndex.end() && this->resultCache.isDirty(F))
+            this->pendingSet.insert(iter->second);
+    }
+    // a call of a pointer resolved through a value dealt later, like the phi a callee returns,
+    // reaches more functions now: deal its function again
+    void pendChangedCalls() {
+        map<CallInst *, set<Function *>>::iterator iter;
+        for (iter = this->calleeSets.begin(); iter != this->calleeSets.end(); ++iter) {
+            if (this->getCalleeSet(iter->first->getCalledValue()) != iter->second)
+                this->pendFunction(iter->first->getFunction());
+        }
+    }
+    // the functions among the real names of fptr, null and the values not dealt yet are left out
+    set<Function *> getCalleeSet(Value *fptr) {
+        set<Value *> fset = this->funcNames.getRealNames(fptr);
+        set<Function *> callees;
+        for (set<Value *>::iterator iter = fset.begin(); iter != fset.end(); ++iter) {
+            if (Function *f = dyn_cast<Function>(*iter))
+                callees.insert(f);
+        }
+        return callees;
+    }
+    void dealInstructionsInFunction(Function &F) {
+        for (BasicBlock &B : F) {
+            // dead code
+            if (!this->feasibles.isExecutable(&B))
+                continue;
+
+            for (Instruction &I: B) {
+                // Call Instruction
+                if (isa<CallInst>(&I) && !isLLVMDBG(I)) {
+                    this->dealCallInst(&I);
+                }
+                // PHI Instruction
+                if (isa<PHINode>(&I)) {
+                    this->dealPHI(&I);
+                }
+                // Branch Instruction
+                if (isa<BranchInst>(&I)) {
+                    this->dealBranchInst(&I);
+                }
+            }
+        }
+    }
     void dealCallInst(Value *v) {
         CallInst *callInst = dyn_cast<CallInst>(v);
                         
@@ -332,7 +1000,7 @@ struct FuncPtrPass : public ModulePass {
         unsigned line = loc->getLine();
         // called value
         Value *calledValue = callInst->getCalledValue();
-        lineFuncs.insertLineFunction(line, calledValue);
+        lineFuncs.insertLineFunction(line, calledValue, callInst);
 
         // deal all kinds of call
         this->dealCallKind(callInst);
@@ -359,33 +1027,48 @@ struct FuncPtrPass : public ModulePass {
     void dealCallFunction(Value *call, Value *func) {
         this->bindFunctionParams(call, func, NULL);
 
-        Function *f = dyn_cast<Function>(func);
-        if (f->getReturnType()->isPointerTy())
-            funcNames.insertName(call, this->getReturnValue(*f));
+        this->insertReturnNames(call, dyn_cast<Function>(func));
     }
     void dealCallFunctionPointer(Value *call, Value *fptr) {
-        set<Value *> fset = this->funcNames.getRealNames(fptr);
-        for (set<Value *>::iterator iter = fset.begin(); iter != fset.end(); ++iter) {
-            // not null
-            if ((*iter)->getName() != "")
-                this->dealCallFunction(call, *iter);
+        set<Function *> &fset = this->calleeSets[dyn_cast<CallInst>(call)];
+        fset = this->getCalleeSet(fptr);
+        for (set<Function *>::iterator iter = fset.begin(); iter != fset.end(); ++iter) {
+            // a function of another type is not called here
+            if (Signatures == SigFilter &&
+                !SignatureIndex::isCompatible(dyn_cast<CallInst>(call)->getFunctionType(), *iter))
+                continue;
+            this->dealCallFunction(call, *iter);
         }
     }
     void dealCallPHI(Value *call, Value *p) {
+        set<Value *> visited;
+        this->dealCallPHI(call, p, visited);
+    }
+    // phis of a loop can be incoming values of each other, each is dealt once
+    void dealCallPHI(Value *call, Value *p, set<Value *> &visited) {
+        if (!visited.insert(p).second)
+            return;
+
         PHINode *phi = dyn_cast<PHINode>(p);
         BasicBlock **b = phi->block_begin();            // phi value blocks
         Use *u_ptr = phi->incoming_values().begin();    // phi values
 
         while (b != phi->block_end() && u_ptr != phi->incoming_values().end()) {
             Value *v = u_ptr->get();
+            // dead edge
+            if (!this->feasibles.isEdgeExecutable(*b, phi->getParent())) {
+                ++b;
+                ++u_ptr;
+                continue;
+            }
             // not null
             if (v->getName() != "") {
                 if (isa<Function>(v)) {
                     this->bindFunctionParams(call, v, *b);
-                    funcNames.insertName(call, this->getReturnValue(*dyn_cast<Function>(v)));
+                    this->insertReturnNames(call, dyn_cast<Function>(v));
                 }
                 else if (isa<PHINode>(v)) {
-                    this->dealCallPHI(call, v);
+                    this->dealCallPHI(call, v, visited);
                 }
             }
             // null
@@ -404,25 +1087,34 @@ struct FuncPtrPass : public ModulePass {
         CallInst::op_iterator op = callInst->op_begin();    // Use *
         // The parameter
         Function *func = dyn_cast<Function>(f);
+        if (func == NULL)
+            return;
         Argument *arg = func->arg_begin();     // Argument *
 
+        bool isChanged = false;
         while (op != callInst->op_end() && arg != func->arg_end()) {
             Value *realV = op->get();
             if (isFunctionPointer(arg)) {
-                 this->bindFuncPtrParam(arg, realV, block);
+                 isChanged |= this->bindFuncPtrParam(arg, realV, block);
             }
             
             ++op;
             ++arg;
         }
+
+        // new names of the parameters, the calls in func may reach more functions
+        if (isChanged)
+            this->pendFunction(func);
     }
-    void bindFuncPtrParam(Argument *arg, Value *realV, Value *block=NULL) {
+    // true if arg has new names
+    bool bindFuncPtrParam(Argument *arg, Value *realV, Value *block=NULL) {
+        bool isChanged = false;
         if (isa<PHINode>(realV)) {
             PHINode *phi = dyn_cast<PHINode>(realV);
 
             // no block constrain
             if (block == NULL)
-                funcNames.insertName(arg, realV);
+                isChanged = funcNames.insertName(arg, realV);
             // constrain the block of the realV
             else {
                 BasicBlock **b = phi->block_begin();
@@ -430,7 +1122,7 @@ struct FuncPtrPass : public ModulePass {
 
                 while (b != phi->block_end() && u_ptr != phi->incoming_values().end()) {
                     if (*b == block) {
-                        funcNames.insertName(arg, u_ptr->get());
+                        isChanged = funcNames.insertName(arg, u_ptr->get());
                         break;
                     }
 
@@ -440,27 +1132,19 @@ struct FuncPtrPass : public ModulePass {
             }
         }
         else {
-            funcNames.insertName(arg, realV);
+            isChanged = funcNames.insertName(arg, realV);
         } 
+        return isChanged;
     }
     void dealPHI(Value *value) {
         PHINode *phi = dyn_cast<PHINode>(value);
 
-        // all names
-        for (Use *u_ptr = phi->incoming_values().begin(); u_ptr != phi->incoming_values().end(); ++u_ptr) {
-            funcNames.insertName(phi, u_ptr->get());// null or not null
-        }
-
-        // deal the always true name
+        // the names on the executable edges
         Use *u_ptr = phi->incoming_values().begin();
         BasicBlock **b_ptr = phi->block_begin();
         while (u_ptr != phi->incoming_values().end() && b_ptr != phi->block_end()) {
-            bool isAlwaysTrueName = alwaysTrues.isAlwarysTrue(*b_ptr);
-            if (isAlwaysTrueName && isIfBlock(*b_ptr)) {
-                funcNames.deleteKey(phi);
-                funcNames.insertName(phi, u_ptr->get());
-                break;
-            }
+            if (this->feasibles.isEdgeExecutable(*b_ptr, phi->getParent()))
+                funcNames.insertName(phi, u_ptr->get());// null or not null
 
             ++u_ptr;
             ++b_ptr;
@@ -469,157 +1153,159 @@ struct FuncPtrPass : public ModulePass {
     void dealBranchInst(Value *v) {
         BranchInst *branch = dyn_cast<BranchInst>(v);
         if (branch->isConditional()) {
-            if (isa<ICmpInst>(branch->getCondition())) {
-                ResultType resultType = resultOfICMP(dyn_cast<ICmpInst>(branch->getCondition()));
-
-                if (resultType == AlwaysTrue)
-                    alwaysTrues.insertAlwaysTrue(branch->getSuccessor(0));
-                else if (resultType == AlwaysFalse)
-                    alwaysTrues.insertAlwaysTrue(branch->getSuccessor(1));
-            }
+            if (isa<ICmpInst>(branch->getCondition()))
+                this->dealNullCheck(dyn_cast<ICmpInst>(branch->getCondition()));
         }
     }
-    ResultType resultOfICMP(ICmpInst *icmp) {
-        ResultType result = NotDefined;
+    // a phi of function pointers checked against null, the null is not called
+    void dealNullCheck(ICmpInst *icmp) {
+        Value *v1 = icmp->getOperand(0);
+        Value *v2 = icmp->getOperand(1);
 
-        Use *u1 = icmp->op_begin();
-        Use *u2 = u1 + 1;
-        if (u1 != NULL && u2 != NULL) {
-            Value *v1 = u1->get();
-            Value *v2 = u2->get();
-            
-            if (isFunctionPointer(v1)) {
-                if (isa<PHINode>(v1) && v2->getName() == "") {
-                    this->funcNames.deleteNameOfKey(v1, v2);
-                }
-            }
-            
-            if (isa<ConstantInt>(v1) && isa<ConstantInt>(v2)) {
-                ConstantInt *c1 = dyn_cast<ConstantInt>(v1);
-                ConstantInt *c2 = dyn_cast<ConstantInt>(v2);
-                int i1 = c1->getLimitedValue();
-                int i2 = c2->getLimitedValue();
-
-                CmpInst::Predicate pr = icmp->getPredicate();
-                switch (pr) {
-                    case CmpInst::Predicate::ICMP_EQ: {
-                        if (i1 == i2)
-                            result = AlwaysTrue;
-                        else 
-                            result = AlwaysFalse;
-                        break;
-                    }
-                    case CmpInst::Predicate::ICMP_NE: {
-                        if (i1 != i2)
-                            result = AlwaysTrue;
-                        else
-                            result = AlwaysFalse;
-                        break;
-                    }
-                    case CmpInst::Predicate::ICMP_SGT: {
-                        if (i1 > i2)
-                            result = AlwaysTrue;
-                        else
-                            result = AlwaysFalse;
-                        break;
-                    }
-                    case CmpInst::Predicate::ICMP_SGE: {
-                        if (i1 >= i2)
-                            result = AlwaysTrue;
-                        else
-                            result = AlwaysFalse;
-                        break;
-                    }
-                    case CmpInst::Predicate::ICMP_SLT: {
-                        if (i1 < i2)
-                            result = AlwaysTrue;
-                        else
-                            result = AlwaysFalse;
-                        break;
-                    }
-                    case CmpInst::Predicate::ICMP_SLE: {
-                        if (i1 <= i2)
-                            result = AlwaysTrue;
-                        else
-                            result = AlwaysFalse;
-                        break;
-                    }
-                }
+        if (isFunctionPointer(v1)) {
+            if (isa<PHINode>(v1) && v2->getName() == "") {
+                this->funcNames.deleteNameOfKey(v1, v2);
             }
         }
-
-        return result;
     }
-    Value* getReturnValue(Function &F) {
-        Value *ret = NULL;
-        if (F.getReturnType()->isPointerTy()) {
-            for (BasicBlock &B : F) {
-                for (Instruction &I : B) {
-                    if (isa<ReturnInst>(&I)) {
-                        ReturnInst *retInst = dyn_cast<ReturnInst>(&I);
-                        ret = retInst->getReturnValue();
-                    }
-                }
-            }
-        }
-        return ret;
+    // the call is an alias of every value f returns
+    void insertReturnNames(Value *call, Function *f) {
+        const vector<Value *> &rets = this->returnValues.getReturnValues(f);
+        for (size_t i = 0; i < rets.size(); ++i)
+            funcNames.insertName(call, rets[i]);
     }
 };
 
 char FuncPtrPass::ID = 0;
 static RegisterPass<FuncPtrPass> X("funcptrpass", "Print function call instruction");
 
-static cl::opt<std::string>
-InputFilename(cl::Positional,
-              cl::desc("<filename>.bc"),
-              cl::init(""));
+static cl::list<std::string>
+InputFilenames(cl::Positional,
+               cl::desc("<filename>.bc..."),
+               cl::OneOrMore);
 
+// several inputs are linked by their summaries, and solved with coarser inclusion constraints
+static cl::opt<unsigned>
+ModuleThreads("module-threads",
+              cl::desc("Number of threads of a whole program of several inputs (0 = one per core); "
+                       "its lines come from field-insensitive inclusion constraints, coarser than one module, every input is written back"),
+              cl::init(0));
 
-int main(int argc, char **argv) {
-    LLVMContext &Context = getGlobalContext();
+// several inputs are analyzed one by one
+static cl::opt<bool>
+Batch("batch",
+      cl::desc("Analyze every input, or every .bc file of an input directory, as a module of its own"),
+      cl::init(false));
+
+static cl::opt<unsigned>
+BatchThreads("batch-threads",
+             cl::desc("Number of threads of a batch (0 = one per core)"),
+             cl::init(0));
+
+
+// analyze one module and write it back, the lines go to os
+static bool analyzeFile(const std::string &InputFilename, LLVMContext &Context, raw_ostream &os) {
     SMDiagnostic Err;
-    // Parse the command line to read the Inputfilename
-    cl::ParseCommandLineOptions(argc, argv,
-                                "FuncPtrPass \n My first LLVM too which does not do much.\n");
 
     // Load the input module
-    std::unique_ptr<Module> M = parseIRFile(InputFilename, Err, Context);
+    std::unique_ptr<Module> M;
+    if (LazyLoad)
+        M = getLazyIRFileModule(InputFilename, Err, Context);
+    else
+        M = parseIRFile(InputFilename, Err, Context);
     if (!M) {
-        Err.print(argv[0], errs());
-        return 1;
+        Err.print("FuncPtrPass", os);
+        return false;
+    }
+
+    // load the reached bodies, and transform only them to SSA
+    if (LazyLoad) {
+        LazyLoader loader;
+        if (!loader.materializeReachable(*M, LazyEntries))
+            return false;
+
+        llvm::legacy::FunctionPassManager FPasses(M.get());
+        #if LLVM_VERSION_MAJOR == 5
+        FPasses.add(new EnableFunctionOptPass());
+        #endif
+        FPasses.add(llvm::createPromoteMemoryToRegisterPass());
+        FPasses.doInitialization();
+        for (Function *F : loader.getFunctions())
+            FPasses.run(*F);
+        FPasses.doFinalization();
     }
 
     llvm::legacy::PassManager Passes;
-        
-    ///Remove functions' optnone attribute in LLVM5.0
-    #if LLVM_VERSION_MAJOR == 5
-    Passes.add(new EnableFunctionOptPass());
-    #endif
+    if (!LazyLoad) {
+        ///Remove functions' optnone attribute in LLVM5.0
+        #if LLVM_VERSION_MAJOR == 5
+        Passes.add(new EnableFunctionOptPass());
+        #endif
 
-    ///Transform it to SSA
-    Passes.add(llvm::createPromoteMemoryToRegisterPass());
+        ///Transform it to SSA
+        Passes.add(llvm::createPromoteMemoryToRegisterPass());
+    }
 
     /// Your pass to print Function and Call Instructions
-    Passes.add(new FuncPtrPass());
+    Passes.add(new FuncPtrPass(os));
+
+    // run the passes
+    Passes.run(*M.get());
+
+    // a lazy module is only analyzed, writing it back would load every body
+    if (LazyLoad)
+        return true;
 
     // rewrite the bitcode file
     std::unique_ptr<tool_output_file> Out;
     std::error_code EC;
     Out.reset(new tool_output_file(InputFilename,EC, sys::fs::F_None));
     if (EC) {
-        errs() << EC.message() << '\n';
-        return 1;
+        os << EC.message() << '\n';
+        return false;
     }
     raw_ostream *OS = &Out->os();
 
     // add bitcode writer pass
-    Passes.add(createBitcodeWriterPass(*OS));
-
-    // run the passes
-    Passes.run(*M.get());
+    llvm::legacy::PassManager WritePasses;
+    WritePasses.add(createBitcodeWriterPass(*OS));
+    WritePasses.run(*M.get());
 
     // keep the file
     Out->keep();
-   
-    return 0;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    LLVMContext &Context = getGlobalContext();
+    // Parse the command line to read the Inputfilename
+    cl::ParseCommandLineOptions(argc, argv,
+                                "FuncPtrPass \n My first LLVM too which does not do much.\n");
+
+    // the rewritten callees are not written back
+    if (LazyLoad && RewriteStats) {
+        errs() << "the rewrite is not written back with -lazy\n";
+        return 1;
+    }
+
+    // every module on its own, on a few threads
+    if (Batch) {
+        if (CacheFile != "" || CallGraphFile != "") {
+            errs() << "the cache and the call graph can't be used in a batch\n";
+            return 1;
+        }
+        BatchDriver driver;
+        return driver.run(InputFilenames, BatchThreads, analyzeFile) ? 0 : 1;
+    }
+
+    // a whole program, the call lines are printed and every input is written back
+    if (InputFilenames.size() > 1) {
+        if (CacheFile != "" || CallGraphFile != "" || LazyLoad || RewriteStats || Signatures != SigOff) {
+            errs() << "the options of one module can't be used with several inputs\n";
+            return 1;
+        }
+        return WholeProgram::run(InputFilenames, ModuleThreads, true, errs()) ? 0 : 1;
+    }
+
+    return analyzeFile(InputFilenames.front(), Context, errs()) ? 0 : 1;
 }
@@ -15,6 +15,7 @@
 #include <set>
 #include <map>
 #include <vector>
+#include <chrono>
 
 #include <llvm/Support/CommandLine.h>
 #include <llvm/IRReader/IRReader.h>
@@ -31,13 +32,24 @@
 #endif
 
 #include <llvm/Transforms/Scalar.h>
+#include <llvm/IR/IRBuilder.h>
+#include "llvm/Bitcode/BitcodeWriterPass.h"
+#include "llvm/Support/FileSystem.h"
 #include "Liveness.h"
+#include "../../common/ResultCache.h"
+#include "../../common/CallGraphWriter.h"
+#include "../../common/LazyLoader.h"
+#include "../../common/WholeProgram.h"
+#include "../../common/SignatureIndex.h"
+#include "../../common/BatchDriver.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Function.h"
 #include <llvm/IR/DebugLoc.h>
 #include <llvm/IR/DebugInfoMetadata.h>
 #include "llvm/Pass.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/Format.h"
 #include "llvm/ADT/StringRef.h"
 
 using namespace llvm;
@@ -66,6 +78,91 @@ struct EnableFunctionOptPass : public FunctionPass {
 char EnableFunctionOptPass::ID = 0;
 #endif
 
+// k-limited call-string contexts, 0 means context-insensitive
+static cl::opt<unsigned>
+ContextDepth("context-depth",
+             cl::desc("Length k of the call strings used as contexts (0 = context-insensitive)"),
+             cl::init(0));
+static cl::opt<unsigned>
+ContextBudget("context-budget",
+              cl::desc("Max number of contexts, callees past it fall back to the insensitive context"),
+              cl::init(1024));
+static cl::opt<bool>
+ContextStats("context-stats",
+             cl::desc("Report the time and memory cost of the analysis"),
+             cl::init(false));
+
+// only resolve the called values of the call instructions
+static cl::opt<bool>
+DemandDriven("demand",
+             cl::desc("Only query the targets of the call instructions, on demand"),
+             cl::init(false));
+
+// cache file of the results, empty means no cache
+static cl::opt<std::string>
+CacheFile("cache",
+          cl::desc("Cache file of the results, only changed functions are analyzed again"),
+          cl::init(""));
+
+// export of the resolved call graph
+static cl::opt<std::string>
+CallGraphFile("callgraph",
+              cl::desc("Write the resolved call graph to this file"),
+              cl::init(""));
+static cl::opt<CallGraphFormat>
+CallGraphFileFormat("callgraph-format",
+                    cl::desc("Format of the call graph file"),
+                    cl::values(clEnumValN(CGBinary, "binary", "compact binary records"),
+                               clEnumValN(CGDot, "dot", "DOT graph"),
+                               clEnumValN(CGJSON, "json", "JSON")),
+                    cl::init(CGBinary));
+
+// rewrite the indirect calls with resolved targets to direct calls
+static cl::opt<bool>
+PromoteCalls("promote-calls",
+             cl::desc("Turn resolved indirect calls into direct calls and write the bitcode back"),
+             cl::init(false));
+static cl::opt<unsigned>
+PromoteMaxTargets("promote-max-targets",
+                  cl::desc("Max targets of an indirect call turned into a compare chain"),
+                  cl::init(4));
+
+// function types of the address-taken functions
+static cl::opt<SignatureMode>
+Signatures("signatures",
+           cl::desc("Use the function types of the address-taken functions"),
+           cl::values(clEnumValN(SigOff, "off", "not used"),
+                      clEnumValN(SigFilter, "filter", "drop the targets whose type does not fit the call"),
+                      clEnumValN(SigOnly, "only", "resolve by the types only, without the pointer analysis")),
+           cl::init(SigOff));
+
+// the inclusion constraints are solved on threads, the walk is not
+enum SolverKind {
+    SolverWalk,
+    SolverInclusion
+};
+static cl::opt<SolverKind>
+Solver("solver",
+       cl::desc("Points-to solver"),
+       cl::values(clEnumValN(SolverWalk, "walk", "walk the calls in order, with fields, strong updates and contexts"),
+                  clEnumValN(SolverInclusion, "inclusion", "solve inclusion constraints on threads, coarser than the walk: "
+                                                           "no fields, no strong updates, no contexts")),
+       cl::init(SolverWalk));
+static cl::opt<unsigned>
+SolverThreads("solver-threads",
+              cl::desc("Number of threads of the inclusion solver (0 = one per core), the lines are the same for any number"),
+              cl::init(0));
+
+// only load the function bodies reached from the entries
+static cl::opt<bool>
+LazyLoad("lazy",
+         cl::desc("Load the function bodies on demand, from the entries"),
+         cl::init(false));
+static cl::list<std::string>
+LazyEntries("lazy-entry",
+            cl::desc("Entry function of the lazy loading, main by default"),
+            cl::CommaSeparated);
+
 class Pointer {
     set<Pointer *> pointToSet;
     map<Pointer *, Value *> blockMap;
@@ -94,8 +191,8 @@ public:
         BasicBlock *block = inst->getParent();
         Function *func = block->getParent();
         
-        set<Pointer *>::iterator it;
-        for (it = this->pointToSet.begin(); it != this->pointToSet.end(); ++it) {
+        set<Pointer *>::iterator it = this->pointToSet.begin();
+        while (it != this->pointToSet.end()) {
             Value *oldInstV = this->blockMap[*it];
             assert(isa<Instruction>(oldInstV));
             Instruction *oldInst = dyn_cast<Instruction>(oldInstV);
@@ -105,9 +202,10 @@ public:
             // only store inst erase
             // if in the same basic block, erase the old values
             // if in different functions, erase the old values
-            if (isa<StoreInst>(inst) && (block == oldBlock || func != oldFunc)) {
-                this->pointToSet.erase(*it);
-            }
+            if (isa<StoreInst>(inst) && (block == oldBlock || func != oldFunc))
+                it = this->pointToSet.erase(it);
+            else
+                ++it;
         }
         this->pointToSet.insert(ptr);
         this->blockMap.insert(pair<Pointer *, Value *>(ptr, iV));
@@ -170,96 +268,432 @@ public:
     }
 };
 
+/*
+function -> every value it returns, built in one walk of the module.
+A call site looks its callee up instead of scanning the callee's instructions again.
+*/
 class ReturnManager {
+    map<Function *, vector<Value *>> returnMap;
+    vector<Value *> emptyValues;
 public:
-    Value* getReturnValueByFuncValue(Value *func) {
-        if (!isa<Function>(func))
-            return NULL;
-        
-        Value *ret = NULL;
-        Function &F = *(dyn_cast<Function>(func));
-        if (F.getReturnType()->isPointerTy()) {
+    void init(Module &M) {
+        this->returnMap.clear();
+        for (Function &F : M) {
+            if (!F.getReturnType()->isPointerTy())
+                continue;
             for (BasicBlock &B : F) {
-                for (Instruction &I : B) {
-                    if (isa<ReturnInst>(&I)) {
-                        ReturnInst *retInst = dyn_cast<ReturnInst>(&I);
-                        ret = retInst->getReturnValue();
-                    }
+                if (ReturnInst *retInst = dyn_cast<ReturnInst>(B.getTerminator())) {
+                    if (retInst->getReturnValue() != NULL)
+                        this->returnMap[&F].push_back(retInst->getReturnValue());
+                }
+            }
+        }
+    }
+
+    const vector<Value *>& getReturnValues(Function *func) {
+        map<Function *, vector<Value *>>::iterator it = this->returnMap.find(func);
+        if (it == this->returnMap.end())
+            return this->emptyValues;
+        return it->second;
+    }
+};
+
+/*
+pointer -> base pointer set, memoized over the lines and calls resolved after the analysis.
+The walk is iterative with a visited set, so a cycle in the point-to graph terminates.
+*/
+class BasePointerStore {
+    map<Pointer *, set<Pointer *>> store;
+public:
+    // same result as Pointer::getBasePointerSet, but safe for cycles, and every pointer is walked once
+    set<Pointer *> resolveBasePointerSet(Pointer *ptr) {
+        map<Pointer *, set<Pointer *>>::iterator found = this->store.find(ptr);
+        if (found != this->store.end())
+            return found->second;
+
+        set<Pointer *> basePointers;
+        set<Pointer *> visited;
+        vector<Pointer *> worklist;
+        worklist.push_back(ptr);
+        visited.insert(ptr);
+        while (!worklist.empty()) {
+            Pointer *cur = worklist.back();
+            worklist.pop_back();
+
+            // resolved by another query
+            found = this->store.find(cur);
+            if (cur != ptr && found != this->store.end()) {
+                basePointers.insert(found->second.begin(), found->second.end());
+                continue;
+            }
+
+            set<Pointer *> pointToSet = cur->getPointerSet();
+            if (pointToSet.size() != 0) {
+                set<Pointer *>::iterator it;
+                for (it = pointToSet.begin(); it != pointToSet.end(); ++it) {
+                    if (visited.insert(*it).second)
+                        worklist.push_back(*it);
                 }
             }
+            else if (isa<Function>(cur->getValue())) {
+                basePointers.insert(cur);
+            }
         }
-        return ret;
+
+        this->store[ptr] = basePointers;
+        return basePointers;
     }
 };
 
 class LineFunctionPtr {
-    map<int, Pointer *> lineMap;
+    // line -> the called value pointer in each context
+    map<int, set<Pointer *>> lineMap;
+    // line -> the first call of the line
+    map<int, CallInst *> lineCallMap;
+    // call -> the called value pointer in each context
+    map<CallInst *, set<Pointer *>> callMap;
+    // drops the functions whose type does not fit the call, NULL keeps all
+    SignatureIndex *signatures;
+    raw_ostream *os;
+
+    void filterBasePointerSet(set<Pointer *> &ptrs, CallInst *call) {
+        if (this->signatures == NULL)
+            return;
+        set<Pointer *>::iterator it = ptrs.begin();
+        while (it != ptrs.end()) {
+            Function *f = dyn_cast<Function>((*it)->getValue());
+            if (f != NULL && !SignatureIndex::isCompatible(call->getFunctionType(), f))
+                it = ptrs.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    set<Pointer *> getLineBasePointerSet(set<Pointer *> &ptrs, BasePointerStore &store) {
+        set<Pointer *> basePointers;
+        set<Pointer *>::iterator p;
+        for (p = ptrs.begin(); p != ptrs.end(); ++p) {
+            set<Pointer *> basePtrs = store.resolveBasePointerSet(*p);
+            basePointers.insert(basePtrs.begin(), basePtrs.end());
+        }
+        return basePointers;
+    }
 
 public:
-    LineFunctionPtr() {}
+    LineFunctionPtr() {
+        this->signatures = NULL;
+        this->os = &errs();
+    }
+
+    void setSignatureFilter(SignatureIndex *signatures) {
+        this->signatures = signatures;
+    }
+    void setOutput(raw_ostream &os) {
+        this->os = &os;
+    }
+
+    void insertLineFunctionPtr(int line, Pointer *ptr, CallInst *call) {
+        callMap[call].insert(ptr);
 
-    void insertLineFunctionPtr(int line, Pointer *ptr) {
         // line not add to map yet
         if (lineMap.find(line) == lineMap.end()) {
-            lineMap.insert(pair<int, Pointer *>(line, ptr));
+            set<Pointer *> ptrs;
+            ptrs.insert(ptr);
+            lineMap.insert(pair<int, set<Pointer *>>(line, ptrs));
+            lineCallMap.insert(pair<int, CallInst *>(line, call));
+        }
+        // the same called value in another context
+        else if ((*lineMap[line].begin())->getValue() == ptr->getValue()) {
+            lineMap[line].insert(ptr);
+        }
+        // the direct calls and the fallback of a promoted call
+        else if (call->getMetadata("promoted") != NULL && lineCallMap[line]->getMetadata("promoted") != NULL) {
+            lineMap[line].insert(ptr);
         }
     }
-    void outputFuncNames(set<Pointer *> pointToSet) {
-        if (pointToSet.size() != 0) {
-            set<Pointer *>::iterator it;
-            for (it = pointToSet.begin(); it != --pointToSet.end(); ++it) {
-                errs() << (*it)->getValue()->getName() << ", ";
+    LineNames getLineNames() {
+        BasePointerStore store;
+        LineNames lineNames;
+        map<int, set<Pointer *>>::iterator it;
+        for (it = lineMap.begin(); it != lineMap.end(); ++it) {
+            set<Pointer *> basePointers = this->getLineBasePointerSet(it->second, store);
+            this->filterBasePointerSet(basePointers, lineCallMap[it->first]);
+            vector<string> &names = lineNames[it->first];
+            set<Pointer *>::iterator p;
+            for (p = basePointers.begin(); p != basePointers.end(); ++p) {
+                names.push_back((*p)->getValue()->getName().str());
             }
-            errs() << (*it)->getValue()->getName() << "\n";
         }
+        return lineNames;
     }
-    void output() {
-        map<int, Pointer *>::iterator it;
-        for (it = lineMap.begin(); it != lineMap.end(); ++it) {
-            errs() << it->first << " : ";
-            set<Pointer *> ptrs = it->second->getBasePointerSet();
-            this->outputFuncNames(ptrs);
+    // group the lines by the function they are in
+    map<Function *, LineNames> getFunctionLineNames(LineNames &lineNames) {
+        map<Function *, LineNames> funcLines;
+        LineNames::iterator it;
+        for (it = lineNames.begin(); it != lineNames.end(); ++it) {
+            funcLines[lineCallMap[it->first]->getFunction()].insert(*it);
         }
-        errs() << "\n";
+        return funcLines;
+    }
+    // call -> base pointers of its called value in all contexts
+    map<CallInst *, set<Pointer *>> getCallBasePointerSets() {
+        BasePointerStore store;
+        map<CallInst *, set<Pointer *>> callBaseMap;
+        map<CallInst *, set<Pointer *>>::iterator it;
+        for (it = callMap.begin(); it != callMap.end(); ++it) {
+            callBaseMap[it->first] = this->getLineBasePointerSet(it->second, store);
+            this->filterBasePointerSet(callBaseMap[it->first], it->first);
+        }
+        return callBaseMap;
+    }
+    // an edge for every call and callee, not only the first call of a line
+    void insertCallGraph(CallGraphWriter &writer) {
+        map<CallInst *, set<Pointer *>> callBaseMap = this->getCallBasePointerSets();
+        map<CallInst *, set<Pointer *>>::iterator it;
+        for (it = callBaseMap.begin(); it != callBaseMap.end(); ++it) {
+            vector<string> names;
+            set<Pointer *>::iterator p;
+            for (p = it->second.begin(); p != it->second.end(); ++p) {
+                names.push_back((*p)->getValue()->getName().str());
+            }
+            writer.insertCall(it->first, names);
+        }
+    }
+    void outputFuncNames(vector<string> &names) {
+        if (names.size() != 0) {
+            size_t i;
+            for (i = 0; i + 1 < names.size(); ++i) {
+                *this->os << names[i] << ", ";
+            }
+            *this->os << names[i] << "\n";
+        }
+    }
+    void outputLineNames(LineNames &lineNames) {
+        LineNames::iterator it;
+        for (it = lineNames.begin(); it != lineNames.end(); ++it) {
+            *this->os << it->first << " : ";
+            this->outputFuncNames(it->second);
+        }
+        *this->os << "\n";
+    }
+    void output() {
+        LineNames lineNames = this->getLineNames();
+        this->outputLineNames(lineNames);
     }
 };
 
 class PointerManager {
-    map<Value *, Pointer *> pointerMap;
-    
-    bool isPointerExist(Value *value) {
-        return pointerMap.find(value) != pointerMap.end();
+    // (value, context) -> pointer
+    map<pair<Value *, int>, Pointer *> pointerMap;
+    // the context of the function being dealt with
+    int context;
+
+    // functions, globals and constants are the same in every context
+    pair<Value *, int> getKey(Value *value, int ctx) {
+        if (value == NULL || !(isa<Instruction>(value) || isa<Argument>(value)))
+            ctx = 0;
+        return pair<Value *, int>(value, ctx);
+    }
+    bool isPointerExist(pair<Value *, int> key) {
+        return pointerMap.find(key) != pointerMap.end();
     }
-    Pointer* getPointerByValue(Value *value) {
-        if (this->isPointerExist(value)) {
-            return pointerMap[value];
+    Pointer* getPointerByKey(pair<Value *, int> key) {
+        if (this->isPointerExist(key)) {
+            return pointerMap[key];
         }
         return NULL;
     }
 public:
+    PointerManager() {
+        this->context = 0;
+    }
+
     Pointer* getPointerFromValue(Value *value) {
-        if (isPointerExist(value)) {
-            return this->getPointerByValue(value);
+        return this->getPointerFromValue(value, this->context);
+    }
+    Pointer* getPointerFromValue(Value *value, int ctx) {
+        pair<Value *, int> key = this->getKey(value, ctx);
+        if (isPointerExist(key)) {
+            return this->getPointerByKey(key);
         }
         else {
             Pointer *newPointer = new Pointer(value);
-            pointerMap.insert(pair<Value *, Pointer *>(value, newPointer));
+            pointerMap.insert(pair<pair<Value *, int>, Pointer *>(key, newPointer));
             return newPointer;
         }
     }
+
+    // context
+    void setContext(int ctx) {
+        this->context = ctx;
+    }
+    int getContext() {
+        return this->context;
+    }
+
+    // forget the pointers of the last module
+    void clear() {
+        map<pair<Value *, int>, Pointer *>::iterator it;
+        for (it = pointerMap.begin(); it != pointerMap.end(); ++it) {
+            delete it->second;
+        }
+        this->pointerMap.clear();
+        this->context = 0;
+    }
+
+    // statistics
+    unsigned long pointerCount() {
+        return this->pointerMap.size();
+    }
+    unsigned long pointToCount() {
+        unsigned long count = 0;
+        map<pair<Value *, int>, Pointer *>::iterator it;
+        for (it = pointerMap.begin(); it != pointerMap.end(); ++it) {
+            count += it->second->getPointerSet().size();
+        }
+        return count;
+    }
+};
+
+// one per thread, a batch analyzes a module on each worker
+thread_local PointerManager pointerManager;
+
+/*
+What a callee can read when it is called: the point-to sets reachable from its arguments and from the globals,
+and the fields of the objects among them. A function is skipped in a context only when this is the same as
+the last time it was dealt with there, so a strong update made by the caller between two calls is seen.
+*/
+struct CallState {
+    map<Pointer *, set<Pointer *>> pointToSets;
+    map<Pointer *, map<int, set<Pointer *>>> fields;
+
+    bool operator==(const CallState &other) const {
+        return this->pointToSets == other.pointToSets && this->fields == other.fields;
+    }
 };
 
-PointerManager pointerManager;
+/*
+k-limited call-string contexts, a context is the last k call sites on the stack.
+foo(t1, a_fptr) at line 12 and foo(t1, s_fptr) at line 14 get different contexts when k >= 1,
+so the arguments of foo do not merge the targets of both call sites.
+*/
+class ContextManager {
+    unsigned depth;
+    unsigned budget;
+    vector<vector<Value *>> contexts;      // context id -> call string, 0 is the empty one
+    map<vector<Value *>, int> contextMap;  // call string -> context id
+
+    // (function, context) -> the state it was dealt with in
+    map<pair<Function *, int>, CallState> summaryMap;
+    // (function, context) being dealt with, for recursion
+    set<pair<Function *, int>> activeSet;
+
+    unsigned long budgetHits;
+    unsigned long summaryHits;
+    unsigned long summaryMisses;
+public:
+    ContextManager() {
+        this->depth = 0;
+        this->budget = 0;
+        this->budgetHits = 0;
+        this->summaryHits = 0;
+        this->summaryMisses = 0;
+
+        vector<Value *> emptyString;
+        this->contexts.push_back(emptyString);
+        this->contextMap.insert(pair<vector<Value *>, int>(emptyString, 0));
+    }
+
+    void init(unsigned depth, unsigned budget) {
+        this->depth = depth;
+        this->budget = budget;
+    }
+    bool isEnabled() {
+        return this->depth > 0;
+    }
+
+    // the context of the callee when called at call in callerContext
+    int getCalleeContext(int callerContext, Value *call) {
+        if (!this->isEnabled())
+            return 0;
+
+        vector<Value *> callString = this->contexts[callerContext];
+        callString.push_back(call);
+        if (callString.size() > this->depth)
+            callString.erase(callString.begin());
+
+        map<vector<Value *>, int>::iterator it = this->contextMap.find(callString);
+        if (it != this->contextMap.end())
+            return it->second;
+
+        // out of budget, fall back to the context-insensitive one
+        if (this->contexts.size() >= this->budget) {
+            ++this->budgetHits;
+            return 0;
+        }
 
+        int ctx = this->contexts.size();
+        this->contexts.push_back(callString);
+        this->contextMap.insert(pair<vector<Value *>, int>(callString, ctx));
+        return ctx;
+    }
+
+    // false if f was dealt with in ctx in the same state, or is being dealt with
+    bool needDealFunction(Function *f, int ctx, const CallState &state) {
+        if (!this->isEnabled())
+            return true;
+
+        pair<Function *, int> key(f, ctx);
+        if (this->activeSet.find(key) != this->activeSet.end()) {
+            ++this->summaryHits;
+            return false;
+        }
+
+        map<pair<Function *, int>, CallState>::iterator it = this->summaryMap.find(key);
+        if (it != this->summaryMap.end() && it->second == state) {
+            ++this->summaryHits;
+            return false;
+        }
+
+        this->summaryMap[key] = state;
+        ++this->summaryMisses;
+        return true;
+    }
+    void enterFunction(Function *f, int ctx) {
+        if (this->isEnabled())
+            this->activeSet.insert(pair<Function *, int>(f, ctx));
+    }
+    void leaveFunction(Function *f, int ctx) {
+        if (this->isEnabled())
+            this->activeSet.erase(pair<Function *, int>(f, ctx));
+    }
+
+    void output(raw_ostream &os, double ms, long heapBytes) {
+        os << "k = " << this->depth
+               << ", contexts = " << this->contexts.size()
+               << " (budget " << this->budget << ", " << this->budgetHits << " over budget)"
+               << ", summaries = " << this->summaryMisses << " dealt / " << this->summaryHits << " reused"
+               << ", pointers = " << pointerManager.pointerCount()
+               << " (" << pointerManager.pointToCount() << " point-to)"
+               << ", heap = " << heapBytes / 1024 << " KB"
+               << ", time = " << format("%.3f", ms) << " ms\n";
+    }
+};
+
+/*
+The fields of the struct and array objects, by offset.
+An object is the pointer of its value in a context, so the fields stored in one context
+are not seen by the same allocation in another.
+*/
 class PropertyManager {
-    map<Value *, map<int, set<Pointer *>>> ownerMap;
+    map<Pointer *, map<int, set<Pointer *>>> ownerMap;
     map<Pointer *, Value *> ptrMap;// property ptr -> store inst
 
     void generatePtrMap(Pointer *ptr, Value *value) {
         this->ptrMap.insert(pair<Pointer *, Value *>(ptr, value));
     }
     // insert
-    void insertOwnerPointer(Value *owner, int offset, 
+    void insertOwnerPointer(Pointer *owner, int offset,
                             Value *source, StoreInst *storeInst) {
 
         // basic block of the new source
@@ -302,8 +736,13 @@ class PropertyManager {
         this->ownerMap[owner][offset] = newSet;
     }
 public:
-    bool isOwnerExist(Value *value) {
-        return this->ownerMap.find(value) != this->ownerMap.end();
+    bool isOwnerExist(Pointer *owner) {
+        return this->ownerMap.find(owner) != this->ownerMap.end();
+    }
+    map<int, set<Pointer *>> getOffsetMap(Pointer *owner) {
+        if (this->isOwnerExist(owner))
+            return this->ownerMap[owner];
+        return map<int, set<Pointer *>>();
     }
     Value* getOwner(Value *getInst) {
         assert(isa<GetElementPtrInst>(getInst));
@@ -328,7 +767,7 @@ public:
 
         return 0;
     }
-    void insertOffsetMap(Value *des, Value *source) {
+    void insertOffsetMap(Pointer *des, Pointer *source) {
         if (this->isOwnerExist(source)) {
             map<int, set<Pointer *>> offsetMap = this->ownerMap[source];
 
@@ -347,7 +786,7 @@ public:
                 this->ownerMap[des] = offsetMap;
             }
             else {
-                this->ownerMap.insert(pair<Value *, map<int, set<Pointer *>>>(des, offsetMap));
+                this->ownerMap.insert(pair<Pointer *, map<int, set<Pointer *>>>(des, offsetMap));
             }
         }
     }
@@ -358,7 +797,7 @@ public:
     %arrayidx13 = getelementptr inbounds [2 x i32 (i32, i32)*], [2 x i32 (i32, i32)*]* %r_fptr, i64 0, i64 1, !dbg !79
     store i32 (i32, i32)* %1, i32 (i32, i32)** %arrayidx13, align 8, !dbg !80
     */
-    set<Pointer *> propertyPointerSet(Value *owner, int offset) {
+    set<Pointer *> propertyPointerSet(Pointer *owner, int offset) {
         if (this->isOwnerExist(owner)) {
             return this->ownerMap[owner][offset];
         } 
@@ -383,21 +822,19 @@ public:
         if (isa<LoadInst>(owner)) {
             set<Pointer *>::iterator it;
             for (it = ownerPtrSet.begin(); it != ownerPtrSet.end(); ++it) {
-                Value *newOwner = (*it)->getValue();//struct fptr
-
-                this->insertOwnerPointer(newOwner, offset, source, storeInst);
+                this->insertOwnerPointer(*it, offset, source, storeInst);//struct fptr
             }
         }
         // getelementptr ... <struct> offset
         else {
-            this->insertOwnerPointer(owner, offset, source, storeInst);
+            this->insertOwnerPointer(ownerPtr, offset, source, storeInst);
         }
     }
     void initProperty(Value *getInst) {
         assert(isa<GetElementPtrInst>(getInst));
 
         // get owner and offset
-        Value *owner = this->getOwner(getInst);
+        Pointer *owner = pointerManager.getPointerFromValue(this->getOwner(getInst));
         int offset = this->getOffset(getInst);
 
         if (!this->isOwnerExist(owner)) {
@@ -409,23 +846,409 @@ public:
             offsetMap.insert(pair<int, set<Pointer *>>(offset, propertyValueSet));
 
             // insert into ownerMap
-            this->ownerMap.insert(pair<Value *, map<int, set<Pointer *>>>(owner, offsetMap));
+            this->ownerMap.insert(pair<Pointer *, map<int, set<Pointer *>>>(owner, offsetMap));
+        }
+    }
+};
+
+/*
+Demand-driven mode: only the called values of the call instructions are queried.
+A query walks backward from a value through the assignments it depends on:
+casts, getelementptr, phi and select in SSA, the stores of a load, the call sites of an argument,
+and the returns of a call. The answer is a set of locations (function or memory object, offset).
+Stores are matched to a load by value type first, so only the stores that may hold the loaded value
+are looked at. The walk is flow-insensitive, like CFL-reachability, and every answer is cached.
+*/
+typedef pair<Value *, int> Location;
+
+class QueryManager {
+    PropertyManager *propertyManager;   // offsets are the same as the property maps
+    ReturnManager *returnManager;       // function -> returned values
+    SignatureIndex *signatures;         // filter of the indirect targets, NULL keeps all
+
+    // index of the module, built once
+    map<Type *, vector<StoreInst *>> storeMap;        // stored value type -> stores
+    map<Function *, vector<CallInst *>> callerMap;    // function -> direct call sites
+    vector<CallInst *> indirectCalls;
+
+    // answers
+    map<Value *, set<Location>> answerMap;
+    set<Value *> doneSet;       // answered, can be reused
+    set<Value *> activeSet;     // being answered, a query on it again is a cycle
+    bool isCyclic;
+    bool isChanged;
+
+    void insertLocations(set<Location> &des, set<Location> source) {
+        des.insert(source.begin(), source.end());
+    }
+    bool isOverlap(set<Location> &a, set<Location> &b) {
+        set<Location>::iterator it;
+        for (it = a.begin(); it != a.end(); ++it) {
+            if (b.find(*it) != b.end())
+                return true;
+        }
+        return false;
+    }
+
+    set<Location> getPointToSet(Value *v) {
+        // reuse the answer of an earlier query
+        if (this->doneSet.find(v) != this->doneSet.end())
+            return this->answerMap[v];
+        // a cycle, use what is known now and query again later
+        if (this->activeSet.find(v) != this->activeSet.end()) {
+            this->isCyclic = true;
+            return this->answerMap[v];
+        }
+
+        this->activeSet.insert(v);
+        set<Location> result = this->computePointToSet(v);
+        this->activeSet.erase(v);
+
+        set<Location> &answer = this->answerMap[v];
+        size_t oldSize = answer.size();
+        answer.insert(result.begin(), result.end());
+        if (answer.size() != oldSize)
+            this->isChanged = true;
+        this->doneSet.insert(v);
+
+        return answer;
+    }
+    set<Location> computePointToSet(Value *v) {
+        set<Location> result;
+
+        // function, or memory object
+        if (isa<Function>(v) || isa<GlobalVariable>(v) || isa<AllocaInst>(v)) {
+            result.insert(Location(v, 0));
+        }
+        // constant cast of a function or global
+        else if (ConstantExpr *constExpr = dyn_cast<ConstantExpr>(v)) {
+            if (constExpr->isCast())
+                this->insertLocations(result, this->getPointToSet(constExpr->getOperand(0)));
+        }
+        else if (CastInst *castInst = dyn_cast<CastInst>(v)) {
+            this->insertLocations(result, this->getPointToSet(castInst->getOperand(0)));
+        }
+        // the same objects, at another offset
+        else if (isa<GetElementPtrInst>(v)) {
+            int offset = this->propertyManager->getOffset(v);
+            set<Location> bases = this->getPointToSet(dyn_cast<GetElementPtrInst>(v)->getPointerOperand());
+            set<Location>::iterator it;
+            for (it = bases.begin(); it != bases.end(); ++it) {
+                result.insert(Location(it->first, offset));
+            }
+        }
+        else if (PHINode *phi = dyn_cast<PHINode>(v)) {
+            for (Use *u_ptr = phi->incoming_values().begin(); u_ptr != phi->incoming_values().end(); ++u_ptr) {
+                this->insertLocations(result, this->getPointToSet(u_ptr->get()));
+            }
+        }
+        else if (SelectInst *select = dyn_cast<SelectInst>(v)) {
+            this->insertLocations(result, this->getPointToSet(select->getTrueValue()));
+            this->insertLocations(result, this->getPointToSet(select->getFalseValue()));
+        }
+        else if (isa<LoadInst>(v)) {
+            this->dealLoad(dyn_cast<LoadInst>(v), result);
+        }
+        else if (isa<Argument>(v)) {
+            this->dealArgument(dyn_cast<Argument>(v), result);
+        }
+        else if (isa<CallInst>(v)) {
+            this->dealCallReturn(dyn_cast<CallInst>(v), result);
+        }
+        // null and other constants point to nothing
+
+        return result;
+    }
+    // the values of the stores to the same locations
+    void dealLoad(LoadInst *load, set<Location> &result) {
+        set<Location> locations = this->getPointToSet(load->getPointerOperand());
+        if (locations.size() == 0)
+            return;
+
+        vector<StoreInst *> &stores = this->storeMap[load->getType()];
+        for (size_t i = 0; i < stores.size(); ++i) {
+            set<Location> storeLocations = this->getPointToSet(stores[i]->getPointerOperand());
+            if (this->isOverlap(locations, storeLocations))
+                this->insertLocations(result, this->getPointToSet(stores[i]->getValueOperand()));
+        }
+    }
+    // the real arguments at every call site
+    void dealArgument(Argument *arg, set<Location> &result) {
+        Function *func = arg->getParent();
+        unsigned argNo = arg->getArgNo();
+
+        vector<CallInst *> calls = this->callerMap[func];
+        // called through a pointer
+        if (func->hasAddressTaken()) {
+            for (size_t i = 0; i < this->indirectCalls.size(); ++i) {
+                set<Function *> targets = this->getCallTargets(this->indirectCalls[i]);
+                if (targets.find(func) != targets.end())
+                    calls.push_back(this->indirectCalls[i]);
+            }
+        }
+
+        for (size_t i = 0; i < calls.size(); ++i) {
+            if (argNo < calls[i]->getNumArgOperands())
+                this->insertLocations(result, this->getPointToSet(calls[i]->getArgOperand(argNo)));
+        }
+    }
+    // the returned values of every callee, a declaration like malloc gives a new object
+    void dealCallReturn(CallInst *call, set<Location> &result) {
+        if (!call->getType()->isPointerTy())
+            return;
+
+        set<Function *> targets = this->getCallTargets(call);
+        set<Function *>::iterator it;
+        for (it = targets.begin(); it != targets.end(); ++it) {
+            if ((*it)->isDeclaration()) {
+                result.insert(Location(call, 0));
+                continue;
+            }
+            const vector<Value *> &rets = this->returnManager->getReturnValues(*it);
+            for (size_t i = 0; i < rets.size(); ++i) {
+                this->insertLocations(result, this->getPointToSet(rets[i]));
+            }
+        }
+    }
+    set<Function *> getCallTargets(CallInst *call) {
+        set<Function *> targets;
+        Value *calledValue = call->getCalledValue()->stripPointerCasts();
+
+        if (Function *func = dyn_cast<Function>(calledValue)) {
+            targets.insert(func);
+            return targets;
+        }
+
+        set<Location> locations = this->getPointToSet(calledValue);
+        set<Location>::iterator it;
+        for (it = locations.begin(); it != locations.end(); ++it) {
+            if (!isa<Function>(it->first) || it->second != 0)
+                continue;
+            Function *func = dyn_cast<Function>(it->first);
+            if (this->signatures == NULL || SignatureIndex::isCompatible(call->getFunctionType(), func))
+                targets.insert(func);
+        }
+        return targets;
+    }
+public:
+    QueryManager() {
+        this->propertyManager = NULL;
+        this->returnManager = NULL;
+        this->signatures = NULL;
+        this->isCyclic = false;
+        this->isChanged = false;
+    }
+
+    void init(Module &M, PropertyManager *propertyManager, ReturnManager *returnManager, SignatureIndex *signatures) {
+        this->propertyManager = propertyManager;
+        this->returnManager = returnManager;
+        this->signatures = signatures;
+
+        for (Function &F : M) {
+            for (BasicBlock &B : F) {
+                for (Instruction &I : B) {
+                    if (StoreInst *storeInst = dyn_cast<StoreInst>(&I)) {
+                        Type *ty = storeInst->getValueOperand()->getType();
+                        if (ty->isPointerTy())
+                            this->storeMap[ty].push_back(storeInst);
+                    }
+                    else if (CallInst *callInst = dyn_cast<CallInst>(&I)) {
+                        Value *calledValue = callInst->getCalledValue()->stripPointerCasts();
+                        if (Function *func = dyn_cast<Function>(calledValue))
+                            this->callerMap[func].push_back(callInst);
+                        else
+                            this->indirectCalls.push_back(callInst);
+                    }
+                }
+            }
         }
     }
+
+    // the functions called at call, query again until the cycles are stable
+    set<Function *> resolveCallTargets(CallInst *call) {
+        this->isCyclic = false;
+        this->isChanged = false;
+        set<Function *> targets = this->getCallTargets(call);
+
+        while (this->isCyclic && this->isChanged) {
+            this->isCyclic = false;
+            this->isChanged = false;
+            this->doneSet.clear();
+            targets = this->getCallTargets(call);
+        }
+        return targets;
+    }
+};
+
+/*
+Indirect call promotion.
+The analysis may miss a target, so every promoted call keeps a fallback:
+    %r = call %fptr(...)   =>
+    %c0 = icmp eq %fptr, @f0
+    br %c0, label %promote.direct, label %promote.check
+  promote.direct:    %r0 = call @f0(...)    br label %promote.cont
+  promote.check:     ... one compare for each target ...
+  promote.fallback:  %r1 = call %fptr(...)  br label %promote.cont
+  promote.cont:      %r = phi [%r0, ...], ..., [%r1, %promote.fallback]
+Only when the function types leave the one target as the sole candidate (-signatures=filter) is the call
+rewritten in place, %r = call @f(...), without a compare.
+The direct calls keep the debug location of the original call.
+The calls of a chain are marked !promoted: the fallback is not chained twice when the written bitcode
+is analyzed again, and the calls still print as one line.
+*/
+class CallPromoter {
+    unsigned directCount;
+    unsigned chainCount;
+
+    // the function type must be the same, or the arguments would not fit
+    bool isCompatible(CallInst *call, Function *f) {
+        Type *calledType = call->getCalledValue()->getType()->getPointerElementType();
+        return f->getFunctionType() == calledType;
+    }
+    void promoteToChain(CallInst *call, vector<Function *> &targets) {
+        Value *calledValue = call->getCalledValue();
+        BasicBlock *head = call->getParent();
+        Function *func = head->getParent();
+        LLVMContext &context = func->getContext();
+
+        // head | fallback: call | cont
+        BasicBlock *fallback = head->splitBasicBlock(call->getIterator(), "promote.fallback");
+        BasicBlock *cont = fallback->splitBasicBlock(++call->getIterator(), "promote.cont");
+        head->getTerminator()->eraseFromParent();
+        call->setMetadata("promoted", MDNode::get(context, None));
+
+        PHINode *phi = NULL;
+        if (!call->getType()->isVoidTy() && !call->use_empty()) {
+            phi = PHINode::Create(call->getType(), targets.size() + 1, "promote.ret", &cont->front());
+            call->replaceAllUsesWith(phi);
+            phi->addIncoming(call, fallback);
+        }
+
+        BasicBlock *check = head;
+        for (size_t i = 0; i < targets.size(); ++i) {
+            BasicBlock *direct = BasicBlock::Create(context, "promote.direct", func, fallback);
+            BasicBlock *next = fallback;
+            if (i + 1 < targets.size())
+                next = BasicBlock::Create(context, "promote.check", func, fallback);
+
+            IRBuilder<> checkBuilder(check);
+            Value *isTarget = checkBuilder.CreateICmpEQ(calledValue, targets[i]);
+            checkBuilder.CreateCondBr(isTarget, direct, next);
+
+            CallInst *directCall = dyn_cast<CallInst>(call->clone());
+            directCall->setCalledFunction(targets[i]);
+            direct->getInstList().push_back(directCall);
+            IRBuilder<> directBuilder(direct);
+            directBuilder.CreateBr(cont);
+
+            if (phi != NULL)
+                phi->addIncoming(directCall, direct);
+            check = next;
+        }
+    }
+public:
+    CallPromoter() {
+        this->directCount = 0;
+        this->chainCount = 0;
+    }
+
+    // true if call is changed, candidates are the functions its type can reach, NULL if unknown
+    bool promote(CallInst *call, vector<Function *> &targets, unsigned maxTargets,
+                 const set<Function *> *candidates) {
+        if (isa<Function>(call->getCalledValue()->stripPointerCasts()) || targets.size() == 0)
+            return false;
+        if (call->getMetadata("promoted") != NULL)
+            return false;
+        for (size_t i = 0; i < targets.size(); ++i) {
+            if (targets[i] == NULL || !this->isCompatible(call, targets[i]))
+                return false;
+        }
+
+        if (targets.size() == 1 && candidates != NULL &&
+            candidates->size() == 1 && *candidates->begin() == targets[0]) {
+            call->setCalledFunction(targets[0]);
+            ++this->directCount;
+            return true;
+        }
+        if (targets.size() <= maxTargets) {
+            this->promoteToChain(call, targets);
+            ++this->chainCount;
+            return true;
+        }
+        return false;
+    }
+    unsigned getDirectCount() {
+        return this->directCount;
+    }
+    unsigned getChainCount() {
+        return this->chainCount;
+    }
 };
 
 ///!TODO TO BE COMPLETED BY YOU FOR ASSIGNMENT 3
 struct FuncPtrPass : public ModulePass {
     ReturnManager returnManager;
     PropertyManager propertyManager;
+    ContextManager contextManager;
+    QueryManager queryManager;
+    CallPromoter callPromoter;
+    ResultCache resultCache;
+    SignatureIndex signatures;
     LineFunctionPtr lineFuncs;
+    LineNames inclusionLines;   // lines of the inclusion solver
+    vector<Value *> globals;    // roots of the state a callee reads
+
+    // cost of the analysis
+    double analysisTime;
+    long analysisHeap;
+    raw_ostream *os;    // the lines and statistics
 
     static char ID; // Pass identification, replacement for typeid
-    FuncPtrPass() : ModulePass(ID) {}
+    FuncPtrPass() : ModulePass(ID), os(&errs()) {}
+    FuncPtrPass(raw_ostream &os) : ModulePass(ID), os(&os) {}
 
     bool runOnModule(Module &M) override {
         //M.dump();
+        pointerManager.clear();
+        this->lineFuncs.setOutput(*this->os);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        size_t startHeap = sys::Process::GetMallocUsage();
+        this->contextManager.init(ContextDepth, ContextBudget);
+        this->returnManager.init(M);
+        this->globals.clear();
+        for (GlobalVariable &G : M.globals()) {
+            this->globals.push_back(&G);
+        }
+
+        if (Solver == SolverInclusion) {
+            this->solveInclusion(M);
+            return false;
+        }
+
+        if (Signatures != SigOff) {
+            this->signatures.init(M);
+            // the lines come from the types only
+            if (Signatures == SigOnly)
+                return false;
+            this->lineFuncs.setSignatureFilter(&this->signatures);
+        }
+
+        if (CacheFile != "") {
+            this->resultCache.hashModule(M, this->getCacheConfig());
+            this->resultCache.load(CacheFile);
+            this->resultCache.computeDirtyFunctions(M);
+        }
+
+        if (DemandDriven) {
+            this->queryManager.init(M, &this->propertyManager, &this->returnManager,
+                                    Signatures == SigFilter ? &this->signatures : NULL);
+            this->dealCallInstsOnDemand(M);
+        }
+
         for (Function &F : M) {
+            if (DemandDriven)
+                break;
+
             bool isDealFunction = true;
             Argument *arg = (&F)->arg_begin();  // Argument *
             while (arg != (&F)->arg_end()) {
@@ -436,18 +1259,118 @@ struct FuncPtrPass : public ModulePass {
                 ++arg;
             }
 
-            if (isDealFunction)
+            if (isDealFunction && this->resultCache.isDirty(&F))
                 this->dealInstructionsInFunction(F);
         }
+
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        this->analysisTime = elapsed.count();
+        this->analysisHeap = (long)sys::Process::GetMallocUsage() - (long)startHeap;
+
+        // if modified, return true
+        if (PromoteCalls)
+            return this->promoteIndirectCalls();
         return false;
     }
     bool doFinalization(Module &M) override {
-        this->lineFuncs.output();
+        if (Signatures == SigOnly) {
+            LineNames lineNames = this->signatures.getLineNames(M);
+            this->lineFuncs.outputLineNames(lineNames);
+            return true;
+        }
+        if (Solver == SolverInclusion) {
+            this->lineFuncs.outputLineNames(this->inclusionLines);
+            return true;
+        }
+
+        LineNames lineNames = this->lineFuncs.getLineNames();
+
+        if (CallGraphFile != "")
+            this->writeCallGraph(M);
+
+        // lines of the unchanged functions come from the cache
+        if (CacheFile != "") {
+            map<Function *, LineNames> funcLines = this->lineFuncs.getFunctionLineNames(lineNames);
+            this->resultCache.insertCachedLines(M, lineNames);
+            this->resultCache.hashModule(M, this->getCacheConfig());
+            this->resultCache.write(CacheFile, M, funcLines);
+        }
+        this->lineFuncs.outputLineNames(lineNames);
+
+        if (ContextStats) {
+            this->contextManager.output(*this->os, this->analysisTime, this->analysisHeap);
+            if (CacheFile != "")
+                this->resultCache.outputStats(*this->os, M);
+        }
 
         return true;
     }
 
+    // the lines of the whole module from the inclusion constraints, names in order
+    void solveInclusion(Module &M) {
+        map<unsigned, set<string>> lineNames = WholeProgram::solveModule(M, SolverThreads);
+        this->inclusionLines.clear();
+        map<unsigned, set<string>>::iterator it;
+        for (it = lineNames.begin(); it != lineNames.end(); ++it) {
+            this->inclusionLines[it->first] = vector<string>(it->second.begin(), it->second.end());
+        }
+    }
+
+    bool promoteIndirectCalls() {
+        bool isModified = false;
+
+        map<CallInst *, set<Pointer *>> callBaseMap = this->lineFuncs.getCallBasePointerSets();
+        map<CallInst *, set<Pointer *>>::iterator it;
+        for (it = callBaseMap.begin(); it != callBaseMap.end(); ++it) {
+            vector<Function *> targets;
+            set<Pointer *>::iterator p;
+            for (p = it->second.begin(); p != it->second.end(); ++p) {
+                targets.push_back(dyn_cast<Function>((*p)->getValue()));
+            }
+            const set<Function *> *candidates = NULL;
+            if (Signatures == SigFilter)
+                candidates = &this->signatures.getCandidates(it->first->getFunctionType());
+            if (this->callPromoter.promote(it->first, targets, PromoteMaxTargets, candidates))
+                isModified = true;
+        }
+        return isModified;
+    }
+    void writeCallGraph(Module &M) {
+        CallGraphWriter writer;
+        this->lineFuncs.insertCallGraph(writer);
+
+        // unchanged functions, the names of a cached line go to the first call of the line
+        for (Function &F : M) {
+            LineNames cached;
+            if (!this->resultCache.getCachedLines(&F, cached))
+                continue;
+
+            for (BasicBlock &B : F) {
+                for (Instruction &I : B) {
+                    if (!isa<CallInst>(&I) || isLLVMCall(I))
+                        continue;
+
+                    DILocation *loc = I.getDebugLoc();
+                    LineNames::iterator it = cached.find(loc->getLine());
+                    if (it != cached.end()) {
+                        writer.insertCall(dyn_cast<CallInst>(&I), it->second);
+                        cached.erase(it);
+                    }
+                }
+            }
+        }
+
+        writer.write(CallGraphFile, CallGraphFileFormat);
+    }
+
     // tools
+    string getCacheConfig() {
+        string config;
+        raw_string_ostream os(config);
+        os << "hw3 k=" << ContextDepth << " budget=" << ContextBudget << " demand=" << DemandDriven
+           << " signatures=" << (int)Signatures;
+        return os.str();
+    }
     bool isLLVMCall(Instruction &I) {
         CallInst *callInst = dyn_cast<CallInst>(&I);
         StringRef calledName = callInst->getCalledValue()->getName();
@@ -498,6 +1421,37 @@ struct FuncPtrPass : public ModulePass {
             }
         }
     }
+    // point the called value of every call to the functions its query gives
+    void dealCallInstsOnDemand(Module &M) {
+        for (Function &F : M) {
+            if (!this->resultCache.isDirty(&F))
+                continue;
+
+            for (BasicBlock &B : F) {
+                for (Instruction &I : B) {
+                    if (!isa<CallInst>(&I) || isLLVMCall(I))
+                        continue;
+
+                    CallInst *callInst = dyn_cast<CallInst>(&I);
+                    DILocation *loc = callInst->getDebugLoc();
+                    unsigned line = loc->getLine();
+
+                    Value *calledValue = callInst->getCalledValue();
+                    Pointer *calledPtr = pointerManager.getPointerFromValue(calledValue);
+                    if (!isa<Function>(calledValue)) {
+                        set<Pointer *> funcPtrs;
+                        set<Function *> targets = this->queryManager.resolveCallTargets(callInst);
+                        set<Function *>::iterator it;
+                        for (it = targets.begin(); it != targets.end(); ++it) {
+                            funcPtrs.insert(pointerManager.getPointerFromValue(*it));
+                        }
+                        calledPtr->resetPointToSet(funcPtrs);
+                    }
+                    lineFuncs.insertLineFunctionPtr(line, calledPtr, callInst);
+                }
+            }
+        }
+    }
     void dealGetElementPtrInst(Value *v) {
         assert(isa<GetElementPtrInst>(v));
         GetElementPtrInst *getInst = dyn_cast<GetElementPtrInst>(v);
@@ -516,17 +1470,16 @@ struct FuncPtrPass : public ModulePass {
             // get the sub pointer set with offset
             set<Pointer *>::iterator it;
             for (it = ptrSet.begin(); it != ptrSet.end(); ++it) {
-                Value *owner = (*it)->getValue();
-
-                set<Pointer *> subSet = this->propertyManager.propertyPointerSet(owner, offset);
+                set<Pointer *> subSet = this->propertyManager.propertyPointerSet(*it, offset);
                 rSet.insert(subSet.begin(), subSet.end());
             }
         }
         // struct: scope variable, argument
         else {
-            if (!this->propertyManager.isOwnerExist(operandValue))
+            Pointer *ownerPtr = pointerManager.getPointerFromValue(operandValue);
+            if (!this->propertyManager.isOwnerExist(ownerPtr))
                 this->propertyManager.initProperty(v);
-            rSet = this->propertyManager.propertyPointerSet(operandValue, offset);
+            rSet = this->propertyManager.propertyPointerSet(ownerPtr, offset);
         }
 
         // update pointer set
@@ -598,7 +1551,7 @@ struct FuncPtrPass : public ModulePass {
         // called value
         Value *calledValue = callInst->getCalledValue();
         Pointer *calledPtr = pointerManager.getPointerFromValue(calledValue);
-        lineFuncs.insertLineFunctionPtr(line, calledPtr);
+        lineFuncs.insertLineFunctionPtr(line, calledPtr, callInst);
 
         #if IS_DEBUG
         calledValue->dump();
@@ -631,6 +1584,11 @@ struct FuncPtrPass : public ModulePass {
         set<Pointer *> pSet = funcPtr->getBasePointerSet();
         set<Pointer *>::iterator it;
         for (it = pSet.begin(); it != pSet.end(); ++it) {
+            Function *f = dyn_cast<Function>((*it)->getValue());
+            // a function of another type is not called here
+            if (Signatures == SigFilter && f != NULL &&
+                !SignatureIndex::isCompatible(dyn_cast<CallInst>(call)->getFunctionType(), f))
+                continue;
             this->dealCallFunction(call, (*it)->getValue());
         }
     }
@@ -641,25 +1599,70 @@ struct FuncPtrPass : public ModulePass {
         if (this->isNULL(func) || this->isMalloc(func))
             return;
 
+        Function *f = dyn_cast<Function>(func);
+        int callerContext = pointerManager.getContext();
+        int calleeContext = this->contextManager.getCalleeContext(callerContext, call);
+
         // bind the parameters
-        this->bindFunctionParams(call, func);
+        this->bindFunctionParams(call, func, callerContext, calleeContext);
 
         // deal the instructions in called function
-        Function *f = dyn_cast<Function>(func);
-        this->dealInstructionsInFunction(*f);
+        bool isDealFunction = true;
+        if (this->contextManager.isEnabled())
+            isDealFunction = this->contextManager.needDealFunction(f, calleeContext, this->getCallState(f, calleeContext));
+        if (isDealFunction) {
+            pointerManager.setContext(calleeContext);
+            this->contextManager.enterFunction(f, calleeContext);
+            this->dealInstructionsInFunction(*f);
+            this->contextManager.leaveFunction(f, calleeContext);
+            pointerManager.setContext(callerContext);
+        }
 
         // if return pointer value
         if (f->getReturnType()->isPointerTy()) {
-            Value *ret = this->returnManager.getReturnValueByFuncValue(func);
-            Pointer *retPtr = pointerManager.getPointerFromValue(ret);
+            // bind the callinst and every return value
+            Pointer *callPtr = pointerManager.getPointerFromValue(call, callerContext);
+            const vector<Value *> &rets = this->returnManager.getReturnValues(f);
+            for (size_t i = 0; i < rets.size(); ++i) {
+                Pointer *retPtr = pointerManager.getPointerFromValue(rets[i], calleeContext);
+                callPtr->copyPointToSet(retPtr, call);
+            }
+        }
+    }
+    // what f reads when called in ctx, see CallState
+    CallState getCallState(Function *f, int ctx) {
+        CallState state;
+        vector<Pointer *> worklist;
+        for (Argument &arg : f->args()) {
+            if (this->isPointer(&arg))
+                worklist.push_back(pointerManager.getPointerFromValue(&arg, ctx));
+        }
+        for (size_t i = 0; i < this->globals.size(); ++i) {
+            worklist.push_back(pointerManager.getPointerFromValue(this->globals[i]));
+        }
 
-            // bind the callinst and the return value
-            Pointer *callPtr = pointerManager.getPointerFromValue(call);
-            callPtr->copyPointToSet(retPtr, call);
+        while (!worklist.empty()) {
+            Pointer *ptr = worklist.back();
+            worklist.pop_back();
+            if (state.pointToSets.find(ptr) != state.pointToSets.end())
+                continue;
+
+            set<Pointer *> &pointToSet = state.pointToSets[ptr] = ptr->getPointerSet();
+            worklist.insert(worklist.end(), pointToSet.begin(), pointToSet.end());
+
+            // the fields of a struct or array object
+            if (state.fields.find(ptr) != state.fields.end() || !this->propertyManager.isOwnerExist(ptr))
+                continue;
+            map<int, set<Pointer *>> &offsetMap = state.fields[ptr] = this->propertyManager.getOffsetMap(ptr);
+            map<int, set<Pointer *>>::iterator it;
+            for (it = offsetMap.begin(); it != offsetMap.end(); ++it) {
+                worklist.insert(worklist.end(), it->second.begin(), it->second.end());
+            }
         }
+        return state;
     }
     // block means this bindation has a block constrain
-    void bindFunctionParams(Value *call, Value *f) {
+    void bindFunctionParams(Value *call, Value *f, int callerContext, int calleeContext) {
         // The real argument
         CallInst *callInst = dyn_cast<CallInst>(call);
         // The parameter: Function
@@ -672,27 +1675,27 @@ struct FuncPtrPass : public ModulePass {
 
             // if the argument is of pointer type
             if (this->isPointer(arg)) {
-                this->bindFuncPtrParam(call, arg, realV);
+                this->bindFuncPtrParam(call, arg, realV, callerContext, calleeContext);
             }
             
             ++op;
             ++arg;
         }
     }
-    void bindFuncPtrParam(Value *call, Argument *arg, Value *realV) {
-        Pointer *argPtr = pointerManager.getPointerFromValue(arg);
-        Pointer *realVPtr = pointerManager.getPointerFromValue(realV);
+    void bindFuncPtrParam(Value *call, Argument *arg, Value *realV, int callerContext, int calleeContext) {
+        Pointer *argPtr = pointerManager.getPointerFromValue(arg, calleeContext);
+        Pointer *realVPtr = pointerManager.getPointerFromValue(realV, callerContext);
 
-        // struct* type
-        if (this->propertyManager.isOwnerExist(realV)) {
-            this->propertyManager.insertOffsetMap(arg, realV);
+        // struct* type, the fields of the caller's object in its context
+        if (this->propertyManager.isOwnerExist(realVPtr)) {
+            this->propertyManager.insertOffsetMap(argPtr, realVPtr);
         }
         // int (*arr[x])
         else if (isa<GetElementPtrInst>(realV)) {
             GetElementPtrInst *getInst = dyn_cast<GetElementPtrInst>(realV);
             Value *operandValue = getInst->getPointerOperand();
             if (this->isArrayPointer(operandValue))
-                this->propertyManager.insertOffsetMap(arg, operandValue);
+                this->propertyManager.insertOffsetMap(argPtr, pointerManager.getPointerFromValue(operandValue, callerContext));
         }
         // normal type: int, int *(int ...), struct(load instruction) 
         else {
@@ -721,41 +1724,137 @@ static RegisterPass<FuncPtrPass> X("funcptrpass", "Print function call instructi
 char Liveness::ID = 0;
 static RegisterPass<Liveness> Y("liveness", "Liveness Dataflow Analysis");
 
-static cl::opt<std::string>
-InputFilename(cl::Positional,
-              cl::desc("<filename>.bc"),
-              cl::init(""));
+static cl::list<std::string>
+InputFilenames(cl::Positional,
+               cl::desc("<filename>.bc..."),
+               cl::OneOrMore);
 
+// several inputs are linked by their summaries, and solved with coarser inclusion constraints
+static cl::opt<unsigned>
+ModuleThreads("module-threads",
+              cl::desc("Number of threads of a whole program of several inputs (0 = one per core); "
+                       "its lines come from field-insensitive inclusion constraints, coarser than one module"),
+              cl::init(0));
 
-int main(int argc, char **argv) {
-   LLVMContext &Context = getGlobalContext();
-   SMDiagnostic Err;
-   // Parse the command line to read the Inputfilename
-   cl::ParseCommandLineOptions(argc, argv,
-                              "FuncPtrPass \n My first LLVM too which does not do much.\n");
+// several inputs are analyzed one by one
+static cl::opt<bool>
+Batch("batch",
+      cl::desc("Analyze every input, or every .bc file of an input directory, as a module of its own"),
+      cl::init(false));
 
+static cl::opt<unsigned>
+BatchThreads("batch-threads",
+             cl::desc("Number of threads of a batch (0 = one per core)"),
+             cl::init(0));
+
+
+// analyze one module, the lines go to os
+static bool analyzeFile(const std::string &InputFilename, LLVMContext &Context, raw_ostream &os) {
+   SMDiagnostic Err;
 
    // Load the input module
-   std::unique_ptr<Module> M = parseIRFile(InputFilename, Err, Context);
+   std::unique_ptr<Module> M;
+   if (LazyLoad)
+      M = getLazyIRFileModule(InputFilename, Err, Context);
+   else
+      M = parseIRFile(InputFilename, Err, Context);
    if (!M) {
-      Err.print(argv[0], errs());
-      return 1;
+      Err.print("FuncPtrPass", os);
+      return false;
+   }
+
+   // load the reached bodies, and transform only them to SSA
+   if (LazyLoad) {
+      LazyLoader loader;
+      if (!loader.materializeReachable(*M, LazyEntries))
+         return false;
+
+      llvm::legacy::FunctionPassManager FPasses(M.get());
+#if LLVM_VERSION_MAJOR == 5
+      FPasses.add(new EnableFunctionOptPass());
+#endif
+      FPasses.add(llvm::createPromoteMemoryToRegisterPass());
+      FPasses.doInitialization();
+      for (Function *F : loader.getFunctions())
+         FPasses.run(*F);
+      FPasses.doFinalization();
    }
 
    llvm::legacy::PassManager Passes;
+   if (!LazyLoad) {
 #if LLVM_VERSION_MAJOR == 5
-   Passes.add(new EnableFunctionOptPass());
+      Passes.add(new EnableFunctionOptPass());
 #endif
-   ///Transform it to SSA
-   Passes.add(llvm::createPromoteMemoryToRegisterPass());
+      ///Transform it to SSA
+      Passes.add(llvm::createPromoteMemoryToRegisterPass());
+   }
 
    /// Your pass to print Function and Call Instructions
    //Passes.add(new Liveness());
-   Passes.add(new FuncPtrPass());
+   Passes.add(new FuncPtrPass(os));
    Passes.run(*M.get());
+
+   // rewrite the bitcode file with the promoted calls,
+   // a lazy module reads its bodies from the file, load them all before it is overwritten
+   if (PromoteCalls) {
+      if (LazyLoad && !LazyLoader::materializeAll(*M))
+         return false;
+
+      std::error_code EC;
+      std::unique_ptr<tool_output_file> Out(new tool_output_file(InputFilename, EC, sys::fs::F_None));
+      if (EC) {
+         os << EC.message() << '\n';
+         return false;
+      }
+      llvm::legacy::PassManager WritePasses;
+      WritePasses.add(createBitcodeWriterPass(Out->os()));
+      WritePasses.run(*M.get());
+
+      // keep the file
+      Out->keep();
+   }
+   return true;
+}
+
+int main(int argc, char **argv) {
+   LLVMContext &Context = getGlobalContext();
+   // Parse the command line to read the Inputfilename
+   cl::ParseCommandLineOptions(argc, argv,
+                              "FuncPtrPass \n My first LLVM too which does not do much.\n");
+
+   // every module on its own, on a few threads
+   if (Batch) {
+      if (CacheFile != "" || CallGraphFile != "") {
+         errs() << "the cache and the call graph can't be used in a batch\n";
+         return 1;
+      }
+      BatchDriver driver;
+      return driver.run(InputFilenames, BatchThreads, analyzeFile) ? 0 : 1;
+   }
+
+   // the inclusion solver only prints the lines
+   if (Solver == SolverInclusion &&
+       (PromoteCalls || CacheFile != "" || CallGraphFile != "" || ContextDepth != 0 ||
+        ContextStats || DemandDriven || Signatures != SigOff)) {
+      errs() << "the inclusion solver only prints the lines\n";
+      return 1;
+   }
+
+   // a whole program, only the call lines are printed
+   if (InputFilenames.size() > 1) {
+      if (PromoteCalls || CacheFile != "" || CallGraphFile != "" || LazyLoad ||
+          ContextDepth != 0 || ContextStats || DemandDriven || Signatures != SigOff) {
+         errs() << "the options of one module can't be used with several inputs\n";
+         return 1;
+      }
+      return WholeProgram::run(InputFilenames, ModuleThreads, false, errs()) ? 0 : 1;
+   }
+
+   if (!analyzeFile(InputFilenames.front(), Context, errs()))
+      return 1;
    /*
 #ifndef NDEBUG
    system("pause");
 #endif
 */
-}
\ No newline at end of file
+}
@@ -0,0 +1,123 @@
+/************************************************************************
+ *
+ * @file BatchDriver.h
+ *
+ * Analysis of many independent modules in one process
+ *
+ ***********************************************************************/
+
+#ifndef _BATCHDRIVER_H_
+#define _BATCHDRIVER_H_
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+
+using namespace llvm;
+
+/// Analyzes one module read from path in context, writes its results to os
+typedef std::function<bool (const std::string &path, LLVMContext &context, raw_ostream &os)> BatchJob;
+
+///
+/// Each input is a bitcode file or a directory, whose .bc files are taken in name
+/// order. Every worker thread owns an LLVMContext and takes the next file; nothing
+/// of a module is shared with the others. The results of a file are kept in memory
+/// until the files before it are done, then written after a "path:" line, so the
+/// output is in input order whatever the number of threads.
+///
+class BatchDriver {
+    std::vector<std::string> paths;
+    std::vector<std::string> results;
+    std::vector<bool> doneList;
+    size_t written;             // files before written are printed
+    std::mutex outputMutex;
+    bool isSucceeded;
+
+    bool collect(const std::string &input) {
+        if (!sys::fs::is_directory(input)) {
+            this->paths.push_back(input);
+            return true;
+        }
+
+        std::vector<std::string> files;
+        std::error_code EC;
+        for (sys::fs::directory_iterator it(input, EC), end; it != end && !EC; it.increment(EC)) {
+            if (sys::path::extension(it->path()) == ".bc")
+                files.push_back(it->path());
+        }
+        if (EC) {
+            errs() << input << ": " << EC.message() << "\n";
+            return false;
+        }
+        std::sort(files.begin(), files.end());
+        this->paths.insert(this->paths.end(), files.begin(), files.end());
+        return true;
+    }
+
+    // keep the results of file i, print every file that is no longer waiting for one before it
+    void finish(size_t i, std::string &result, bool succeeded) {
+        std::lock_guard<std::mutex> lock(this->outputMutex);
+        this->results[i].swap(result);
+        this->doneList[i] = true;
+        this->isSucceeded = this->isSucceeded && succeeded;
+
+        while (this->written < this->paths.size() && this->doneList[this->written]) {
+            errs() << this->paths[this->written] << ":\n" << this->results[this->written];
+            std::string().swap(this->results[this->written]);
+            ++this->written;
+        }
+    }
+    void work(std::atomic<size_t> &next, const BatchJob &job) {
+        LLVMContext context;
+        for (size_t i = next++; i < this->paths.size(); i = next++) {
+            std::string result;
+            raw_string_ostream os(result);
+            bool succeeded = job(this->paths[i], context, os);
+            os.flush();
+            this->finish(i, result, succeeded);
+        }
+    }
+public:
+    BatchDriver() {
+        this->written = 0;
+        this->isSucceeded = true;
+    }
+
+    bool run(const std::vector<std::string> &inputs, unsigned threadNum, const BatchJob &job) {
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            if (!this->collect(inputs[i]))
+                return false;
+        }
+        if (this->paths.empty())
+            return true;
+        this->results.resize(this->paths.size());
+        this->doneList.resize(this->paths.size(), false);
+
+        if (threadNum == 0)
+            threadNum = std::max(1u, std::thread::hardware_concurrency());
+        threadNum = std::min<size_t>(threadNum, this->paths.size());
+
+        std::atomic<size_t> next(0);
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < threadNum; ++t) {
+            threads.push_back(std::thread([&]() {
+                this->work(next, job);
+            }));
+        }
+        for (size_t t = 0; t < threads.size(); ++t) {
+            threads[t].join();
+        }
+        return this->isSucceeded;
+    }
+};
+
+#endif /* !_BATCHDRIVER_H_ */
@@ -0,0 +1,245 @@
+/************************************************************************
+ *
+ * @file CallGraphWriter.h
+ *
+ * Export of the resolved call graph as binary, DOT or JSON
+ *
+ ***********************************************************************/
+
+#ifndef _CALLGRAPHWRITER_H_
+#define _CALLGRAPHWRITER_H_
+
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/DebugInfoMetadata.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/GraphWriter.h>
+#include <llvm/Support/raw_ostream.h>
+
+using namespace llvm;
+
+enum CallGraphFormat { CGBinary, CGDot, CGJSON };
+
+///
+/// One edge per (call site, callee), kept in a flat vector sorted by
+/// file, line, column, caller and callee. Files and functions are numbered
+/// in name order, so the same graph is written the same way every time.
+///
+/// The binary file is little-endian:
+///
+///   header     "FPCG" version:u32 fileCount:u32 functionCount:u32 edgeCount:u32 stringSize:u32
+///   files      nameOffset:u32
+///   functions  nameOffset:u32
+///   edges      file:u32 line:u32 column:u32 caller:u32 callee:u32
+///   strings    null-terminated names
+///
+class CallGraphWriter {
+    static const uint32_t VERSION = 1;
+
+    struct CallEdge {
+        uint32_t file;
+        uint32_t line;
+        uint32_t column;
+        uint32_t caller;
+        uint32_t callee;
+
+        bool operator < (const CallEdge &e) const {
+            if (file != e.file) return file < e.file;
+            if (line != e.line) return line < e.line;
+            if (column != e.column) return column < e.column;
+            if (caller != e.caller) return caller < e.caller;
+            return callee < e.callee;
+        }
+        bool operator == (const CallEdge &e) const {
+            return file == e.file && line == e.line && column == e.column &&
+                   caller == e.caller && callee == e.callee;
+        }
+    };
+
+    // names, numbered in insertion order until finish
+    std::vector<std::string> files;
+    std::map<std::string, uint32_t> fileIds;
+    std::vector<std::string> functions;
+    std::map<std::string, uint32_t> functionIds;
+    std::vector<CallEdge> edges;
+    bool isFinished;
+
+    static uint32_t getId(std::vector<std::string> &names, std::map<std::string, uint32_t> &ids, StringRef name) {
+        std::map<std::string, uint32_t>::iterator it = ids.find(name.str());
+        if (it != ids.end())
+            return it->second;
+
+        uint32_t id = names.size();
+        names.push_back(name.str());
+        ids.insert(std::make_pair(name.str(), id));
+        return id;
+    }
+    // renumber names in name order, old id -> new id
+    static std::vector<uint32_t> sortNames(std::vector<std::string> &names, std::map<std::string, uint32_t> &ids) {
+        std::vector<uint32_t> newIds(names.size());
+        std::sort(names.begin(), names.end());
+        for (uint32_t i = 0; i < names.size(); ++i) {
+            newIds[ids[names[i]]] = i;
+            ids[names[i]] = i;
+        }
+        return newIds;
+    }
+
+    static void write32(raw_ostream &os, uint32_t v) {
+        char b[4] = { (char)v, (char)(v >> 8), (char)(v >> 16), (char)(v >> 24) };
+        os.write(b, 4);
+    }
+    static void writeJSONString(raw_ostream &os, StringRef s) {
+        os << '"';
+        for (size_t i = 0; i < s.size(); ++i) {
+            unsigned char c = s[i];
+            if (c == '"' || c == '\\')
+                os << '\\' << c;
+            else if (c < 0x20)
+                os << format("\\u%04x", c);
+            else
+                os << c;
+        }
+        os << '"';
+    }
+
+    void writeBinary(raw_ostream &os) {
+        std::string strTable;
+        std::vector<uint32_t> fileOffsets, functionOffsets;
+        for (size_t i = 0; i < files.size(); ++i) {
+            fileOffsets.push_back(strTable.size());
+            strTable += files[i];
+            strTable += '\0';
+        }
+        for (size_t i = 0; i < functions.size(); ++i) {
+            functionOffsets.push_back(strTable.size());
+            strTable += functions[i];
+            strTable += '\0';
+        }
+
+        os.write("FPCG", 4);
+        write32(os, VERSION);
+        write32(os, files.size());
+        write32(os, functions.size());
+        write32(os, edges.size());
+        write32(os, strTable.size());
+        for (size_t i = 0; i < fileOffsets.size(); ++i)
+            write32(os, fileOffsets[i]);
+        for (size_t i = 0; i < functionOffsets.size(); ++i)
+            write32(os, functionOffsets[i]);
+        for (size_t i = 0; i < edges.size(); ++i) {
+            write32(os, edges[i].file);
+            write32(os, edges[i].line);
+            write32(os, edges[i].column);
+            write32(os, edges[i].caller);
+            write32(os, edges[i].callee);
+        }
+        os << strTable;
+    }
+    void writeDot(raw_ostream &os) {
+        os << "digraph callgraph {\n";
+        for (size_t i = 0; i < functions.size(); ++i) {
+            os << "  f" << i << " [label=\"" << DOT::EscapeString(functions[i]) << "\"];\n";
+        }
+        for (size_t i = 0; i < edges.size(); ++i) {
+            os << "  f" << edges[i].caller << " -> f" << edges[i].callee
+               << " [label=\"" << DOT::EscapeString(files[edges[i].file]) << ":"
+               << edges[i].line << ":" << edges[i].column << "\"];\n";
+        }
+        os << "}\n";
+    }
+    // edges are [file, line, column, caller, callee]
+    void writeJSON(raw_ostream &os) {
+        os << "{\"files\":[";
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (i != 0) os << ',';
+            writeJSONString(os, files[i]);
+        }
+        os << "],\n\"functions\":[";
+        for (size_t i = 0; i < functions.size(); ++i) {
+            if (i != 0) os << ',';
+            writeJSONString(os, functions[i]);
+        }
+        os << "],\n\"edges\":[";
+        for (size_t i = 0; i < edges.size(); ++i) {
+            if (i != 0) os << ",\n";
+            os << '[' << edges[i].file << ',' << edges[i].line << ',' << edges[i].column
+               << ',' << edges[i].caller << ',' << edges[i].callee << ']';
+        }
+        os << "]}\n";
+    }
+public:
+    CallGraphWriter() {
+        this->isFinished = false;
+    }
+
+    /// Add an edge from the function of call to each callee
+    void insertCall(CallInst *call, const std::vector<std::string> &callees) {
+        StringRef file;
+        uint32_t line = 0, column = 0;
+        if (DILocation *loc = call->getDebugLoc()) {
+            file = loc->getFilename();
+            line = loc->getLine();
+            column = loc->getColumn();
+        }
+
+        CallEdge edge;
+        edge.file = getId(files, fileIds, file);
+        edge.line = line;
+        edge.column = column;
+        edge.caller = getId(functions, functionIds, call->getFunction()->getName());
+        for (size_t i = 0; i < callees.size(); ++i) {
+            // null
+            if (callees[i] == "")
+                continue;
+            edge.callee = getId(functions, functionIds, callees[i]);
+            edges.push_back(edge);
+        }
+    }
+
+    /// Number the names in name order and sort the edges
+    void finish() {
+        if (this->isFinished)
+            return;
+        this->isFinished = true;
+
+        std::vector<uint32_t> newFiles = sortNames(files, fileIds);
+        std::vector<uint32_t> newFunctions = sortNames(functions, functionIds);
+        for (size_t i = 0; i < edges.size(); ++i) {
+            edges[i].file = newFiles[edges[i].file];
+            edges[i].caller = newFunctions[edges[i].caller];
+            edges[i].callee = newFunctions[edges[i].callee];
+        }
+        std::sort(edges.begin(), edges.end());
+        edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+    }
+
+    bool write(StringRef path, CallGraphFormat graphFormat) {
+        this->finish();
+
+        std::error_code EC;
+        raw_fd_ostream os(path, EC, sys::fs::F_None);
+        if (EC) {
+            errs() << path << ": " << EC.message() << "\n";
+            return false;
+        }
+        os.SetBufferSize(1 << 20);
+
+        if (graphFormat == CGBinary)
+            this->writeBinary(os);
+        else if (graphFormat == CGDot)
+            this->writeDot(os);
+        else
+            this->writeJSON(os);
+
+        return !os.has_error();
+    }
+};
+
+#endif /* !_CALLGRAPHWRITER_H_ */
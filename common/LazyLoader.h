@@ -0,0 +1,132 @@
+/************************************************************************
+ *
+ * @file LazyLoader.h
+ *
+ * On-demand materialization of the function bodies of a lazy module
+ *
+ ***********************************************************************/
+
+#ifndef _LAZYLOADER_H_
+#define _LAZYLOADER_H_
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/raw_ostream.h>
+
+using namespace llvm;
+
+///
+/// A module read with getLazyIRFileModule has its globals, but no function bodies.
+/// Starting from the entry functions, a body is loaded only when a loaded body or
+/// a referenced global initializer refers to the function, as a callee or as an
+/// address. Every function whose address can reach a call is loaded that way,
+/// the bodies of the others are never read.
+///
+class LazyLoader {
+    std::set<Function *> reachedSet;
+    std::vector<Function *> reachedFunctions;   // in reach order
+    std::set<Constant *> visitedSet;            // constants already scanned
+    std::vector<Function *> worklist;
+
+    void insertFunction(Function *F) {
+        if (F->isDeclaration() || !this->reachedSet.insert(F).second)
+            return;
+        this->worklist.push_back(F);
+    }
+    // functions in a constant, through constant expressions, aggregates and initializers
+    void insertConstant(Constant *c) {
+        if (!this->visitedSet.insert(c).second)
+            return;
+
+        if (Function *F = dyn_cast<Function>(c)) {
+            this->insertFunction(F);
+        }
+        else if (GlobalVariable *gv = dyn_cast<GlobalVariable>(c)) {
+            if (gv->hasInitializer())
+                this->insertConstant(gv->getInitializer());
+        }
+        else if (GlobalAlias *ga = dyn_cast<GlobalAlias>(c)) {
+            this->insertConstant(ga->getAliasee());
+        }
+        else if (!isa<GlobalValue>(c)) {
+            for (Use &op : c->operands()) {
+                if (Constant *opc = dyn_cast<Constant>(op.get()))
+                    this->insertConstant(opc);
+            }
+        }
+    }
+    bool materialize(Function *F) {
+        if (Error err = F->materialize()) {
+            logAllUnhandledErrors(std::move(err), errs(), F->getName() + ": ");
+            return false;
+        }
+        if (F->hasPersonalityFn())
+            this->insertConstant(F->getPersonalityFn());
+
+        for (BasicBlock &B : *F) {
+            for (Instruction &I : B) {
+                for (Use &op : I.operands()) {
+                    if (Constant *c = dyn_cast<Constant>(op.get()))
+                        this->insertConstant(c);
+                }
+            }
+        }
+        return true;
+    }
+public:
+    /// Load the bodies reachable from the named entries. With no entries, main is the
+    /// entry, and without main every function visible outside the module is.
+    bool materializeReachable(Module &M, const std::vector<std::string> &entries) {
+        for (size_t i = 0; i < entries.size(); ++i) {
+            Function *F = M.getFunction(entries[i]);
+            if (F == NULL) {
+                errs() << "no entry function " << entries[i] << "\n";
+                return false;
+            }
+            this->insertFunction(F);
+        }
+        if (entries.empty()) {
+            if (Function *F = M.getFunction("main")) {
+                this->insertFunction(F);
+            }
+            else {
+                for (Function &F : M) {
+                    if (!F.hasLocalLinkage())
+                        this->insertFunction(&F);
+                }
+            }
+        }
+
+        while (!this->worklist.empty()) {
+            Function *F = this->worklist.back();
+            this->worklist.pop_back();
+            if (!this->materialize(F))
+                return false;
+            this->reachedFunctions.push_back(F);
+        }
+        return true;
+    }
+
+    /// Load the remaining bodies, before the module is written back
+    static bool materializeAll(Module &M) {
+        if (Error err = M.materializeAll()) {
+            logAllUnhandledErrors(std::move(err), errs(), M.getModuleIdentifier() + ": ");
+            return false;
+        }
+        return true;
+    }
+
+    const std::vector<Function *>& getFunctions() {
+        return this->reachedFunctions;
+    }
+};
+
+#endif /* !_LAZYLOADER_H_ */
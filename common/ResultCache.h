@@ -0,0 +1,441 @@
+/************************************************************************
+ *
+ * @file ResultCache.h
+ *
+ * On-disk cache of the call resolution results, keyed by function hash
+ *
+ ***********************************************************************/
+
+#ifndef _RESULTCACHE_H_
+#define _RESULTCACHE_H_
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <memory>
+
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/DebugInfoMetadata.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/raw_ostream.h>
+
+using namespace llvm;
+
+/// line -> names of the called functions
+typedef std::map<int, std::vector<std::string> > LineNames;
+
+///
+/// The cache file is little-endian and read in place from a memory mapped buffer:
+///
+///   header     "FPRC" version:u32 moduleHash:u64 functionCount:u32 recordCount:u32 stringSize:u32 0:u32
+///   functions  hash:u64 nameOffset:u32 firstRecord:u32 recordCount:u32 0:u32, sorted by name
+///   records    line:u32 calleeOffset:u32, NO_NAME when a line has no callee
+///   strings    null-terminated names, each stored once
+///
+/// A function is dirty when its hash changed, or it is connected to a changed function
+/// by a call, a shared global, or an indirect call to an address-taken function.
+/// Library declarations and constants without pointers connect nothing.
+/// Only dirty functions are analyzed again, the lines of the others come from the cache.
+///
+class ResultCache {
+    static const uint32_t VERSION = 1;
+    static const uint32_t NO_NAME = 0xffffffff;
+    static const size_t HEADER_SIZE = 32;
+    static const size_t FUNCTION_SIZE = 24;
+    static const size_t RECORD_SIZE = 8;
+
+    // the module now
+    std::map<std::string, uint64_t> hashMap;    // function name -> hash
+    uint64_t moduleHash;
+    std::set<Function *> dirtySet;
+    bool isEnabled;
+
+    // the loaded cache file
+    std::unique_ptr<MemoryBuffer> buffer;
+    uint64_t cachedModuleHash;
+    uint32_t functionCount;
+    uint32_t recordCount;
+    const char *functions;
+    const char *records;
+    const char *strings;
+    uint32_t stringSize;
+
+    static uint32_t read32(const char *p) {
+        const unsigned char *u = (const unsigned char *)p;
+        return (uint32_t)u[0] | ((uint32_t)u[1] << 8) | ((uint32_t)u[2] << 16) | ((uint32_t)u[3] << 24);
+    }
+    static uint64_t read64(const char *p) {
+        return (uint64_t)read32(p) | ((uint64_t)read32(p + 4) << 32);
+    }
+    static void write32(raw_ostream &os, uint32_t v) {
+        char b[4] = { (char)v, (char)(v >> 8), (char)(v >> 16), (char)(v >> 24) };
+        os.write(b, 4);
+    }
+    static void write64(raw_ostream &os, uint64_t v) {
+        write32(os, (uint32_t)v);
+        write32(os, (uint32_t)(v >> 32));
+    }
+
+    StringRef getString(uint32_t offset) {
+        if (offset >= this->stringSize)
+            return StringRef();
+        return StringRef(this->strings + offset);
+    }
+    // binary search of the function table
+    bool findFunction(StringRef name, uint64_t &hash, uint32_t &first, uint32_t &count) {
+        uint32_t low = 0, high = this->functionCount;
+        while (low < high) {
+            uint32_t mid = low + (high - low) / 2;
+            const char *entry = this->functions + mid * FUNCTION_SIZE;
+            int cmp = this->getString(read32(entry + 8)).compare(name);
+            if (cmp == 0) {
+                hash = read64(entry);
+                first = read32(entry + 12);
+                count = read32(entry + 16);
+                return true;
+            }
+            if (cmp < 0)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        return false;
+    }
+    void readLines(uint32_t first, uint32_t count, LineNames &lines) {
+        for (uint32_t i = first; i < first + count && i < this->recordCount; ++i) {
+            const char *record = this->records + i * RECORD_SIZE;
+            int line = (int)read32(record);
+            uint32_t callee = read32(record + 4);
+
+            std::vector<std::string> &names = lines[line];
+            if (callee != NO_NAME)
+                names.push_back(this->getString(callee).str());
+        }
+    }
+
+    static uint64_t hashFunction(Function &F, StringRef config) {
+        std::string text;
+        raw_string_ostream os(text);
+        os << config;
+        F.print(os);
+        // the lines are only referred to by metadata in the printed IR
+        for (BasicBlock &B : F) {
+            for (Instruction &I : B) {
+                if (DILocation *loc = I.getDebugLoc())
+                    os << loc->getLine() << ":" << loc->getColumn() << ";";
+            }
+        }
+        os.flush();
+
+        MD5 md5;
+        md5.update(text);
+        MD5::MD5Result result;
+        md5.final(result);
+        return result.low();
+    }
+
+    // union-find over functions and globals
+    Value* findRoot(std::map<Value *, Value *> &parent, Value *v) {
+        if (parent.find(v) == parent.end())
+            parent[v] = v;
+        while (parent[v] != v) {
+            parent[v] = parent[parent[v]];
+            v = parent[v];
+        }
+        return v;
+    }
+    static bool holdsPointer(Type *ty) {
+        if (ty->isPointerTy())
+            return true;
+        if (!ty->isStructTy() && !ty->isArrayTy() && !ty->isVectorTy())
+            return false;
+        for (unsigned i = 0; i < ty->getNumContainedTypes(); ++i) {
+            if (holdsPointer(ty->getContainedType(i)))
+                return true;
+        }
+        return false;
+    }
+    // a defined function, or a global whose pointers can change or reach functions;
+    // a string or other constant without pointers connects nothing
+    static bool isSharedState(Value *v) {
+        if (Function *F = dyn_cast<Function>(v))
+            return !F->isDeclaration();
+        if (GlobalVariable *G = dyn_cast<GlobalVariable>(v))
+            return !G->isConstant() || holdsPointer(G->getValueType());
+        return false;
+    }
+    void unite(std::map<Value *, Value *> &parent, Value *a, Value *b) {
+        Value *ra = this->findRoot(parent, a);
+        Value *rb = this->findRoot(parent, b);
+        if (ra != rb)
+            parent[ra] = rb;
+    }
+public:
+    ResultCache() {
+        this->moduleHash = 0;
+        this->isEnabled = false;
+        this->cachedModuleHash = 0;
+        this->functionCount = 0;
+        this->recordCount = 0;
+        this->functions = NULL;
+        this->records = NULL;
+        this->strings = NULL;
+        this->stringSize = 0;
+    }
+
+    /// Hash every function of M, config keeps results of different options apart
+    void hashModule(Module &M, StringRef config) {
+        this->isEnabled = true;
+        this->hashMap.clear();
+
+        MD5 md5;
+        md5.update(config);
+        for (Function &F : M) {
+            uint64_t hash = hashFunction(F, config);
+            if (F.hasName())
+                this->hashMap[F.getName().str()] = hash;
+            md5.update(F.getName());
+            md5.update(StringRef((const char *)&hash, sizeof(hash)));
+        }
+        for (GlobalVariable &G : M.globals()) {
+            std::string text;
+            raw_string_ostream os(text);
+            G.print(os);
+            md5.update(os.str());
+        }
+        MD5::MD5Result result;
+        md5.final(result);
+        this->moduleHash = result.low();
+    }
+
+    /// Map the cache file, false if it is missing or not valid
+    bool load(StringRef path) {
+        ErrorOr<std::unique_ptr<MemoryBuffer>> file = MemoryBuffer::getFile(path, -1, false);
+        if (!file)
+            return false;
+
+        std::unique_ptr<MemoryBuffer> buf = std::move(file.get());
+        const char *start = buf->getBufferStart();
+        size_t size = buf->getBufferSize();
+        if (size < HEADER_SIZE || StringRef(start, 4) != "FPRC" || read32(start + 4) != VERSION)
+            return false;
+
+        uint32_t funcs = read32(start + 16);
+        uint32_t recs = read32(start + 20);
+        uint32_t strSize = read32(start + 24);
+        if (size != HEADER_SIZE + (uint64_t)funcs * FUNCTION_SIZE + (uint64_t)recs * RECORD_SIZE + strSize)
+            return false;
+        if (strSize != 0 && start[size - 1] != '\0')
+            return false;
+
+        this->cachedModuleHash = read64(start + 8);
+        this->functionCount = funcs;
+        this->recordCount = recs;
+        this->stringSize = strSize;
+        this->functions = start + HEADER_SIZE;
+        this->records = this->functions + funcs * FUNCTION_SIZE;
+        this->strings = this->records + recs * RECORD_SIZE;
+        this->buffer = std::move(buf);
+        return true;
+    }
+
+    /// Find the functions that must be analyzed again, call after hashModule and load
+    void computeDirtyFunctions(Module &M) {
+        this->dirtySet.clear();
+        if (this->buffer && this->cachedModuleHash == this->moduleHash)
+            return;
+
+        std::map<Value *, Value *> parent;
+        Value *indirectGroup = NULL;
+        for (Function &F : M) {
+            this->findRoot(parent, &F);
+            // a library function has no lines and no state of its own
+            if (F.isDeclaration())
+                continue;
+            if (F.hasAddressTaken()) {
+                if (indirectGroup != NULL)
+                    this->unite(parent, &F, indirectGroup);
+                indirectGroup = &F;
+            }
+            for (BasicBlock &B : F) {
+                for (Instruction &I : B) {
+                    if (CallInst *callInst = dyn_cast<CallInst>(&I)) {
+                        if (!isa<Function>(callInst->getCalledValue()->stripPointerCasts())) {
+                            if (indirectGroup != NULL)
+                                this->unite(parent, &F, indirectGroup);
+                            indirectGroup = &F;
+                        }
+                    }
+                    for (Use &U : I.operands()) {
+                        Value *op = U.get()->stripPointerCasts();
+                        if (isSharedState(op))
+                            this->unite(parent, &F, op);
+                    }
+                }
+            }
+        }
+
+        // groups with a changed function
+        std::set<Value *> dirtyRoots;
+        for (Function &F : M) {
+            if (F.isDeclaration())
+                continue;
+            uint64_t hash;
+            uint32_t first, count;
+            bool isCached = this->buffer && F.hasName() &&
+                            this->findFunction(F.getName(), hash, first, count) &&
+                            hash == this->hashMap[F.getName().str()];
+            if (!isCached)
+                dirtyRoots.insert(this->findRoot(parent, &F));
+        }
+        for (Function &F : M) {
+            if (dirtyRoots.find(this->findRoot(parent, &F)) != dirtyRoots.end())
+                this->dirtySet.insert(&F);
+        }
+    }
+
+    /// True if F has to be analyzed, always true without a cache
+    bool isDirty(Function *F) {
+        if (!this->isEnabled)
+            return true;
+        return this->dirtySet.find(F) != this->dirtySet.end();
+    }
+
+    /// Print how many defined functions are analyzed again
+    void outputStats(raw_ostream &os, Module &M) {
+        unsigned defined = 0, dirty = 0;
+        for (Function &F : M) {
+            if (F.isDeclaration())
+                continue;
+            ++defined;
+            if (this->isDirty(&F))
+                ++dirty;
+        }
+        os << "cache = " << dirty << " of " << defined << " functions analyzed\n";
+    }
+
+    /// Add the cached lines of the clean functions, lines already in lines are kept
+    void insertCachedLines(Module &M, LineNames &lines) {
+        if (!this->buffer)
+            return;
+
+        for (Function &F : M) {
+            uint64_t hash;
+            uint32_t first, count;
+            if (this->isDirty(&F) || !F.hasName() || !this->findFunction(F.getName(), hash, first, count))
+                continue;
+
+            LineNames cached;
+            this->readLines(first, count, cached);
+            lines.insert(cached.begin(), cached.end());
+        }
+    }
+
+    /// The cached lines of a clean function F, false if there are none
+    bool getCachedLines(Function *F, LineNames &lines) {
+        uint64_t hash;
+        uint32_t first, count;
+        if (!this->buffer || this->isDirty(F) || !F->hasName() || !this->findFunction(F->getName(), hash, first, count))
+            return false;
+
+        this->readLines(first, count, lines);
+        return true;
+    }
+
+    /// Write the lines of every function of M, dirty ones from funcLines, clean ones from the cache
+    bool write(StringRef path, Module &M, std::map<Function *, LineNames> &funcLines) {
+        // function name -> lines, sorted by name
+        std::map<std::string, std::pair<uint64_t, LineNames> > table;
+        for (Function &F : M) {
+            if (!F.hasName() || F.isDeclaration())
+                continue;
+
+            std::pair<uint64_t, LineNames> &entry = table[F.getName().str()];
+            entry.first = this->hashMap[F.getName().str()];
+
+            uint64_t hash;
+            uint32_t first, count;
+            if (this->isDirty(&F))
+                entry.second = funcLines[&F];
+            else if (this->buffer && this->findFunction(F.getName(), hash, first, count))
+                this->readLines(first, count, entry.second);
+        }
+
+        // string table
+        std::string strTable;
+        std::map<std::string, uint32_t> strOffsets;
+        std::vector<uint32_t> nameOffsets;
+        std::vector<std::pair<uint32_t, uint32_t> > recs;
+        std::vector<std::pair<uint32_t, uint32_t> > ranges;   // first record, record count
+
+        std::map<std::string, std::pair<uint64_t, LineNames> >::iterator it;
+        for (it = table.begin(); it != table.end(); ++it) {
+            std::vector<std::string> names(1, it->first);
+            LineNames::iterator l;
+            for (l = it->second.second.begin(); l != it->second.second.end(); ++l) {
+                names.insert(names.end(), l->second.begin(), l->second.end());
+            }
+            for (size_t i = 0; i < names.size(); ++i) {
+                if (strOffsets.find(names[i]) == strOffsets.end()) {
+                    strOffsets[names[i]] = strTable.size();
+                    strTable += names[i];
+                    strTable += '\0';
+                }
+            }
+
+            nameOffsets.push_back(strOffsets[it->first]);
+            uint32_t first = recs.size();
+            for (l = it->second.second.begin(); l != it->second.second.end(); ++l) {
+                if (l->second.size() == 0)
+                    recs.push_back(std::make_pair((uint32_t)l->first, NO_NAME));
+                for (size_t i = 0; i < l->second.size(); ++i) {
+                    recs.push_back(std::make_pair((uint32_t)l->first, strOffsets[l->second[i]]));
+                }
+            }
+            ranges.push_back(std::make_pair(first, (uint32_t)recs.size() - first));
+        }
+
+        // the file is rewritten, unmap it first
+        this->buffer.reset();
+
+        std::error_code EC;
+        raw_fd_ostream os(path, EC, sys::fs::F_None);
+        if (EC) {
+            errs() << path << ": " << EC.message() << "\n";
+            return false;
+        }
+
+        os.write("FPRC", 4);
+        write32(os, VERSION);
+        write64(os, this->moduleHash);
+        write32(os, table.size());
+        write32(os, recs.size());
+        write32(os, strTable.size());
+        write32(os, 0);
+
+        size_t i = 0;
+        for (it = table.begin(); it != table.end(); ++it, ++i) {
+            write64(os, it->second.first);
+            write32(os, nameOffsets[i]);
+            write32(os, ranges[i].first);
+            write32(os, ranges[i].second);
+            write32(os, 0);
+        }
+        for (i = 0; i < recs.size(); ++i) {
+            write32(os, recs[i].first);
+            write32(os, recs[i].second);
+        }
+        os << strTable;
+
+        return !os.has_error();
+    }
+};
+
+#endif /* !_RESULTCACHE_H_ */
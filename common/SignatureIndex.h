@@ -0,0 +1,141 @@
+/************************************************************************
+ *
+ * @file SignatureIndex.h
+ *
+ * Index of the address-taken functions by function type
+ *
+ ***********************************************************************/
+
+#ifndef _SIGNATUREINDEX_H_
+#define _SIGNATUREINDEX_H_
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/DebugInfoMetadata.h>
+
+#include "ResultCache.h"
+
+using namespace llvm;
+
+enum SignatureMode { SigOff, SigFilter, SigOnly };
+
+///
+/// An indirect call can only reach a function whose address is taken, and whose
+/// type fits the call. A type fits when it is the same, or when every pointer is
+/// matched by a pointer in the same place and the other types are equal; a vararg
+/// function also fits calls with more arguments.
+///
+/// The functions of each exact type are indexed once per module, the ones that only
+/// fit loosely are found once per call type and kept.
+///
+class SignatureIndex {
+    std::map<FunctionType *, std::vector<Function *> > typeMap;
+    std::vector<Function *> addressTaken;
+    std::map<FunctionType *, std::set<Function *> > candidateMap;
+
+    static bool isLooseEqual(Type *a, Type *b) {
+        return a == b || (a->isPointerTy() && b->isPointerTy());
+    }
+public:
+    void init(Module &M) {
+        this->typeMap.clear();
+        this->addressTaken.clear();
+        this->candidateMap.clear();
+        for (Function &F : M) {
+            if (F.hasAddressTaken()) {
+                this->typeMap[F.getFunctionType()].push_back(&F);
+                this->addressTaken.push_back(&F);
+            }
+        }
+    }
+
+    /// The function type of a called value, NULL if it is no function pointer
+    static FunctionType* getCalledType(Value *calledValue) {
+        PointerType *ptrTy = dyn_cast<PointerType>(calledValue->getType());
+        if (ptrTy == NULL)
+            return NULL;
+        return dyn_cast<FunctionType>(ptrTy->getElementType());
+    }
+    static bool isCompatible(FunctionType *callType, Function *F) {
+        FunctionType *funcType = F->getFunctionType();
+        if (callType == NULL || funcType == callType)
+            return true;
+        if (!isLooseEqual(funcType->getReturnType(), callType->getReturnType()))
+            return false;
+
+        unsigned paramNum = funcType->getNumParams();
+        if (callType->getNumParams() < paramNum)
+            return false;
+        if (callType->getNumParams() > paramNum && !funcType->isVarArg())
+            return false;
+        for (unsigned i = 0; i < paramNum; ++i) {
+            if (!isLooseEqual(funcType->getParamType(i), callType->getParamType(i)))
+                return false;
+        }
+        return true;
+    }
+
+    /// The address-taken functions a call of callType can reach
+    const std::set<Function *>& getCandidates(FunctionType *callType) {
+        std::map<FunctionType *, std::set<Function *> >::iterator it = this->candidateMap.find(callType);
+        if (it != this->candidateMap.end())
+            return it->second;
+
+        std::set<Function *> &candidates = this->candidateMap[callType];
+        std::map<FunctionType *, std::vector<Function *> >::iterator exact = this->typeMap.find(callType);
+        if (exact != this->typeMap.end())
+            candidates.insert(exact->second.begin(), exact->second.end());
+        for (size_t i = 0; i < this->addressTaken.size(); ++i) {
+            Function *F = this->addressTaken[i];
+            if (F->getFunctionType() != callType && isCompatible(callType, F))
+                candidates.insert(F);
+        }
+        return candidates;
+    }
+
+    /// The coarse resolution: the called function of a direct call, the candidates of its type otherwise
+    LineNames getLineNames(Module &M) {
+        std::map<int, std::set<std::string> > lineSets;
+        for (Function &F : M) {
+            for (BasicBlock &B : F) {
+                for (Instruction &I : B) {
+                    CallInst *call = dyn_cast<CallInst>(&I);
+                    if (call == NULL || !call->getDebugLoc())
+                        continue;
+
+                    Value *calledValue = call->getCalledValue()->stripPointerCasts();
+                    Function *callee = dyn_cast<Function>(calledValue);
+                    if (callee != NULL && callee->isIntrinsic())
+                        continue;
+
+                    std::set<std::string> &names = lineSets[call->getDebugLoc()->getLine()];
+                    if (callee != NULL) {
+                        names.insert(callee->getName().str());
+                        continue;
+                    }
+                    const std::set<Function *> &candidates = this->getCandidates(call->getFunctionType());
+                    std::set<Function *>::const_iterator it;
+                    for (it = candidates.begin(); it != candidates.end(); ++it) {
+                        names.insert((*it)->getName().str());
+                    }
+                }
+            }
+        }
+
+        LineNames lineNames;
+        std::map<int, std::set<std::string> >::iterator it;
+        for (it = lineSets.begin(); it != lineSets.end(); ++it) {
+            lineNames[it->first] = std::vector<std::string>(it->second.begin(), it->second.end());
+        }
+        return lineNames;
+    }
+};
+
+#endif /* !_SIGNATUREINDEX_H_ */
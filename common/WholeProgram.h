@@ -0,0 +1,770 @@
+/************************************************************************
+ *
+ * @file WholeProgram.h
+ *
+ * Whole-program call resolution over many bitcode files, linked by summaries
+ *
+ ***********************************************************************/
+
+#ifndef _WHOLEPROGRAM_H_
+#define _WHOLEPROGRAM_H_
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <functional>
+
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/GlobalAlias.h>
+#include <llvm/IR/DebugInfoMetadata.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/Bitcode/BitcodeWriterPass.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/PromoteMemToReg.h>
+
+using namespace llvm;
+
+///
+/// The constraints of one module, over nodes numbered in the module.
+/// A node is a value or a memory object, the point-to set of an object is what it holds.
+/// Nodes that are the same in every module, the object, arguments and return of a
+/// function or global visible outside its module, carry a link name.
+///
+struct ModuleSummary {
+    static const uint32_t NO_NODE = 0xffffffff;
+
+    enum ConstraintKind {
+        AddressOf,      // dst = &src
+        Copy,           // dst = src
+        Load,           // dst = *src
+        Store           // *dst = src
+    };
+    struct Constraint {
+        ConstraintKind kind;
+        uint32_t dst;
+        uint32_t src;
+    };
+    // an indirect call, bound to the functions its callee points to
+    struct CallSite {
+        uint32_t callee;
+        std::vector<uint32_t> args;     // NO_NODE for a value that holds no pointer
+        uint32_t ret;
+    };
+    struct FunctionNodes {
+        uint32_t object;
+        std::vector<uint32_t> args;
+        uint32_t ret;
+        std::string name;
+        bool isDefined;
+    };
+    struct LineCall {
+        unsigned line;
+        uint32_t callee;
+    };
+    // a direct call of a function the module only declares
+    struct LibraryCall {
+        uint32_t object;                // of the function
+        uint32_t ret;
+    };
+
+    std::string path;
+    std::string error;              // not empty when the file could not be read
+    uint32_t nodeCount;
+    std::map<uint32_t, std::string> linkNames;
+    std::vector<Constraint> constraints;
+    std::vector<CallSite> calls;
+    std::vector<FunctionNodes> functions;
+    std::vector<LineCall> lines;
+    std::vector<LibraryCall> libraryCalls;
+
+    ModuleSummary() {
+        this->nodeCount = 0;
+    }
+};
+
+///
+/// Walks a module once and writes its constraints. Field-insensitive: a struct, an array
+/// and a pointer to them are one node, casts, GEPs, phis and selects copy.
+///
+class SummaryBuilder {
+    ModuleSummary &summary;
+    std::map<Value *, uint32_t> valueNodes;
+    std::map<GlobalValue *, uint32_t> objectNodes;
+    std::map<Function *, size_t> functionIndex;     // index in summary.functions
+    uint32_t retNode;                               // return of the function being walked
+
+    uint32_t newNode() {
+        return this->summary.nodeCount++;
+    }
+    uint32_t newLinkedNode(GlobalValue *gv, const std::string &prefix) {
+        uint32_t n = this->newNode();
+        if (gv->hasName() && !gv->hasLocalLinkage())
+            this->summary.linkNames[n] = prefix + gv->getName().str();
+        return n;
+    }
+    void insertConstraint(ModuleSummary::ConstraintKind kind, uint32_t dst, uint32_t src) {
+        ModuleSummary::Constraint c;
+        c.kind = kind;
+        c.dst = dst;
+        c.src = src;
+        this->summary.constraints.push_back(c);
+    }
+
+    static bool isTracked(Type *ty) {
+        return ty->isPointerTy() || ty->isStructTy() || ty->isArrayTy() || ty->isVectorTy();
+    }
+
+    uint32_t getObjectNode(GlobalValue *gv) {
+        std::map<GlobalValue *, uint32_t>::iterator it = this->objectNodes.find(gv);
+        if (it != this->objectNodes.end())
+            return it->second;
+
+        uint32_t n = this->newLinkedNode(gv, "o:");
+        this->objectNodes[gv] = n;
+        return n;
+    }
+    size_t getFunctionNodes(Function *F) {
+        std::map<Function *, size_t>::iterator it = this->functionIndex.find(F);
+        if (it != this->functionIndex.end())
+            return it->second;
+
+        ModuleSummary::FunctionNodes fn;
+        fn.object = this->getObjectNode(F);
+        fn.name = F->getName().str();
+        fn.isDefined = !F->isDeclaration();
+        unsigned i = 0;
+        for (Argument &arg : F->args()) {
+            uint32_t n = this->newLinkedNode(F, "a" + std::to_string(i++) + ":");
+            fn.args.push_back(n);
+            this->valueNodes[&arg] = n;
+        }
+        fn.ret = this->newLinkedNode(F, "r:");
+
+        size_t index = this->summary.functions.size();
+        this->summary.functions.push_back(fn);
+        this->functionIndex[F] = index;
+        return index;
+    }
+    uint32_t getNode(Value *v) {
+        std::map<Value *, uint32_t>::iterator it = this->valueNodes.find(v);
+        if (it != this->valueNodes.end())
+            return it->second;
+
+        // the nodes of the arguments come with their function
+        if (Argument *arg = dyn_cast<Argument>(v)) {
+            this->getFunctionNodes(arg->getParent());
+            return this->valueNodes[v];
+        }
+
+        uint32_t n = this->newNode();
+        this->valueNodes[v] = n;
+
+        if (GlobalAlias *ga = dyn_cast<GlobalAlias>(v)) {
+            this->insertConstraint(ModuleSummary::Copy, n, this->getNode(ga->getAliasee()));
+        }
+        else if (GlobalValue *gv = dyn_cast<GlobalValue>(v)) {
+            // a function only declared everywhere is still named at the calls
+            if (Function *F = dyn_cast<Function>(gv))
+                this->getFunctionNodes(F);
+            this->insertConstraint(ModuleSummary::AddressOf, n, this->getObjectNode(gv));
+        }
+        // constant expressions and aggregates hold the pointers in their operands
+        else if (isa<ConstantExpr>(v) || isa<ConstantAggregate>(v)) {
+            Constant *c = cast<Constant>(v);
+            for (Use &op : c->operands()) {
+                if (isTracked(op->getType()))
+                    this->insertConstraint(ModuleSummary::Copy, n, this->getNode(op.get()));
+            }
+        }
+        return n;
+    }
+
+    void insertCopy(Value *dst, Value *src) {
+        if (isTracked(src->getType()))
+            this->insertConstraint(ModuleSummary::Copy, this->getNode(dst), this->getNode(src));
+    }
+    void dealCall(CallInst *call) {
+        Function *F = dyn_cast<Function>(call->getCalledValue()->stripPointerCasts());
+
+        // memcpy and memmove copy what the source holds
+        if (F != NULL && F->isIntrinsic()) {
+            if (MemTransferInst *mt = dyn_cast<MemTransferInst>(call)) {
+                uint32_t tmp = this->newNode();
+                this->insertConstraint(ModuleSummary::Load, tmp, this->getNode(mt->getRawSource()));
+                this->insertConstraint(ModuleSummary::Store, this->getNode(mt->getRawDest()), tmp);
+            }
+            return;
+        }
+
+        if (DILocation *loc = call->getDebugLoc()) {
+            ModuleSummary::LineCall lc;
+            lc.line = loc->getLine();
+            lc.callee = this->getNode(call->getCalledValue());
+            this->summary.lines.push_back(lc);
+        }
+
+        ModuleSummary::CallSite site;
+        for (unsigned i = 0; i < call->getNumArgOperands(); ++i) {
+            Value *arg = call->getArgOperand(i);
+            site.args.push_back(isTracked(arg->getType()) ? this->getNode(arg) : ModuleSummary::NO_NODE);
+        }
+        site.ret = isTracked(call->getType()) ? this->getNode(call) : ModuleSummary::NO_NODE;
+
+        if (F == NULL) {
+            site.callee = this->getNode(call->getCalledValue());
+            this->summary.calls.push_back(site);
+            return;
+        }
+
+        // a direct call binds now
+        ModuleSummary::FunctionNodes fn = this->summary.functions[this->getFunctionNodes(F)];
+        for (size_t i = 0; i < site.args.size() && i < fn.args.size(); ++i) {
+            if (site.args[i] != ModuleSummary::NO_NODE)
+                this->insertConstraint(ModuleSummary::Copy, fn.args[i], site.args[i]);
+        }
+        if (site.ret != ModuleSummary::NO_NODE) {
+            this->insertConstraint(ModuleSummary::Copy, site.ret, fn.ret);
+            // defined in another module, or a library function like malloc, known once linked
+            if (F->isDeclaration()) {
+                ModuleSummary::LibraryCall lc;
+                lc.object = fn.object;
+                lc.ret = site.ret;
+                this->summary.libraryCalls.push_back(lc);
+            }
+        }
+    }
+    void dealInstruction(Instruction &I) {
+        if (isa<AllocaInst>(&I)) {
+            this->insertConstraint(ModuleSummary::AddressOf, this->getNode(&I), this->newNode());
+        }
+        else if (LoadInst *loadInst = dyn_cast<LoadInst>(&I)) {
+            if (isTracked(I.getType()))
+                this->insertConstraint(ModuleSummary::Load, this->getNode(&I), this->getNode(loadInst->getPointerOperand()));
+        }
+        else if (StoreInst *storeInst = dyn_cast<StoreInst>(&I)) {
+            Value *v = storeInst->getValueOperand();
+            if (isTracked(v->getType()))
+                this->insertConstraint(ModuleSummary::Store, this->getNode(storeInst->getPointerOperand()), this->getNode(v));
+        }
+        else if (CallInst *callInst = dyn_cast<CallInst>(&I)) {
+            this->dealCall(callInst);
+        }
+        else if (ReturnInst *retInst = dyn_cast<ReturnInst>(&I)) {
+            Value *v = retInst->getReturnValue();
+            if (v != NULL && isTracked(v->getType()))
+                this->insertConstraint(ModuleSummary::Copy, this->retNode, this->getNode(v));
+        }
+        else if (PHINode *phi = dyn_cast<PHINode>(&I)) {
+            for (Value *v : phi->incoming_values())
+                this->insertCopy(&I, v);
+        }
+        else if (SelectInst *sel = dyn_cast<SelectInst>(&I)) {
+            this->insertCopy(&I, sel->getTrueValue());
+            this->insertCopy(&I, sel->getFalseValue());
+        }
+        else if (isa<CastInst>(&I) || isa<GetElementPtrInst>(&I) || isa<ExtractValueInst>(&I)) {
+            if (isTracked(I.getType()))
+                this->insertCopy(&I, I.getOperand(0));
+        }
+        else if (isa<InsertValueInst>(&I)) {
+            this->insertCopy(&I, I.getOperand(0));
+            this->insertCopy(&I, I.getOperand(1));
+        }
+    }
+public:
+    SummaryBuilder(ModuleSummary &summary) : summary(summary) {
+        this->retNode = ModuleSummary::NO_NODE;
+    }
+
+    /// node of a value the walk met, NO_NODE if there is none
+    uint32_t findNode(Value *v) {
+        std::map<Value *, uint32_t>::iterator it = this->valueNodes.find(v);
+        return it == this->valueNodes.end() ? ModuleSummary::NO_NODE : it->second;
+    }
+    /// node of the object of a global value, NO_NODE if there is none
+    uint32_t findObjectNode(GlobalValue *gv) {
+        std::map<GlobalValue *, uint32_t>::iterator it = this->objectNodes.find(gv);
+        return it == this->objectNodes.end() ? ModuleSummary::NO_NODE : it->second;
+    }
+
+    void build(Module &M) {
+        for (GlobalVariable &G : M.globals()) {
+            if (G.hasInitializer() && isTracked(G.getInitializer()->getType()))
+                this->insertConstraint(ModuleSummary::Copy, this->getObjectNode(&G), this->getNode(G.getInitializer()));
+        }
+        for (Function &F : M) {
+            if (F.isDeclaration())
+                continue;
+            this->retNode = this->summary.functions[this->getFunctionNodes(&F)].ret;
+            for (BasicBlock &B : F) {
+                for (Instruction &I : B) {
+                    this->dealInstruction(I);
+                }
+            }
+        }
+    }
+};
+
+///
+/// Links the module summaries by name and solves all constraints at once,
+/// indirect calls are bound as the functions reach their callees.
+/// The worklist is solved in rounds split across threads, the nodes changed in a round
+/// make the next one. The sets only grow, so the result is the same for any thread count.
+///
+class SummarySolver {
+    static const size_t STRIPE_COUNT = 64;
+    static const size_t ROUND_GRAIN = 256;          // nodes of a round per thread, at least
+
+    std::vector<std::set<uint32_t>> pointToSets;
+    std::vector<std::set<uint32_t>> copyEdges;      // src -> dsts
+    std::vector<std::vector<uint32_t>> loadEdges;   // pointer -> dsts loaded from it
+    std::vector<std::vector<uint32_t>> storeEdges;  // pointer -> srcs stored to it
+    std::vector<std::vector<size_t>> callEdges;     // callee -> call sites
+    std::vector<ModuleSummary::CallSite> calls;
+    std::map<uint32_t, ModuleSummary::FunctionNodes> functionMap;   // object -> nodes
+    std::map<std::string, uint32_t> linkMap;        // link name -> node
+    std::set<uint32_t> definedObjects;              // functions defined in a linked module
+    std::vector<ModuleSummary::LibraryCall> libraryCalls;
+    std::vector<uint32_t> worklist;
+    // node n % STRIPE_COUNT -> the lock of its point-to set and copy edges while solving,
+    // no two are held at once
+    std::mutex stripes[STRIPE_COUNT];
+
+    uint32_t newNode() {
+        uint32_t n = this->pointToSets.size();
+        this->pointToSets.push_back(std::set<uint32_t>());
+        this->copyEdges.push_back(std::set<uint32_t>());
+        this->loadEdges.push_back(std::vector<uint32_t>());
+        this->storeEdges.push_back(std::vector<uint32_t>());
+        this->callEdges.push_back(std::vector<size_t>());
+        return n;
+    }
+    std::mutex &getStripe(uint32_t n) {
+        return this->stripes[n % STRIPE_COUNT];
+    }
+    // the changed nodes go to next
+    void unionInto(uint32_t dst, const std::vector<uint32_t> &objects, std::vector<uint32_t> &next) {
+        bool isChanged = false;
+        {
+            std::lock_guard<std::mutex> lock(this->getStripe(dst));
+            for (size_t i = 0; i < objects.size(); ++i)
+                isChanged |= this->pointToSets[dst].insert(objects[i]).second;
+        }
+        if (isChanged)
+            next.push_back(dst);
+    }
+    void insertCopyEdge(uint32_t dst, uint32_t src, std::vector<uint32_t> &next) {
+        // what src gets after the edge is in goes through it when src is solved again
+        std::vector<uint32_t> objects;
+        {
+            std::lock_guard<std::mutex> lock(this->getStripe(src));
+            if (!this->copyEdges[src].insert(dst).second)
+                return;
+            objects.assign(this->pointToSets[src].begin(), this->pointToSets[src].end());
+        }
+        this->unionInto(dst, objects, next);
+    }
+    void bindCall(size_t callIndex, uint32_t object, std::vector<uint32_t> &next) {
+        std::map<uint32_t, ModuleSummary::FunctionNodes>::iterator it = this->functionMap.find(object);
+        if (it == this->functionMap.end())
+            return;
+
+        ModuleSummary::CallSite &site = this->calls[callIndex];
+        ModuleSummary::FunctionNodes &fn = it->second;
+        for (size_t i = 0; i < site.args.size() && i < fn.args.size(); ++i) {
+            if (site.args[i] != ModuleSummary::NO_NODE)
+                this->insertCopyEdge(fn.args[i], site.args[i], next);
+        }
+        if (site.ret != ModuleSummary::NO_NODE)
+            this->insertCopyEdge(site.ret, fn.ret, next);
+    }
+    void solveNode(uint32_t n, std::vector<uint32_t> &next) {
+        // what n gets while it is solved puts it in the next round
+        std::vector<uint32_t> objects;
+        {
+            std::lock_guard<std::mutex> lock(this->getStripe(n));
+            objects.assign(this->pointToSets[n].begin(), this->pointToSets[n].end());
+        }
+        for (size_t i = 0; i < objects.size(); ++i) {
+            uint32_t o = objects[i];
+            for (size_t j = 0; j < this->loadEdges[n].size(); ++j)
+                this->insertCopyEdge(this->loadEdges[n][j], o, next);
+            for (size_t j = 0; j < this->storeEdges[n].size(); ++j)
+                this->insertCopyEdge(o, this->storeEdges[n][j], next);
+            for (size_t j = 0; j < this->callEdges[n].size(); ++j)
+                this->bindCall(this->callEdges[n][j], o, next);
+        }
+
+        std::vector<uint32_t> dsts;
+        {
+            std::lock_guard<std::mutex> lock(this->getStripe(n));
+            dsts.assign(this->copyEdges[n].begin(), this->copyEdges[n].end());
+        }
+        for (size_t i = 0; i < dsts.size(); ++i)
+            this->unionInto(dsts[i], objects, next);
+    }
+public:
+    /// module node -> solver node, for each linked module
+    std::vector<std::vector<uint32_t>> moduleNodes;
+
+    void link(const ModuleSummary &summary) {
+        std::vector<uint32_t> nodes(summary.nodeCount);
+        for (uint32_t i = 0; i < summary.nodeCount; ++i) {
+            std::map<uint32_t, std::string>::const_iterator name = summary.linkNames.find(i);
+            if (name == summary.linkNames.end()) {
+                nodes[i] = this->newNode();
+                continue;
+            }
+            std::map<std::string, uint32_t>::iterator it = this->linkMap.find(name->second);
+            if (it != this->linkMap.end()) {
+                nodes[i] = it->second;
+            }
+            else {
+                nodes[i] = this->newNode();
+                this->linkMap[name->second] = nodes[i];
+            }
+        }
+
+        for (size_t i = 0; i < summary.constraints.size(); ++i) {
+            const ModuleSummary::Constraint &c = summary.constraints[i];
+            uint32_t dst = nodes[c.dst], src = nodes[c.src];
+            if (c.kind == ModuleSummary::AddressOf) {
+                this->pointToSets[dst].insert(src);
+                this->worklist.push_back(dst);
+            }
+            else if (c.kind == ModuleSummary::Copy) {
+                this->copyEdges[src].insert(dst);
+                this->worklist.push_back(src);
+            }
+            else if (c.kind == ModuleSummary::Load) {
+                this->loadEdges[src].push_back(dst);
+                this->worklist.push_back(src);
+            }
+            else {
+                this->storeEdges[dst].push_back(src);
+                this->worklist.push_back(dst);
+            }
+        }
+        for (size_t i = 0; i < summary.functions.size(); ++i) {
+            ModuleSummary::FunctionNodes fn = summary.functions[i];
+            fn.object = nodes[fn.object];
+            for (size_t a = 0; a < fn.args.size(); ++a)
+                fn.args[a] = nodes[fn.args[a]];
+            fn.ret = nodes[fn.ret];
+            // the same function from another module has the same nodes
+            this->functionMap.insert(std::make_pair(fn.object, fn));
+            if (fn.isDefined)
+                this->definedObjects.insert(fn.object);
+        }
+        for (size_t i = 0; i < summary.calls.size(); ++i) {
+            ModuleSummary::CallSite site = summary.calls[i];
+            site.callee = nodes[site.callee];
+            for (size_t a = 0; a < site.args.size(); ++a) {
+                if (site.args[a] != ModuleSummary::NO_NODE)
+                    site.args[a] = nodes[site.args[a]];
+            }
+            if (site.ret != ModuleSummary::NO_NODE)
+                site.ret = nodes[site.ret];
+            this->callEdges[site.callee].push_back(this->calls.size());
+            this->calls.push_back(site);
+            this->worklist.push_back(site.callee);
+        }
+        for (size_t i = 0; i < summary.libraryCalls.size(); ++i) {
+            ModuleSummary::LibraryCall lc = summary.libraryCalls[i];
+            lc.object = nodes[lc.object];
+            lc.ret = nodes[lc.ret];
+            this->libraryCalls.push_back(lc);
+        }
+        this->moduleNodes.push_back(nodes);
+    }
+
+    /// threadNum 0 is one per core
+    void solve(unsigned threadNum) {
+        if (threadNum == 0)
+            threadNum = std::max(1u, std::thread::hardware_concurrency());
+
+        // a function no linked module defines, like malloc, returns a new object
+        for (size_t i = 0; i < this->libraryCalls.size(); ++i) {
+            if (this->definedObjects.find(this->libraryCalls[i].object) != this->definedObjects.end())
+                continue;
+            uint32_t o = this->newNode();
+            this->pointToSets[this->libraryCalls[i].ret].insert(o);
+            this->worklist.push_back(this->libraryCalls[i].ret);
+        }
+        this->libraryCalls.clear();
+
+        std::vector<uint32_t> round;
+        round.swap(this->worklist);
+        while (true) {
+            std::sort(round.begin(), round.end());
+            round.erase(std::unique(round.begin(), round.end()), round.end());
+            if (round.empty())
+                break;
+
+            size_t roundThreads = std::min<size_t>(threadNum, (round.size() + ROUND_GRAIN - 1) / ROUND_GRAIN);
+            std::vector<std::vector<uint32_t>> nexts(roundThreads);
+            if (roundThreads == 1) {
+                for (size_t i = 0; i < round.size(); ++i)
+                    this->solveNode(round[i], nexts[0]);
+            }
+            else {
+                std::atomic<size_t> nextChunk(0);
+                std::vector<std::thread> threads;
+                for (size_t t = 0; t < roundThreads; ++t) {
+                    threads.push_back(std::thread([&, t]() {
+                        size_t first;
+                        while ((first = nextChunk.fetch_add(ROUND_GRAIN)) < round.size()) {
+                            size_t last = std::min(first + ROUND_GRAIN, round.size());
+                            for (size_t i = first; i < last; ++i)
+                                this->solveNode(round[i], nexts[t]);
+                        }
+                    }));
+                }
+                for (size_t t = 0; t < threads.size(); ++t) {
+                    threads[t].join();
+                }
+            }
+
+            round.clear();
+            for (size_t t = 0; t < nexts.size(); ++t)
+                round.insert(round.end(), nexts[t].begin(), nexts[t].end());
+        }
+    }
+
+    /// the function objects node points to
+    std::set<uint32_t> getFunctionObjects(uint32_t node) {
+        std::set<uint32_t> objects;
+        std::set<uint32_t>::iterator it;
+        for (it = this->pointToSets[node].begin(); it != this->pointToSets[node].end(); ++it) {
+            if (this->functionMap.find(*it) != this->functionMap.end())
+                objects.insert(*it);
+        }
+        return objects;
+    }
+    /// name of a function object from getFunctionObjects
+    const std::string &getFunctionName(uint32_t object) {
+        return this->functionMap.find(object)->second.name;
+    }
+
+    /// names of the functions node points to
+    std::set<std::string> getFunctionNames(uint32_t node) {
+        std::set<std::string> names;
+        std::set<uint32_t>::iterator it;
+        for (it = this->pointToSets[node].begin(); it != this->pointToSets[node].end(); ++it) {
+            std::map<uint32_t, ModuleSummary::FunctionNodes>::iterator fn = this->functionMap.find(*it);
+            if (fn != this->functionMap.end())
+                names.insert(fn->second.name);
+        }
+        return names;
+    }
+};
+
+///
+/// Reads every file in its own LLVMContext on a few threads, keeps only the summaries,
+/// then links and solves them. Prints "file:line : names" for every call line to os.
+/// The answers are coarser than the analysis of one module: no fields, no strong updates,
+/// no contexts. With rewrite, every file is read again and written back with the calls
+/// of a pointer to a single function calling it directly.
+///
+class WholeProgram {
+    // f(i) for i < count, on threadNum threads
+    static void forEachIndex(size_t count, size_t threadNum, const std::function<void(size_t)> &f) {
+        threadNum = std::min(threadNum, count);
+        std::atomic<size_t> next(0);
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < threadNum; ++t) {
+            threads.push_back(std::thread([&]() {
+                size_t i;
+                while ((i = next.fetch_add(1)) < count) {
+                    f(i);
+                }
+            }));
+        }
+        for (size_t t = 0; t < threads.size(); ++t) {
+            threads[t].join();
+        }
+    }
+    static void summarize(const std::string &path, ModuleSummary &summary) {
+        summary.path = path;
+
+        LLVMContext context;
+        SMDiagnostic err;
+        std::unique_ptr<Module> M = parseIRFile(path, err, context);
+        if (!M) {
+            raw_string_ostream os(summary.error);
+            err.print(NULL, os);
+            return;
+        }
+
+        promote(*M);
+        SummaryBuilder builder(summary);
+        builder.build(*M);
+    }
+    // the same SSA form as the single module analysis, promoted directly:
+    // the mem2reg pass skips the optnone functions of -O0
+    static void promote(Module &M) {
+        for (Function &F : M) {
+            if (F.isDeclaration())
+                continue;
+            std::vector<AllocaInst *> allocas;
+            for (Instruction &I : F.getEntryBlock()) {
+                AllocaInst *alloca = dyn_cast<AllocaInst>(&I);
+                if (alloca != NULL && isAllocaPromotable(alloca))
+                    allocas.push_back(alloca);
+            }
+            if (!allocas.empty()) {
+                DominatorTree DT(F);
+                PromoteMemToReg(allocas, DT);
+            }
+        }
+    }
+    // the walk of summarize again gives the same nodes, so the module is matched to its solved nodes
+    static void rewrite(const std::string &path, SummarySolver &solver, size_t moduleIndex, std::string &error) {
+        LLVMContext context;
+        SMDiagnostic err;
+        std::unique_ptr<Module> M = parseIRFile(path, err, context);
+        if (!M) {
+            raw_string_ostream os(error);
+            err.print(NULL, os);
+            return;
+        }
+
+        promote(*M);
+        ModuleSummary summary;
+        SummaryBuilder builder(summary);
+        builder.build(*M);
+        const std::vector<uint32_t> &nodes = solver.moduleNodes[moduleIndex];
+
+        for (Function &F : *M) {
+            for (BasicBlock &B : F) {
+                for (Instruction &I : B) {
+                    CallInst *call = dyn_cast<CallInst>(&I);
+                    if (call == NULL || isa<Function>(call->getCalledValue()->stripPointerCasts()))
+                        continue;
+                    uint32_t callee = builder.findNode(call->getCalledValue());
+                    if (callee == ModuleSummary::NO_NODE)
+                        continue;
+                    std::set<uint32_t> objects = solver.getFunctionObjects(nodes[callee]);
+                    if (objects.size() != 1)
+                        continue;
+
+                    // the target has to be named in this module, as the same object
+                    Function *target = M->getFunction(solver.getFunctionName(*objects.begin()));
+                    if (target == NULL)
+                        continue;
+                    uint32_t object = builder.findObjectNode(target);
+                    if (object == ModuleSummary::NO_NODE || nodes[object] != *objects.begin())
+                        continue;
+
+                    // keep the function type of the call
+                    Value *calledValue = target;
+                    if (target->getType() != call->getCalledValue()->getType())
+                        calledValue = ConstantExpr::getBitCast(target, call->getCalledValue()->getType());
+                    call->setCalledFunction(call->getFunctionType(), calledValue);
+                }
+            }
+        }
+
+        std::error_code EC;
+        raw_fd_ostream os(path, EC, sys::fs::F_None);
+        if (EC) {
+            error = path + ": " + EC.message() + "\n";
+            return;
+        }
+        legacy::PassManager writePasses;
+        writePasses.add(createBitcodeWriterPass(os));
+        writePasses.run(*M);
+    }
+    // line -> names of the functions called there, in module moduleIndex of the solver
+    static std::map<unsigned, std::set<std::string>> getLineNames(SummarySolver &solver, const ModuleSummary &summary,
+                                                                  size_t moduleIndex) {
+        std::map<unsigned, std::set<std::string>> lineNames;
+        const std::vector<ModuleSummary::LineCall> &lines = summary.lines;
+        for (size_t l = 0; l < lines.size(); ++l) {
+            std::set<std::string> names = solver.getFunctionNames(solver.moduleNodes[moduleIndex][lines[l].callee]);
+            lineNames[lines[l].line].insert(names.begin(), names.end());
+        }
+        return lineNames;
+    }
+public:
+    /// the inclusion constraints of one loaded module, solved on threadNum threads (0 = one per core)
+    static std::map<unsigned, std::set<std::string>> solveModule(Module &M, unsigned threadNum) {
+        ModuleSummary summary;
+        promote(M);
+        SummaryBuilder builder(summary);
+        builder.build(M);
+
+        SummarySolver solver;
+        solver.link(summary);
+        solver.solve(threadNum);
+        return getLineNames(solver, summary, 0);
+    }
+    /// threadNum threads read, solve and rewrite the files (0 = one per core)
+    static bool run(const std::vector<std::string> &paths, unsigned threadNum, bool isRewrite, raw_ostream &os) {
+        if (threadNum == 0)
+            threadNum = std::max(1u, std::thread::hardware_concurrency());
+
+        std::vector<ModuleSummary> summaries(paths.size());
+        forEachIndex(paths.size(), threadNum, [&](size_t i) {
+            summarize(paths[i], summaries[i]);
+        });
+
+        SummarySolver solver;
+        for (size_t i = 0; i < summaries.size(); ++i) {
+            if (summaries[i].error != "") {
+                os << summaries[i].error;
+                return false;
+            }
+            solver.link(summaries[i]);
+        }
+        solver.solve(threadNum);
+
+        for (size_t i = 0; i < summaries.size(); ++i) {
+            std::map<unsigned, std::set<std::string>> lineNames = getLineNames(solver, summaries[i], i);
+            std::map<unsigned, std::set<std::string>>::iterator it;
+            for (it = lineNames.begin(); it != lineNames.end(); ++it) {
+                os << summaries[i].path << ":" << it->first << " : ";
+                std::set<std::string>::iterator name;
+                for (name = it->second.begin(); name != it->second.end(); ++name) {
+                    if (name != it->second.begin())
+                        os << ", ";
+                    os << *name;
+                }
+                os << "\n";
+            }
+        }
+        os << "\n";
+
+        if (isRewrite) {
+            std::vector<std::string> errors(paths.size());
+            forEachIndex(paths.size(), threadNum, [&](size_t i) {
+                rewrite(paths[i], solver, i, errors[i]);
+            });
+            for (size_t i = 0; i < errors.size(); ++i) {
+                if (errors[i] != "") {
+                    os << errors[i];
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+};
+
+#endif /* !_WHOLEPROGRAM_H_ */